@@ -69,6 +69,27 @@ bool MapFile::create(const std::string &name) {
 
 }
 
+bool MapFile::open(const std::string &name) {
+
+    if ( !boost::filesystem::exists(name) ) return false ;
+
+    db_ = new SQLite::Database(name) ;
+
+    SQLite::Session session(db_) ;
+    SQLite::Connection &con = session.handle() ;
+
+    try {
+        con.exec("PRAGMA synchronous=NORMAL") ;
+        con.exec("PRAGMA journal_mode=WAL") ;
+
+        return true ;
+    }
+    catch ( SQLite::Exception & )
+    {
+        return false ;
+    }
+}
+
 bool MapFile::hasLayer(const std::string &layerName) const
 {
     SQLite::Session session(db_) ;
@@ -104,10 +125,14 @@ bool MapFile::createLayerTable(const std::string &layerName, const string &layer
         string sql ;
 
         sql = "CREATE TABLE ";
-        sql +=  layerName + "(gid INTEGER PRIMARY KEY AUTOINCREMENT, tags TEXT)" ;
+        sql +=  layerName + "(gid INTEGER PRIMARY KEY AUTOINCREMENT, tags TEXT, osm_type INTEGER, osm_id INTEGER)" ;
 
         SQLite::Command(con, sql).exec() ;
 
+        // index of source features used by incremental updates (NULL for other sources)
+
+        con.exec("CREATE INDEX %q_osm_idx ON %q(osm_type, osm_id);", layerName.c_str(), layerName.c_str()) ;
+
         // Add geometry column
 
         sql = "SELECT AddGeometryColumn( '"  ;
@@ -144,9 +169,11 @@ string MapFile::insertFeatureSQL(const string &layerName, const string &geomCmd
     sql = "INSERT INTO " ;
     sql += layerName ;
     sql += "(" + geom_column_name_ ;
-    sql += ",tags" ;
+    sql += ",tags,osm_type,osm_id" ;
+
+    // the feature key (parameters 3 and 4) is left NULL if not bound
 
-    sql += ") VALUES (" + geomCmd + ",?)";
+    sql += ") VALUES (" + geomCmd + ",?,?,?)";
     return sql ;
 }
 
@@ -26,6 +26,10 @@ public:
 
     bool create(const string &filePath) ;
 
+    // Open an existing database e.g. to update it.
+
+    bool open(const string &filePath) ;
+
     // Get handle to database
 
     SQLite::Database &handle() const { return *db_ ; }
@@ -39,22 +43,59 @@ public:
                                  const std::string &geomCmd = "?") ;
 
     bool processOsmFiles(const vector<string> &files, const ImportConfig &cfg) ;
+
+    // Apply the OSM change files to the base file (see OSM::Document::read) and replace the rows of all features
+    // affected by the changes. The extents (EPSG:3857) of the replaced and of the new rows are appended to dirty.
+
+    bool updateOsmFiles(const string &baseFile, const vector<string> &changeFiles, const ImportConfig &cfg,
+                        vector<BBox> &dirty) ;
     bool processShpFile(const string &file_name, const string &table_name, int srid, const string &char_enc) ;
 
     bool queryTile(const MapConfig &cfg, VectorTileWriter &tile) const ;
 
+    // features of a document to process, indexed as the document entities
+    struct FeatureMask {
+        vector<bool> nodes_, ways_, relations_ ;
+    };
+
+    // rows are keyed by the type (OSM::Feature::Type) and id of the OSM feature they were created from
+    typedef std::pair<int, int64_t> FeatureKey ;
+
+    // row of a layer table created from an OSM feature
+    struct FeatureRow {
+        std::vector<unsigned char> geom_ ; // spatialite blob in EPSG:4326
+        string tags_ ; // serialized tags, empty if none
+        FeatureKey key_ ;
+    };
+
+    // rows produced for a layer from one document, encoded without access to the database
+    struct LayerRows {
+        LayerRows(): layer_(nullptr) {}
+
+        const OSM::Filter::LayerDefinition *layer_ ;
+        vector<FeatureRow> rows_ ;
+    };
+
 private:
 
-    bool addOSMLayerPoints(OSM::Document &doc, const OSM::Filter::LayerDefinition *layer,
-                           const vector<NodeRuleMap > &node_idxs) ;
+    static void processOsmDocument(OSM::Document &doc, const ImportConfig &cfg, const FeatureMask *mask,
+                                   vector<LayerRows> &batches) ;
+
+    bool writeLayerRows(const LayerRows &batch) ;
+
+    void queryFeatureExtents(const ImportConfig &cfg, const vector<FeatureKey> &keys, vector<BBox> &boxes) ;
+    void deleteFeatures(const ImportConfig &cfg, const vector<FeatureKey> &keys) ;
+
+    static bool addOSMLayerPoints(OSM::Document &doc, const OSM::Filter::LayerDefinition *layer,
+                           const vector<NodeRuleMap > &node_idxs, LayerRows &batch) ;
 
-    bool addOSMLayerLines(OSM::Document &doc, const OSM::Filter::LayerDefinition *layer,
+    static bool addOSMLayerLines(OSM::Document &doc, const OSM::Filter::LayerDefinition *layer,
                           const vector<NodeRuleMap> &way_idxs,
                           vector<OSM::Way> &chunk_list,
-                          const vector<NodeRuleMap > &rule_map) ;
+                          const vector<NodeRuleMap > &rule_map, LayerRows &batch) ;
 
-    bool addOSMLayerPolygons(const OSM::Document &doc, const OSM::Filter::LayerDefinition *layer,
-                             vector<OSM::Polygon> &polygons, const vector<NodeRuleMap > &poly_idxs) ;
+    static bool addOSMLayerPolygons(const OSM::Document &doc, const OSM::Filter::LayerDefinition *layer,
+                             vector<OSM::Polygon> &polygons, const vector<NodeRuleMap > &poly_idxs, LayerRows &batch) ;
 
     static string serializeTags(const Dictionary &tags) ;
     static void deserializeTags(const std::string &src, Dictionary &tags) ;
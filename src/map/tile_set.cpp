@@ -0,0 +1,34 @@
+#include "tile_set.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+using namespace std ;
+
+// pixel coordinate to tile index, clamped to the tiles of the zoom level
+
+static uint32_t pixel_to_tile(double p, uint32_t zoom)
+{
+    int64_t n = int64_t(1) << zoom ;
+    int64_t t = (int64_t)floor(p / 256.0) ;
+
+    return (uint32_t)std::min(std::max(t, (int64_t)0), n - 1) ;
+}
+
+void TileSet::addBox(const BBox &box, uint32_t minz, uint32_t maxz, uint32_t buffer)
+{
+    for( uint32_t z = minz ; z <= maxz ; z++ )
+    {
+        double px0, py0, px1, py1 ;
+
+        tms::metersToPixels(box.minx_, box.miny_, z, px0, py0) ;
+        tms::metersToPixels(box.maxx_, box.maxy_, z, px1, py1) ;
+
+        uint32_t x0 = pixel_to_tile(px0 - buffer, z), y0 = pixel_to_tile(py0 - buffer, z) ;
+        uint32_t x1 = pixel_to_tile(px1 + buffer, z), y1 = pixel_to_tile(py1 + buffer, z) ;
+
+        for( uint32_t x = x0 ; x <= x1 ; x++ )
+            for( uint32_t y = y0 ; y <= y1 ; y++ )
+                add(z, x, y) ;
+    }
+}
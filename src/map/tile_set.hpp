@@ -0,0 +1,47 @@
+#ifndef __TILE_SET_H__
+#define __TILE_SET_H__
+
+#include <set>
+#include <tuple>
+#include <cstdint>
+#include <cstddef>
+
+#include "geom_helpers.hpp"
+
+// Set of tile coordinates (TMS scheme), e.g. the tiles touched by an incremental update that have to be regenerated
+
+struct TileKey {
+    TileKey(uint32_t z, uint32_t x, uint32_t y): z_(z), x_(x), y_(y) {}
+
+    bool operator < (const TileKey &other) const {
+        return std::tie(z_, x_, y_) < std::tie(other.z_, other.x_, other.y_) ;
+    }
+
+    uint32_t z_, x_, y_ ;
+};
+
+class TileSet {
+public:
+
+    TileSet() {}
+
+    void add(uint32_t z, uint32_t x, uint32_t y) { tiles_.insert(TileKey(z, x, y)) ; }
+
+    // add the tiles of zoom levels minz to maxz whose area, extended by buffer pixels on each side, intersects the
+    // given box in mercator meters
+    void addBox(const BBox &box, uint32_t minz, uint32_t maxz, uint32_t buffer) ;
+
+    bool contains(uint32_t z, uint32_t x, uint32_t y) const { return tiles_.count(TileKey(z, x, y)) != 0 ; }
+
+    size_t size() const { return tiles_.size() ; }
+    bool empty() const { return tiles_.empty() ; }
+
+    std::set<TileKey>::const_iterator begin() const { return tiles_.begin() ; }
+    std::set<TileKey>::const_iterator end() const { return tiles_.end() ; }
+
+private:
+
+    std::set<TileKey> tiles_ ;
+};
+
+#endif
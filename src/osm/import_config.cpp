@@ -47,6 +47,22 @@ bool ImportConfig::parse(const string &fileName)
 
     layers_ = parser.layers_ ;
 
+    // keys tested by the conditions and the action expressions, plus those the processor uses to select relations and
+    // decide whether closed ways are lines or polygons
+
+    tag_filter_.reset(new OSM::TagFilter({"type", "area", "highway", "barrier", "contour"})) ;
+
+    for( const OSM::Filter::LayerDefinition *layer = layers_ ; layer ; layer = layer->next_ )
+    {
+        for( const OSM::Filter::Rule *r = layer->rules_ ; r ; r = r->next_ )
+        {
+            if ( r->node_ ) r->node_->addKeys(*tag_filter_) ;
+
+            for( const OSM::Filter::Command *action = r->actions_ ; action ; action = action->next_ )
+                if ( action->expression_ ) action->expression_->addKeys(*tag_filter_) ;
+        }
+    }
+
     return true ;
 }
 
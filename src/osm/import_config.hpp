@@ -5,6 +5,7 @@
 
 #include "osm_rule_parser.hpp"
 #include "osm_document.hpp"
+#include "osm_rule_profiler.hpp"
 
 struct Action {
     std::string key_ ;
@@ -12,15 +13,28 @@ struct Action {
 };
 
 struct NodeRuleMap {
+    NodeRuleMap(): node_idx_(0), modified_(false) {}
+
     int node_idx_ ;
     std::vector<const OSM::Filter::Rule *> matched_rules_ ;
+    bool modified_ ; // the set-tag actions of the matched rules changed the tags of the feature to tags_
+    OSM::TagList tags_ ;
 };
 
 struct ImportConfig {
-    ImportConfig(){}
+    ImportConfig(): streaming_(false), pbf_index_(false), snapshot_(false), max_concurrent_files_(1) {}
 
     OSM::Filter::LayerDefinition *layers_ ;
 
+    std::string node_locations_file_ ; // if set node coordinates are kept in a memory mapped file at this path
+    bool streaming_ ; // two-pass import keeping only the features matched by the layer rules and the nodes they reference
+    std::shared_ptr<OSM::ClipRegion> clip_ ; // if set only the features within this region are imported
+    bool pbf_index_ ; // use (and create if needed) block index files next to PBF inputs
+    bool snapshot_ ; // restore (and save if needed) binary snapshots of the documents next to the inputs
+    unsigned int max_concurrent_files_ ; // number of input files read and evaluated in parallel, bounds memory use
+    std::shared_ptr<OSM::TagFilter> tag_filter_ ; // keys read by the rules or the processor, other tags are dropped when reading
+    std::shared_ptr<OSM::Filter::RuleProfiler> profiler_ ; // if set, statistics of the layer rules are collected
+
     bool parse(const std::string &fileName) ;
 };
 
@@ -108,8 +108,8 @@ rule_list: rule { $$ = $1 ; }
 		  | rule rule_list { $$ = $1 ; $$->next_ = $2 ; }
 ;
 
-rule: boolean_value_expression action_block { $$ = new OSM::Filter::Rule{$1, $2} ; }
-	  | action_block { $$ = new OSM::Filter::Rule{nullptr, $1} ; }
+rule: boolean_value_expression action_block { $$ = new OSM::Filter::Rule{$1, $2} ; $$->line_ = @$.begin.line ; }
+	  | action_block { $$ = new OSM::Filter::Rule{nullptr, $1} ; $$->line_ = @$.begin.line ; }
 ;
 
 
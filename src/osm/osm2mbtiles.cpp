@@ -3,6 +3,7 @@
 #include "map_config.hpp"
 #include "map_file.hpp"
 #include "mb_tile_writer.hpp"
+#include "tile_set.hpp"
 
 #include <boost/filesystem.hpp>
 
@@ -10,14 +11,17 @@ using namespace std ;
 
 void printUsageAndExit()
 {
-    cerr << "Usage: osm2mbtiles --import <config_file> --options <options_file> --out <tileset> <file_name>+" << endl ;
+    cerr << "Usage: osm2mbtiles --import <config_file> --options <options_file> --out <tileset> [--map-file <file>] [--node-locations <file>] [--streaming] [--clip | --clip-poly <poly_file>] [--pbf-index] [--snapshot] [--jobs <n>] [--profile] <file_name>+" << endl ;
+    cerr << "       osm2mbtiles --update --import <config_file> --options <options_file> --out <tileset> --map-file <file> [--node-locations <file>] [--profile] <base_file> <change_file>+" << endl ;
     exit(1) ;
 }
 
 int main(int argc, char *argv[])
 {
-    string mapFile, mapConfigFile, importConfigFile, tileSet ;
+    string mapFile, mapConfigFile, importConfigFile, tileSet, nodeLocationsFile, clipPolyFile ;
     vector<string> osmFiles ;
+    bool streaming = false, clip = false, pbfIndex = false, snapshot = false, update = false, profile = false ;
+    unsigned int jobs = 1 ;
 
     for( int i=1 ; i<argc ; i++ )
     {
@@ -35,6 +39,40 @@ int main(int argc, char *argv[])
             if ( i++ == argc ) printUsageAndExit() ;
             tileSet = argv[i] ;
         }
+        else if ( arg == "--node-locations" ) {
+            if ( i++ == argc ) printUsageAndExit() ;
+            nodeLocationsFile = argv[i] ;
+        }
+        else if ( arg == "--map-file" ) {
+            if ( i++ == argc ) printUsageAndExit() ;
+            mapFile = argv[i] ;
+        }
+        else if ( arg == "--jobs" ) {
+            if ( i++ == argc ) printUsageAndExit() ;
+            jobs = std::max(1, atoi(argv[i])) ;
+        }
+        else if ( arg == "--update" ) {
+            update = true ;
+        }
+        else if ( arg == "--streaming" ) {
+            streaming = true ;
+        }
+        else if ( arg == "--pbf-index" ) {
+            pbfIndex = true ;
+        }
+        else if ( arg == "--snapshot" ) {
+            snapshot = true ;
+        }
+        else if ( arg == "--profile" ) {
+            profile = true ;
+        }
+        else if ( arg == "--clip" ) {
+            clip = true ;
+        }
+        else if ( arg == "--clip-poly" ) {
+            if ( i++ == argc ) printUsageAndExit() ;
+            clipPolyFile = argv[i] ;
+        }
 
         else
             osmFiles.push_back(argv[i]) ;
@@ -43,15 +81,22 @@ int main(int argc, char *argv[])
     if ( importConfigFile.empty() ||  mapConfigFile.empty() || osmFiles.empty() )
         printUsageAndExit() ;
 
-    boost::filesystem::path tmp_dir = boost::filesystem::temp_directory_path() ;
-    boost::filesystem::path tmp_file = boost::filesystem::unique_path("%%%%%.sqlite");
+    // updates are applied to the map file and tileset of a previous import
+
+    if ( update && ( mapFile.empty() || osmFiles.size() < 2 ) )
+        printUsageAndExit() ;
+
+    if ( mapFile.empty() ) {
+        boost::filesystem::path tmp_dir = boost::filesystem::temp_directory_path() ;
+        boost::filesystem::path tmp_file = boost::filesystem::unique_path("%%%%%.sqlite");
 
-    mapFile = ( tmp_dir / tmp_file ).native() ;
+        mapFile = ( tmp_dir / tmp_file ).native() ;
+    }
 
     cout << mapFile << endl ;
     MapFile gfile ;
 
-    if ( !gfile.create(mapFile) ) {
+    if ( update ? !gfile.open(mapFile) : !gfile.create(mapFile) ) {
         cerr << "can't open map file: " << mapFile << endl ;
         exit(1) ;
     }
@@ -62,12 +107,72 @@ int main(int argc, char *argv[])
         return 0 ;
     }
 
+    icfg.node_locations_file_ = nodeLocationsFile ;
+    icfg.streaming_ = streaming ;
+    icfg.pbf_index_ = pbfIndex ;
+    icfg.snapshot_ = snapshot ;
+    icfg.max_concurrent_files_ = jobs ;
+
+    if ( profile ) icfg.profiler_.reset(new OSM::Filter::RuleProfiler(icfg.layers_)) ;
+
     MapConfig mcfg ;
     if ( !mcfg.parse(mapConfigFile) ) {
         cerr << "Error parsing map configuration file: " << mapConfigFile << endl ;
         return 0 ;
     }
 
+    // discard input outside the clip polygon or the bounding box of the map
+
+    if ( !clipPolyFile.empty() ) {
+        icfg.clip_.reset(new OSM::ClipRegion) ;
+        if ( !icfg.clip_->readPolyFile(clipPolyFile) ) {
+            cerr << "Error parsing clip polygon file: " << clipPolyFile << endl ;
+            return 0 ;
+        }
+    }
+    else if ( clip ) {
+        if ( !mcfg.has_bbox_ ) {
+            cerr << "No bounding box defined in map configuration file: " << mapConfigFile << endl ;
+            return 0 ;
+        }
+
+        double min_lat, min_lon, max_lat, max_lon ;
+        tms::metersToLatLon(mcfg.bbox_.minx_, mcfg.bbox_.miny_, min_lat, min_lon) ;
+        tms::metersToLatLon(mcfg.bbox_.maxx_, mcfg.bbox_.maxy_, max_lat, max_lon) ;
+
+        icfg.clip_.reset(new OSM::ClipRegion(min_lat, min_lon, max_lat, max_lon)) ;
+    }
+
+    if ( update ) {
+        vector<BBox> dirty ;
+        vector<string> changeFiles(osmFiles.begin() + 1, osmFiles.end()) ;
+
+        if ( !gfile.updateOsmFiles(osmFiles[0], changeFiles, icfg, dirty) ) {
+            cerr << "Error while updating spatialite database" << endl ;
+            return 0 ;
+        }
+
+        if ( icfg.profiler_ ) icfg.profiler_->report(cout) ;
+
+        // regenerate the tiles whose area, including the buffer used by queryTile, meets an old or new feature
+
+        TileSet tiles ;
+
+        for( const BBox &box: dirty )
+            tiles.addBox(box, mcfg.minz_, mcfg.maxz_, 16) ;
+
+        cout << "Updating " << tiles.size() << " tiles" << endl ;
+
+        MBTileWriter twriter(tileSet, true) ;
+
+        if ( boost::filesystem::is_directory(tileSet) )
+            twriter.writeTilesFolder(gfile, mcfg, tiles) ;
+        else
+            twriter.writeTilesDB(gfile, mcfg, tiles) ;
+
+        return 1 ;
+    }
+
     for( OSM::Filter::LayerDefinition *layer = icfg.layers_ ; layer ; layer = layer->next_)  {
         if ( ! gfile.createLayerTable(layer->name_, layer->type_, layer->srid_ ) ) {
             cerr << "Failed to create layer " << layer->name_ << ", skipping" ;
@@ -80,6 +185,8 @@ int main(int argc, char *argv[])
         return 0 ;
     }
 
+    if ( icfg.profiler_ ) icfg.profiler_->report(cout) ;
+
     MBTileWriter twriter(tileSet) ;
 
 
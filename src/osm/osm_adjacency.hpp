@@ -0,0 +1,101 @@
+#ifndef __OSM_ADJACENCY_H__
+#define __OSM_ADJACENCY_H__
+
+#include <vector>
+#include <cstddef>
+#include <sys/types.h>
+
+namespace OSM {
+
+// Read-only view of a contiguous range of values
+
+template<class T>
+class Span {
+public:
+
+    Span(): begin_(nullptr), end_(nullptr) {}
+    Span(const T *begin, const T *end): begin_(begin), end_(end) {}
+
+    const T *begin() const { return begin_ ; }
+    const T *end() const { return end_ ; }
+
+    size_t size() const { return end_ - begin_ ; }
+    bool empty() const { return begin_ == end_ ; }
+
+    const T &operator[](size_t i) const { return begin_[i] ; }
+    const T &front() const { return *begin_ ; }
+    const T &back() const { return *(end_ - 1) ; }
+
+private:
+
+    const T *begin_, *end_ ;
+};
+
+// One-to-many relationship between document entities in compressed sparse row form, i.e. the values of entity i are
+// values_[offsets_[i]] to values_[offsets_[i+1]-1]. The whole relationship takes two allocations instead of one per
+// entity. It is filled entity by entity with push() and close(), or as the inverse of another relationship.
+
+template<class T>
+class Adjacency {
+public:
+
+    Adjacency(): offsets_(1, 0) {}
+
+    void clear() {
+        offsets_.assign(1, 0) ;
+        values_.clear() ;
+    }
+
+    void reserve(size_t n_entities, size_t n_values) {
+        offsets_.reserve(n_entities + 1) ;
+        values_.reserve(n_values) ;
+    }
+
+    // number of entities
+    size_t size() const { return offsets_.size() - 1 ; }
+
+    // append a value to the current entity, close() starts the next entity
+    void push(const T &v) { values_.push_back(v) ; }
+    void close() { offsets_.push_back(values_.size()) ; }
+
+    // the values of an entity, invalidated by push
+    Span<T> operator[](size_t i) const {
+        return Span<T>(values_.data() + offsets_[i], values_.data() + offsets_[i+1]) ;
+    }
+
+    // make this the inverse of a relationship whose values are indices in [0, n), values of each entity are kept
+    // in increasing order
+    void invert(const Adjacency<uint> &other, size_t n) {
+        offsets_.assign(n + 1, 0) ;
+
+        for( uint v: other.values_ ) ++offsets_[v + 1] ;
+        for( size_t i=0 ; i<n ; i++ ) offsets_[i + 1] += offsets_[i] ;
+
+        values_.resize(other.values_.size()) ;
+
+        std::vector<size_t> pos(offsets_.begin(), offsets_.end() - 1) ;
+
+        for( size_t i=0 ; i<other.size() ; i++ )
+            for( uint v: other[i] ) values_[pos[v]++] = i ;
+    }
+
+    // the underlying arrays, used to save and restore the relationship as a whole
+    const std::vector<size_t> &offsets() const { return offsets_ ; }
+    const std::vector<T> &values() const { return values_ ; }
+
+    void assign(std::vector<size_t> &&offsets, std::vector<T> &&values) {
+        offsets_ = std::move(offsets) ;
+        values_ = std::move(values) ;
+    }
+
+private:
+
+    template<class U> friend class Adjacency ;
+
+    std::vector<size_t> offsets_ ;
+    std::vector<T> values_ ;
+};
+
+}
+
+#endif
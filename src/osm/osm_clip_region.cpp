@@ -0,0 +1,106 @@
+#include "osm_clip_region.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <limits>
+
+#include <boost/algorithm/string.hpp>
+
+using namespace std ;
+
+namespace OSM {
+
+ClipRegion::ClipRegion(): min_lat_(-90), min_lon_(-180), max_lat_(90), max_lon_(180) {}
+
+ClipRegion::ClipRegion(double min_lat, double min_lon, double max_lat, double max_lon):
+    min_lat_(min_lat), min_lon_(min_lon), max_lat_(max_lat), max_lon_(max_lon) {}
+
+void ClipRegion::addRing(const vector<Point> &ring)
+{
+    if ( ring.size() < 3 ) return ;
+
+    if ( rings_.empty() ) {
+        min_lat_ = min_lon_ = std::numeric_limits<double>::max() ;
+        max_lat_ = max_lon_ = -std::numeric_limits<double>::max() ;
+    }
+
+    for( const Point &p: ring ) {
+        min_lat_ = std::min(min_lat_, p.lat_) ;
+        max_lat_ = std::max(max_lat_, p.lat_) ;
+        min_lon_ = std::min(min_lon_, p.lon_) ;
+        max_lon_ = std::max(max_lon_, p.lon_) ;
+    }
+
+    rings_.push_back(ring) ;
+}
+
+// The file consists of a name line followed by sections, each one a section name, a list of "lon lat" lines and an
+// END line. Section names starting with '!' denote holes. A final END line closes the file.
+
+bool ClipRegion::readPolyFile(const string &fileName)
+{
+    ifstream strm(fileName.c_str()) ;
+
+    if ( !strm ) return false ;
+
+    string line ;
+
+    // polygon name
+    if ( !getline(strm, line) ) return false ;
+
+    while ( getline(strm, line) )
+    {
+        boost::trim(line) ;
+
+        if ( line.empty() ) continue ;
+        if ( line == "END" ) return !rings_.empty() ;
+
+        // section name, read coordinates up to the closing END
+
+        vector<Point> ring ;
+
+        while ( true )
+        {
+            if ( !getline(strm, line) ) return false ;
+
+            boost::trim(line) ;
+
+            if ( line.empty() ) continue ;
+            if ( line == "END" ) break ;
+
+            istringstream coords(line) ;
+            Point p ;
+
+            if ( !( coords >> p.lon_ >> p.lat_ ) ) return false ;
+
+            ring.push_back(p) ;
+        }
+
+        addRing(ring) ;
+    }
+
+    return false ;
+}
+
+// even-odd crossing test over all rings
+
+bool ClipRegion::insidePolygon(double lat, double lon) const
+{
+    bool inside = false ;
+
+    for( const vector<Point> &ring: rings_ )
+    {
+        for( size_t i=0, j=ring.size()-1 ; i<ring.size() ; j = i++ )
+        {
+            const Point &p = ring[i], &q = ring[j] ;
+
+            if ( ( p.lat_ > lat ) != ( q.lat_ > lat ) &&
+                 lon < ( q.lon_ - p.lon_ ) * ( lat - p.lat_ ) / ( q.lat_ - p.lat_ ) + p.lon_ )
+                inside = !inside ;
+        }
+    }
+
+    return inside ;
+}
+
+}
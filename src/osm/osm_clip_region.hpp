@@ -0,0 +1,52 @@
+#ifndef __OSM_CLIP_REGION_H__
+#define __OSM_CLIP_REGION_H__
+
+#include <string>
+#include <vector>
+
+namespace OSM {
+
+// Area of interest used to discard nodes while reading a document. It is a lat/lon bounding box optionally refined
+// by a polygon, whose rings are combined with the even-odd rule so that holes need no special treatment. The box is
+// tested first so that the polygon is only evaluated for the (few) nodes near the area.
+
+class ClipRegion {
+public:
+
+    struct Point {
+        double lat_, lon_ ;
+    };
+
+    // box covering the whole world
+    ClipRegion() ;
+
+    // box in degrees
+    ClipRegion(double min_lat, double min_lon, double max_lat, double max_lon) ;
+
+    // read polygon in the Osmosis polygon filter format (.poly), the box is set to the polygon extent
+    bool readPolyFile(const std::string &fileName) ;
+
+    // add polygon ring and extend the box to the extent of all rings
+    void addRing(const std::vector<Point> &ring) ;
+
+    bool contains(double lat, double lon) const {
+        if ( lat < min_lat_ || lat > max_lat_ || lon < min_lon_ || lon > max_lon_ ) return false ;
+        return rings_.empty() || insidePolygon(lat, lon) ;
+    }
+
+    // test the box (in degrees) against the region box, i.e. false only if the box has no point in the region
+    bool intersects(double min_lat, double min_lon, double max_lat, double max_lon) const {
+        return min_lat <= max_lat_ && max_lat >= min_lat_ && min_lon <= max_lon_ && max_lon >= min_lon_ ;
+    }
+
+private:
+
+    bool insidePolygon(double lat, double lon) const ;
+
+    double min_lat_, min_lon_, max_lat_, max_lon_ ;
+    std::vector< std::vector<Point> > rings_ ;
+};
+
+}
+
+#endif
@@ -1,11 +1,14 @@
 #include "osm_document.hpp"
 #include "osm_rule_parser.hpp"
+#include "osm_id_index.hpp"
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <iostream>
 #include <iomanip>
 #include <set>
+#include <map>
 
 #include "xml_reader.hpp"
 #include "zfstream.hpp"
@@ -16,278 +19,791 @@ using namespace std ;
 
 namespace OSM {
 
-bool Document::readXML(istream &strm)
+const TagList NodeStore::empty_tags_ ;
+
+void NodeStore::clear()
 {
-    XmlReader rd(strm) ;
+    ids_.clear() ;
+    lat_.clear() ;
+    lon_.clear() ;
+    tagged_.clear() ;
+    tags_.clear() ;
+}
+
+bool NodeStore::append(NodeStore &other)
+{
+    uint offset = ids_.size() ;
+
+    if ( locations_ || other.locations_ ) {
+        for( uint i=0 ; i<other.size() ; i++ ) {
+            int32_t lat, lon ;
+            other.getFixed(i, lat, lon) ;
+            if ( !addFixed(other.ids_[i], lat, lon) ) return false ;
+        }
+    }
+    else {
+        ids_.insert(ids_.end(), other.ids_.begin(), other.ids_.end()) ;
+        lat_.insert(lat_.end(), other.lat_.begin(), other.lat_.end()) ;
+        lon_.insert(lon_.end(), other.lon_.begin(), other.lon_.end()) ;
+    }
+
+    for( uint idx: other.tagged_ )
+        tagged_.push_back(idx + offset) ;
+
+    tags_.insert(tags_.end(), std::make_move_iterator(other.tags_.begin()), std::make_move_iterator(other.tags_.end())) ;
+
+    other.clear() ;
+
+    return true ;
+}
+
+Node NodeStore::node(uint idx) const
+{
+    Node n ;
+
+    int32_t lat, lon ;
+    getFixed(idx, lat, lon) ;
 
-    map<string, uint> nodeMap, wayMap, relMap ;
-    vector<  vector<string> > wayNodeMap, relNodeMap, relWayMap, relRelMap ;
-    vector<  vector<string> > relNodeMapRole, relWayMapRole, relRelMapRole ;
+    n.id_ = ids_[idx] ;
+    n.lat_ = fromFixed(lat) ;
+    n.lon_ = fromFixed(lon) ;
 
-    if ( !rd.readNextStartElement("osm") ) return false ;
+    const TagList *tags = findTags(idx) ;
+    if ( tags ) n.tags_ = *tags ;
+
+    return n ;
+}
+
+// attribute values are references into the reader buffer and are not null terminated
+
+static int64_t to_int64(boost::string_ref s)
+{
+    char buf[32] ;
+    size_t n = std::min(s.size(), sizeof(buf) - 1) ;
+    memcpy(buf, s.data(), n) ; buf[n] = 0 ;
+
+    return strtoll(buf, nullptr, 10) ;
+}
+
+static double to_double(boost::string_ref s)
+{
+    char buf[64] ;
+    size_t n = std::min(s.size(), sizeof(buf) - 1) ;
+    memcpy(buf, s.data(), n) ; buf[n] = 0 ;
+
+    return atof(buf) ;
+}
+
+static uint32_t intern(boost::string_ref s, string &scratch)
+{
+    scratch.assign(s.data(), s.size()) ;
+    return StringPool::intern(scratch) ;
+}
+
+// intern the key and value of a tag element, returns false if the tag is dropped by the filter
+
+static bool internTag(XmlReader &rd, const TagFilter *filter, string &scratch, uint32_t &key, uint32_t &val)
+{
+    boost::string_ref k = rd.attributeRef("k") ;
+    scratch.assign(k.data(), k.size()) ;
+
+    if ( filter && !filter->accepts(scratch) ) return false ;
+
+    key = StringPool::intern(scratch) ;
+    val = intern(rd.attributeRef("v"), scratch) ;
+
+    return true ;
+}
+
+bool Document::readXML(XmlReader &rd, References &refs, int what, const NodePredicate &keep_node, const ClipRegion *clip)
+{
+    string scratch ;
+
+    const TagFilter *filter = tag_filter_.get() ;
+
+    // change files have an osmChange root with the entities grouped in create, modify and delete sections
+
+    if ( !rd.readNextStartElement() ) return false ;
+
+    bool is_change = rd.nodeName() == "osmChange" ;
+    bool deleted = false ;
+
+    if ( !is_change && rd.nodeName() != "osm" ) return false ;
 
     while ( rd.read() )
     {
         if ( rd.readNextStartElement() )
         {
-            if ( rd.nodeName() == "node" )
+            if ( is_change && ( rd.nodeName() == "create" || rd.nodeName() == "modify" || rd.nodeName() == "delete" ) )
+            {
+                deleted = rd.nodeName() == "delete" ;
+            }
+            else if ( rd.nodeName() == "node" )
             {
-                Node node ;
+                boost::string_ref id = rd.attributeRef("id") ;
+
+                if ( id.empty() ) return false ;
 
-                node.id_ = rd.attribute("id") ;
+                int64_t node_id = to_int64(id) ;
+                double lat = to_double(rd.attributeRef("lat")) ;
+                double lon = to_double(rd.attributeRef("lon")) ;
 
-                if ( node.id_.empty() ) return false ;
+                // tags of discarded nodes are not interned
+                bool keep = ( what & LoadNodes ) && ( !clip || clip->contains(lat, lon) ) ;
 
-                node.lat_ = atof(rd.attribute("lat").c_str()) ;
-                node.lon_ = atof(rd.attribute("lon").c_str()) ;
+                TagList tags ;
 
                 while ( rd.read() )
                 {
-                    if ( rd.isStartElement("tag") )
+                    if ( keep && rd.isStartElement("tag") )
                     {
-                        string key = rd.attribute("k")  ;
-                        string val = rd.attribute("v") ;
+                        uint32_t key, val ;
 
-                        node.tags_[key] = val ;
+                        if ( internTag(rd, filter, scratch, key, val) ) tags.set(key, val) ;
                     }
                     else if ( rd.isEndElement("node" ) ) break ;
                 }
 
-                nodeMap[node.id_] = nodes_.size() ;
-                nodes_.push_back(node) ;
+                if ( !keep ) continue ;
+
+                if ( keep_node ) {
+                    Node node ;
+                    node.id_ = node_id ;
+                    node.lat_ = lat ;
+                    node.lon_ = lon ;
+                    node.tags_ = std::move(tags) ;
+
+                    if ( !keep_node(node) ) continue ;
+
+                    if ( !nodes_.add(node_id, lat, lon, std::move(node.tags_)) ) return false ;
+                }
+                else if ( !nodes_.add(node_id, lat, lon, std::move(tags)) ) return false ;
+
+                if ( is_change ) refs.node_deleted_.push_back(deleted) ;
 
             }
             else if ( rd.nodeName() == "way" )
             {
                 Way way ;
 
-                way.id_ = rd.attribute("id") ;
+                boost::string_ref id = rd.attributeRef("id") ;
+
+                if ( id.empty() ) return false ;
 
-                wayNodeMap.push_back(vector<string>()) ;
-                vector<string> &map_item =  wayNodeMap.back() ;
+                way.id_ = to_int64(id) ;
 
-                if ( way.id_.empty() ) return false ;
+                vector<int64_t> map_item ;
 
                 while ( rd.read() )
                 {
                     if ( rd.isStartElement("nd") )
                     {
-                        string ref_ = rd.attribute("ref")  ;
+                        boost::string_ref ref = rd.attributeRef("ref")  ;
 
-                        if ( ref_.empty()  ) return false ;
+                        if ( ref.empty()  ) return false ;
 
-                        map_item.push_back(ref_) ;
+                        map_item.push_back(to_int64(ref)) ;
                     }
                     else if ( rd.isStartElement("tag"))
                     {
-                        string key = rd.attribute("k")  ;
-                        string val = rd.attribute("v") ;
+                        uint32_t key, val ;
 
-                        way.tags_[key] = val ;
+                        if ( internTag(rd, filter, scratch, key, val) ) way.tags_.set(key, val) ;
                     }
                     else if ( rd.isEndElement("way" ) ) break ;
                 }
 
-                wayMap[way.id_] = ways_.size() ;
-                ways_.push_back(way) ;
+                if ( !( what & LoadWays ) ) continue ;
+
+                refs.way_nodes_.push_back(std::move(map_item)) ;
+                ways_.push_back(std::move(way)) ;
+
+                if ( is_change ) refs.way_deleted_.push_back(deleted) ;
 
             }
             else if ( rd.nodeName() == "relation" )
             {
                 Relation relation ;
 
-                relation.id_ = rd.attribute("id") ;
+                boost::string_ref id = rd.attributeRef("id") ;
 
-                if (relation.id_.empty() ) return false ;
+                if ( id.empty() ) return false ;
 
-                relNodeMap.push_back(vector<string>()) ;
-                relWayMap.push_back(vector<string>()) ;
-                relRelMap.push_back(vector<string>()) ;
+                relation.id_ = to_int64(id) ;
 
-                relNodeMapRole.push_back(vector<string>()) ;
-                relWayMapRole.push_back(vector<string>()) ;
-                relRelMapRole.push_back(vector<string>()) ;
-
-                vector<string> &node_map_item = relNodeMap.back() ;
-                vector<string> &way_map_item = relWayMap.back() ;
-                vector<string> &rel_map_item = relRelMap.back() ;
-
-                vector<string> &node_map_role = relNodeMapRole.back() ;
-                vector<string> &way_map_role = relWayMapRole.back() ;
-                vector<string> &rel_map_role = relRelMapRole.back() ;
+                vector<int64_t> node_map_item, way_map_item, rel_map_item ;
+                vector<uint32_t> node_map_role, way_map_role, rel_map_role ;
 
                 while ( rd.read() )
                 {
                     if ( rd.isStartElement("member") )
                     {
-                        string type = rd.attribute("type") ;
-                        string ref = rd.attribute("ref") ;
-                        string role = rd.attribute("role") ;
-
+                        boost::string_ref type = rd.attributeRef("type") ;
+                        boost::string_ref ref = rd.attributeRef("ref") ;
                         if ( ref.empty() || type.empty() ) return false ;
 
+                        int64_t ref_id = to_int64(ref) ;
+                        uint32_t role = intern(rd.attributeRef("role"), scratch) ;
+
                         if ( type == "node" )
                         {
-                            node_map_item.push_back(ref) ;
+                            node_map_item.push_back(ref_id) ;
                             node_map_role.push_back(role) ;
                         }
                         else if ( type == "way" )
                         {
-                            way_map_item.push_back(ref) ;
+                            way_map_item.push_back(ref_id) ;
                             way_map_role.push_back(role) ;
                         }
                         else if ( type == "relation" )
                         {
-                            rel_map_item.push_back(ref) ;
+                            rel_map_item.push_back(ref_id) ;
                             rel_map_role.push_back(role) ;
                         }
                     }
                     else if ( rd.isStartElement("tag"))
                     {
-                        string key = rd.attribute("k") ;
-                        string val = rd.attribute("v") ;
+                        uint32_t key, val ;
 
-                        relation.tags_[key] = val ;
+                        if ( internTag(rd, filter, scratch, key, val) ) relation.tags_.set(key, val) ;
                     }
                     else if ( rd.isEndElement("relation" ) ) break ;
 
                 }
 
-                relMap[relation.id_] = relations_.size() ;
-                relations_.push_back(relation) ;
+                if ( !( what & LoadRelations ) ) continue ;
+
+                refs.rel_nodes_.push_back(std::move(node_map_item)) ;
+                refs.rel_ways_.push_back(std::move(way_map_item)) ;
+                refs.rel_rels_.push_back(std::move(rel_map_item)) ;
+
+                refs.rel_node_roles_.push_back(std::move(node_map_role)) ;
+                refs.rel_way_roles_.push_back(std::move(way_map_role)) ;
+                refs.rel_rel_roles_.push_back(std::move(rel_map_role)) ;
+
+                relations_.push_back(std::move(relation)) ;
+
+                if ( is_change ) refs.rel_deleted_.push_back(deleted) ;
 
             }
         }
 
     }
 
+    return true ;
+}
+
+void Document::resolveReferences(References &refs)
+{
+    IdIndex nodeIndex, wayIndex, relIndex ;
+
+    nodeIndex.reserve(nodes_.size()) ;
+    for( uint i=0 ; i<nodes_.size() ; i++ )
+        nodeIndex.add(nodes_.id(i), i) ;
+
+    wayIndex.reserve(ways_.size()) ;
+    for( uint i=0 ; i<ways_.size() ; i++ )
+        wayIndex.add(ways_[i].id_, i) ;
+
+    relIndex.reserve(relations_.size()) ;
+    for( uint i=0 ; i<relations_.size() ; i++ )
+        relIndex.add(relations_[i].id_, i) ;
+
+    nodeIndex.finalize() ;
+    wayIndex.finalize() ;
+    relIndex.finalize() ;
+
     // establish feature dependencies
 
     for(uint i=0 ; i<ways_.size() ; i++ )
     {
         Way &way = ways_[i] ;
 
-        vector<string> &node_refs = wayNodeMap[i] ;
+        vector<int64_t> &node_refs = refs.way_nodes_[i] ;
+
+        way.nodes_.reserve(node_refs.size()) ;
 
         for(uint j=0 ; j<node_refs.size() ; j++ )
         {
-            uint idx = nodeMap[node_refs[j]] ;
-            way.nodes_.push_back(idx) ;
+            uint idx ;
 
-            nodes_[idx].ways_.push_back(i) ;
+            if ( nodeIndex.find(node_refs[j], idx) )
+                way.nodes_.push_back(idx) ;
         }
 
     }
 
+    // relation members are stored in flat arrays, dropping the references to entities not in the document
+
+    size_t n_node_refs = 0, n_way_refs = 0, n_rel_refs = 0 ;
+
     for(uint i=0 ; i<relations_.size() ; i++ )
     {
-        Relation &relation = relations_[i] ;
+        n_node_refs += refs.rel_nodes_[i].size() ;
+        n_way_refs += refs.rel_ways_[i].size() ;
+        n_rel_refs += refs.rel_rels_[i].size() ;
+    }
+
+    rel_nodes_.clear() ; rel_node_roles_.clear() ;
+    rel_ways_.clear() ; rel_way_roles_.clear() ;
+    rel_children_.clear() ; rel_child_roles_.clear() ;
 
-        vector<string> &node_refs = relNodeMap[i] ;
-        vector<string> &node_roles = relNodeMapRole[i] ;
+    rel_nodes_.reserve(relations_.size(), n_node_refs) ;
+    rel_node_roles_.reserve(relations_.size(), n_node_refs) ;
+    rel_ways_.reserve(relations_.size(), n_way_refs) ;
+    rel_way_roles_.reserve(relations_.size(), n_way_refs) ;
+    rel_children_.reserve(relations_.size(), n_rel_refs) ;
+    rel_child_roles_.reserve(relations_.size(), n_rel_refs) ;
+
+    for(uint i=0 ; i<relations_.size() ; i++ )
+    {
+        const vector<int64_t> &node_refs = refs.rel_nodes_[i] ;
+        const vector<uint32_t> &node_roles = refs.rel_node_roles_[i] ;
 
         for(uint j=0 ; j<node_refs.size() ; j++ )
         {
-            auto it = nodeMap.find(node_refs[j]) ;
+            uint idx ;
+
+            if ( nodeIndex.find(node_refs[j], idx) )
+            {
+                rel_nodes_.push(idx) ;
+                rel_node_roles_.push(node_roles[j]) ;
+            }
+        }
+
+        const vector<int64_t> &way_refs = refs.rel_ways_[i] ;
+        const vector<uint32_t> &way_roles = refs.rel_way_roles_[i] ;
+
+        for(uint j=0 ; j<way_refs.size() ; j++ )
+        {
+            uint idx ;
 
-            if ( it != nodeMap.end() )
+            if ( wayIndex.find(way_refs[j], idx) )
             {
-                int idx = (*it).second ;
-                relation.nodes_.push_back(idx) ;
-                relation.nodes_role_.push_back(node_roles[j]) ;
+                rel_ways_.push(idx) ;
+                rel_way_roles_.push(way_roles[j]) ;
+            }
+        }
+
+        const vector<int64_t> &rel_refs = refs.rel_rels_[i] ;
+        const vector<uint32_t> &rel_roles = refs.rel_rel_roles_[i] ;
 
-                nodes_[idx].relations_.push_back(i) ;
+        for(uint j=0 ; j<rel_refs.size() ; j++ )
+        {
+            uint idx ;
+
+            if ( relIndex.find(rel_refs[j], idx) )
+            {
+                rel_children_.push(idx) ;
+                rel_child_roles_.push(rel_roles[j]) ;
             }
         }
 
+        rel_nodes_.close() ; rel_node_roles_.close() ;
+        rel_ways_.close() ; rel_way_roles_.close() ;
+        rel_children_.close() ; rel_child_roles_.close() ;
     }
 
+    linkMembers() ;
+}
+
+void Document::linkMembers()
+{
+    way_relations_.invert(rel_ways_, ways_.size()) ;
+    rel_parents_.invert(rel_children_, relations_.size()) ;
+
+    for(uint i=0 ; i<ways_.size() ; i++ )
+        ways_[i].relations_ = way_relations_[i] ;
+
     for(uint i=0 ; i<relations_.size() ; i++ )
     {
         Relation &relation = relations_[i] ;
 
-        vector<string> &way_refs = relWayMap[i] ;
-        vector<string> &way_roles = relWayMapRole[i] ;
+        relation.nodes_ = rel_nodes_[i] ;
+        relation.nodes_role_ = rel_node_roles_[i] ;
+        relation.ways_ = rel_ways_[i] ;
+        relation.ways_role_ = rel_way_roles_[i] ;
+        relation.children_ = rel_children_[i] ;
+        relation.children_role_ = rel_child_roles_[i] ;
+        relation.parents_ = rel_parents_[i] ;
+    }
+}
+
+bool Document::setNodeLocationFile(const string &fileName)
+{
+    std::shared_ptr<NodeLocationFile> locations(new NodeLocationFile) ;
 
-        for(uint j=0 ; j<way_refs.size() ; j++ )
-        {
-            auto it = wayMap.find(way_refs[j]) ;
+    if ( !locations->create(fileName) ) return false ;
 
-            if ( it != wayMap.end() )
-            {
-                uint idx = (*it).second ;
-                relation.ways_.push_back(idx) ;
-                relation.ways_role_.push_back(way_roles[j]) ;
+    nodes_.setLocationFile(locations) ;
 
-                ways_[idx].relations_.push_back(i) ;
-            }
+    return true ;
+}
+
+bool Document::load(const string &fileName, References &refs, int what, const NodePredicate &keep_node, const ClipRegion *clip)
+{
+    if ( boost::ends_with(fileName, ".osm.gz") || boost::ends_with(fileName, ".osc.gz") )
+    {
+        gzifstream strm(fileName.c_str()) ;
+        XmlReader rd(strm) ;
+
+        return readXML(rd, refs, what, keep_node, clip) ;
+    }
+    else if ( boost::ends_with(fileName, ".osm") || boost::ends_with(fileName, ".osc") )
+    {
+        // plain files are mapped in memory by the reader
+        XmlReader rd(fileName) ;
+
+        return readXML(rd, refs, what, keep_node, clip) ;
+    }
+    else if ( boost::ends_with(fileName, ".pbf") )
+    {
+        return readPBF(fileName, refs, what, keep_node, clip) ;
+    }
+    else if ( boost::ends_with(fileName, ".o5m") || boost::ends_with(fileName, ".o5c") )
+    {
+        return readO5M(fileName, refs, what, keep_node, clip) ;
+    }
+
+    return false ;
+}
+
+bool Document::read(const string &fileName)
+{
+    if ( clip_ ) return readClipped(fileName, nullptr) ;
+
+    if ( use_snapshot_ ) {
+        bool failed = false ;
+        if ( loadSnapshot(fileName, failed) ) return true ;
+        if ( failed ) return false ;
+    }
+
+    References refs ;
+
+    if ( !load(fileName, refs, LoadAll, nullptr, nullptr) ) return false ;
+
+    resolveReferences(refs) ;
+
+    // the snapshot is only a cache, failing to save it (e.g. in a read-only directory) is not an error
+    if ( use_snapshot_ ) saveSnapshot(fileName) ;
+
+    return true ;
+}
+
+// remove the entries of v not marked in keep
+
+template<class T>
+static void compact(vector<T> &v, const vector<bool> &keep)
+{
+    size_t n = 0 ;
+
+    for( size_t i=0 ; i<v.size() ; i++ )
+        if ( keep[i] ) {
+            if ( n != i ) v[n] = std::move(v[i]) ;
+            ++n ;
+        }
+
+    v.resize(n) ;
+}
+
+void Document::removeFeatures(References &refs, const vector<bool> &keep_way, const vector<bool> &keep_rel)
+{
+    compact(ways_, keep_way) ;
+    compact(refs.way_nodes_, keep_way) ;
+
+    compact(relations_, keep_rel) ;
+    compact(refs.rel_nodes_, keep_rel) ;
+    compact(refs.rel_ways_, keep_rel) ;
+    compact(refs.rel_rels_, keep_rel) ;
+    compact(refs.rel_node_roles_, keep_rel) ;
+    compact(refs.rel_way_roles_, keep_rel) ;
+    compact(refs.rel_rel_roles_, keep_rel) ;
+}
+
+bool Document::read(const string &fileName, const EntityFilter &filter)
+{
+    if ( clip_ ) return readClipped(fileName, &filter) ;
+
+    References refs ;
+
+    // first pass, ways and relations
+
+    if ( !load(fileName, refs, LoadWays | LoadRelations, nullptr, nullptr) ) return false ;
+
+    IdIndex wayIndex ;
+
+    for( uint i=0 ; i<ways_.size() ; i++ )
+        wayIndex.add(ways_[i].id_, i) ;
+
+    wayIndex.finalize() ;
+
+    vector<bool> keep_way(ways_.size(), false), keep_rel(relations_.size(), false) ;
+
+    for( uint i=0 ; i<relations_.size() ; i++ )
+    {
+        if ( !filter.acceptRelation(relations_[i]) ) continue ;
+
+        keep_rel[i] = true ;
+
+        // member ways are needed to build the relation geometry
+
+        for( int64_t ref: refs.rel_ways_[i] ) {
+            uint idx ;
+            if ( wayIndex.find(ref, idx) ) keep_way[idx] = true ;
         }
     }
 
-    for(uint i=0 ; i<relations_.size() ; i++ )
+    for( uint i=0 ; i<ways_.size() ; i++ )
+        if ( !keep_way[i] && filter.acceptWay(ways_[i]) ) keep_way[i] = true ;
+
+    // collect nodes referenced by the selected features
+
+    vector<int64_t> node_ids ;
+
+    for( uint i=0 ; i<ways_.size() ; i++ )
+        if ( keep_way[i] ) node_ids.insert(node_ids.end(), refs.way_nodes_[i].begin(), refs.way_nodes_[i].end()) ;
+
+    for( uint i=0 ; i<relations_.size() ; i++ )
+        if ( keep_rel[i] ) node_ids.insert(node_ids.end(), refs.rel_nodes_[i].begin(), refs.rel_nodes_[i].end()) ;
+
+    std::sort(node_ids.begin(), node_ids.end()) ;
+    node_ids.erase(std::unique(node_ids.begin(), node_ids.end()), node_ids.end()) ;
+
+    removeFeatures(refs, keep_way, keep_rel) ;
+
+    // second pass, nodes
+
+    auto keep_node = [&](const Node &node) {
+        return std::binary_search(node_ids.begin(), node_ids.end(), node.id_) || filter.acceptNode(node) ;
+    } ;
+
+    if ( !load(fileName, refs, LoadNodes, keep_node, nullptr) ) return false ;
+
+    resolveReferences(refs) ;
+
+    return true ;
+}
+
+// Reading with a clip region takes two passes. The first one loads all ways and relations but only the nodes inside
+// the region. Ways with a node inside and relations with a node or way member inside are kept (if accepted by the
+// filter), along with the member ways of the kept relations so that their geometry can be built. The second pass
+// reads the nodes outside the region referenced by the kept ways. Nodes inside the region are kept regardless of
+// the filter.
+
+bool Document::readClipped(const string &fileName, const EntityFilter *filter)
+{
+    References refs ;
+
+    // first pass, everything but the nodes outside the region
+
+    if ( !load(fileName, refs, LoadAll, nullptr, clip_.get()) ) return false ;
+
+    IdIndex nodeIndex, wayIndex ;
+
+    nodeIndex.reserve(nodes_.size()) ;
+    for( uint i=0 ; i<nodes_.size() ; i++ )
+        nodeIndex.add(nodes_.id(i), i) ;
+
+    wayIndex.reserve(ways_.size()) ;
+    for( uint i=0 ; i<ways_.size() ; i++ )
+        wayIndex.add(ways_[i].id_, i) ;
+
+    nodeIndex.finalize() ;
+    wayIndex.finalize() ;
+
+    auto inside = [&](int64_t id) {
+        uint idx ;
+        return nodeIndex.find(id, idx) ;
+    } ;
+
+    vector<bool> touches_way(ways_.size(), false), keep_way(ways_.size(), false), keep_rel(relations_.size(), false) ;
+
+    for( uint i=0 ; i<ways_.size() ; i++ )
+        touches_way[i] = std::any_of(refs.way_nodes_[i].begin(), refs.way_nodes_[i].end(), inside) ;
+
+    for( uint i=0 ; i<relations_.size() ; i++ )
     {
-        Relation &relation = relations_[i] ;
+        bool touches = std::any_of(refs.rel_nodes_[i].begin(), refs.rel_nodes_[i].end(), inside) ;
 
-        vector<string> &rel_refs = relRelMap[i] ;
-        vector<string> &rel_roles = relRelMapRole[i] ;
+        for( int64_t ref: refs.rel_ways_[i] ) {
+            uint idx ;
+            if ( !touches && wayIndex.find(ref, idx) ) touches = touches_way[idx] ;
+        }
 
-        for(uint j=0 ; j<rel_refs.size() ; j++ )
-        {
-            auto it = relMap.find(rel_refs[j]) ;
+        if ( !touches || ( filter && !filter->acceptRelation(relations_[i]) ) ) continue ;
 
-            if ( it != relMap.end() )
-            {
-                uint idx = relMap[rel_refs[j]] ;
-                relation.children_.push_back(idx) ;
-                relation.children_role_.push_back(rel_roles[j]) ;
+        keep_rel[i] = true ;
 
-                relations_[idx].parents_.push_back(i) ;
-            }
+        for( int64_t ref: refs.rel_ways_[i] ) {
+            uint idx ;
+            if ( wayIndex.find(ref, idx) ) keep_way[idx] = true ;
         }
     }
 
+    for( uint i=0 ; i<ways_.size() ; i++ )
+        if ( !keep_way[i] && touches_way[i] && ( !filter || filter->acceptWay(ways_[i]) ) ) keep_way[i] = true ;
+
+    // nodes outside the region needed to complete the kept ways
+
+    vector<int64_t> node_ids ;
+
+    for( uint i=0 ; i<ways_.size() ; i++ )
+    {
+        if ( !keep_way[i] ) continue ;
+
+        for( int64_t ref: refs.way_nodes_[i] )
+            if ( !inside(ref) ) node_ids.push_back(ref) ;
+    }
+
+    std::sort(node_ids.begin(), node_ids.end()) ;
+    node_ids.erase(std::unique(node_ids.begin(), node_ids.end()), node_ids.end()) ;
+
+    removeFeatures(refs, keep_way, keep_rel) ;
+
+    // second pass, nodes outside the region
+
+    if ( !node_ids.empty() ) {
+        auto keep_node = [&](const Node &node) {
+            return std::binary_search(node_ids.begin(), node_ids.end(), node.id_) ;
+        } ;
+
+        if ( !load(fileName, refs, LoadNodes, keep_node, nullptr) ) return false ;
+    }
+
+    resolveReferences(refs) ;
+
     return true ;
 }
 
+// map entity ids to the index of their last version in the change files
 
-bool Document::read(const string &fileName)
+static void last_versions(const vector<int64_t> &ids, map<int64_t, uint> &versions, vector<int64_t> &changed)
 {
-    if ( boost::ends_with(fileName, ".osm.gz") )
+    for( uint i=0 ; i<ids.size() ; i++ )
+        versions[ids[i]] = i ;
+
+    for( const auto &v: versions )
+        changed.push_back(v.first) ;
+}
+
+bool Document::read(const string &fileName, const vector<string> &changeFiles, ChangeSet &changes)
+{
+    // load all change files in a separate document
+
+    Document diff ;
+    References diff_refs ;
+
+    for( const string &changeFile: changeFiles )
     {
-        gzifstream strm(fileName.c_str()) ;
+        if ( !diff.load(changeFile, diff_refs, LoadAll, nullptr, nullptr) ) return false ;
 
-        return readXML(strm) ;
+        // reject files without an osmChange root
+        if ( diff_refs.node_deleted_.size() != diff.nodes_.size() ||
+             diff_refs.way_deleted_.size() != diff.ways_.size() ||
+             diff_refs.rel_deleted_.size() != diff.relations_.size() ) return false ;
     }
-    else if ( boost::ends_with(fileName, ".osm") )
+
+    vector<int64_t> ids ;
+    map<int64_t, uint> node_versions, way_versions, rel_versions ;
+
+    changes = ChangeSet() ;
+
+    for( uint i=0 ; i<diff.nodes_.size() ; i++ ) ids.push_back(diff.nodes_.id(i)) ;
+    last_versions(ids, node_versions, changes.nodes_) ;
+
+    ids.clear() ;
+    for( const Way &way: diff.ways_ ) ids.push_back(way.id_) ;
+    last_versions(ids, way_versions, changes.ways_) ;
+
+    ids.clear() ;
+    for( const Relation &relation: diff.relations_ ) ids.push_back(relation.id_) ;
+    last_versions(ids, rel_versions, changes.relations_) ;
+
+    // load the file without the old versions of the changed entities
+
+    References refs ;
+
+    auto keep_node = [&](const Node &node) {
+        return !std::binary_search(changes.nodes_.begin(), changes.nodes_.end(), node.id_) ;
+    } ;
+
+    if ( !load(fileName, refs, LoadAll, keep_node, nullptr) ) return false ;
+
+    vector<bool> keep_way(ways_.size()), keep_rel(relations_.size()) ;
+
+    for( uint i=0 ; i<ways_.size() ; i++ )
+        keep_way[i] = !std::binary_search(changes.ways_.begin(), changes.ways_.end(), ways_[i].id_) ;
+
+    for( uint i=0 ; i<relations_.size() ; i++ )
+        keep_rel[i] = !std::binary_search(changes.relations_.begin(), changes.relations_.end(), relations_[i].id_) ;
+
+    removeFeatures(refs, keep_way, keep_rel) ;
+
+    // append the new versions
+
+    for( const auto &v: node_versions )
     {
-        ifstream strm(fileName.c_str()) ;
+        uint idx = v.second ;
+        if ( diff_refs.node_deleted_[idx] ) continue ;
 
-        return readXML(strm) ;
+        int32_t lat, lon ;
+        diff.nodes_.getFixed(idx, lat, lon) ;
+
+        if ( !nodes_.add(v.first, NodeStore::fromFixed(lat), NodeStore::fromFixed(lon), TagList(diff.nodes_.tags(idx))) ) return false ;
     }
-    else if ( boost::ends_with(fileName, ".pbf") )
+
+    for( const auto &v: way_versions )
+    {
+        uint idx = v.second ;
+        if ( diff_refs.way_deleted_[idx] ) continue ;
+
+        ways_.push_back(std::move(diff.ways_[idx])) ;
+        refs.way_nodes_.push_back(std::move(diff_refs.way_nodes_[idx])) ;
+    }
+
+    for( const auto &v: rel_versions )
     {
-        return readPBF(fileName) ;
+        uint idx = v.second ;
+        if ( diff_refs.rel_deleted_[idx] ) continue ;
+
+        relations_.push_back(std::move(diff.relations_[idx])) ;
+        refs.rel_nodes_.push_back(std::move(diff_refs.rel_nodes_[idx])) ;
+        refs.rel_ways_.push_back(std::move(diff_refs.rel_ways_[idx])) ;
+        refs.rel_rels_.push_back(std::move(diff_refs.rel_rels_[idx])) ;
+        refs.rel_node_roles_.push_back(std::move(diff_refs.rel_node_roles_[idx])) ;
+        refs.rel_way_roles_.push_back(std::move(diff_refs.rel_way_roles_[idx])) ;
+        refs.rel_rel_roles_.push_back(std::move(diff_refs.rel_rel_roles_[idx])) ;
     }
 
-    return false ;
+    resolveReferences(refs) ;
+
+    return true ;
 }
 
-void Document::write(const string &fileName)
+bool Document::write(const string &fileName)
 {
     if ( boost::ends_with(fileName, ".osm.gz") )
     {
         gzofstream strm(fileName.c_str()) ;
 
-        return writeXML(strm) ;
+        writeXML(strm) ;
+
+        return strm.good() ;
     }
     else if ( boost::ends_with(fileName, ".osm") )
     {
         ofstream strm(fileName.c_str()) ;
 
-        return writeXML(strm) ;
-    }
+        writeXML(strm) ;
 
+        return strm.good() ;
+    }
+    else if ( boost::ends_with(fileName, ".pbf") )
+    {
+        return writePBF(fileName) ;
+    }
 
+    return false ;
 }
 
 void Document::writeXML(ostream &strm)
@@ -296,22 +812,20 @@ void Document::writeXML(ostream &strm)
     strm << "<?xml version='1.0' encoding='UTF-8'?>\n" ;
     strm << "<osm version='0.6' generator='JOSM'>\n" ;
 
-    for(int i=0 ; i<nodes_.size() ; i++ )
+    for(uint i=0 ; i<nodes_.size() ; i++ )
     {
-        const Node &node = nodes_[i] ;
+        strm << '\t' << "<node id='" << nodes_.id(i) << "' visible='true' lat='" << setprecision(12) << nodes_.lat(i) <<
+            "' lon='" << setprecision(12) << nodes_.lon(i)  ;
 
-        strm << '\t' << "<node id='" << node.id_ << "' visible='true' lat='" << setprecision(12) << node.lat_ <<
-            "' lon='" << setprecision(12) << node.lon_  ;
+        const TagList &node_tags = nodes_.tags(i) ;
 
-        if ( node.tags_.empty() ) strm <<  "' />\n" ;
+        if ( node_tags.empty() ) strm <<  "' />\n" ;
         else
         {
             strm << "' >\n" ;
 
-            auto tags = node.tags_.keys() ;
-
-            for( int j=0 ; j<tags.size() ; j++ )
-                strm << "\t\t" << "<tag k='" << tags[j] << "' v='" << node.tags_.get(tags[j]) << "' />\n" ;
+            for( const TagList::Tag &tag: node_tags )
+                strm << "\t\t" << "<tag k='" << tag.key() << "' v='" << tag.value() << "' />\n" ;
 
             strm << "\t</node>\n" ;
         }
@@ -323,14 +837,12 @@ void Document::writeXML(ostream &strm)
 
         strm << "\t<way id='" << way.id_ << "' action='modify' visible='true'>\n" ;
 
-        auto tags = way.tags_.keys() ;
-
-        for( int j=0 ; j<tags.size() ; j++ )
-            strm << "\t\t" << "<tag k='" << tags[j] << "' v='" << way.tags_.get(tags[j]) << "' />\n" ;
+        for( const TagList::Tag &tag: way.tags_ )
+            strm << "\t\t" << "<tag k='" << tag.key() << "' v='" << tag.value() << "' />\n" ;
 
         for(int j=0 ; j<way.nodes_.size() ; j++ )
         {
-            strm << "\t\t<nd ref='" << nodes_[way.nodes_[j]].id_ << "'/>\n" ;
+            strm << "\t\t<nd ref='" << nodes_.id(way.nodes_[j]) << "'/>\n" ;
         }
 
         strm << "\t</way>\n" ;
@@ -342,14 +854,12 @@ void Document::writeXML(ostream &strm)
 
         strm << "\t<relation id='" << relation.id_ << "' action='modify' visible='true'>\n" ;
 
-        auto tags = relation.tags_.keys() ;
-
-        for( int j=0 ; j<tags.size() ; j++ )
-            strm << "\t\t" << "<tag k='" << tags[j] << "' v='" << relation.tags_.get(tags[j]) << "' />\n" ;
+        for( const TagList::Tag &tag: relation.tags_ )
+            strm << "\t\t" << "<tag k='" << tag.key() << "' v='" << tag.value() << "' />\n" ;
 
         for(int j=0 ; j<relation.nodes_.size() ; j++ )
         {
-            strm << "\t\t<member type='node' ref='" << nodes_[relation.nodes_[j]].id_ << "' role=''/>\n" ;
+            strm << "\t\t<member type='node' ref='" << nodes_.id(relation.nodes_[j]) << "' role=''/>\n" ;
         }
 
         for(int j=0 ; j<relation.ways_.size() ; j++ )
@@ -4,9 +4,18 @@
 #include <string>
 #include <map>
 #include <vector>
-#include <deque>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <memory>
+#include <functional>
 
-#include "dictionary.hpp"
+#include "osm_tag_list.hpp"
+#include "osm_node_locations.hpp"
+#include "osm_clip_region.hpp"
+#include "osm_adjacency.hpp"
+
+class XmlReader ;
 
 namespace OSM {
 
@@ -14,10 +23,10 @@ struct Feature {
 
     enum Type { NodeFeature, WayFeature, RelationFeature, PolygonFeature } ;
 
-    Feature(Type type): type_(type), visited_(false) {}
+    Feature(Type type): id_(0), type_(type), visited_(false) {}
 
-    std::string id_ ; // feature id
-    Dictionary tags_ ; // tags associated with this feature
+    int64_t id_ ; // feature id
+    TagList tags_ ; // tags associated with this feature
     Type type_ ; // feature type ;
     bool visited_ ; // used by algorithms ;
 };
@@ -25,23 +34,136 @@ struct Feature {
 class Way ;
 class Relation ;
 
+// A node as seen by the filter rules. Nodes are not stored in this form but materialized on demand from the NodeStore.
+
 struct Node: public Feature {
 
-    Node(): Feature(NodeFeature) {}
+    Node(): Feature(NodeFeature), lat_(0), lon_(0) {}
 
     double lat_, lon_ ;
-
-    std::vector<uint> ways_ ;      // ways in which this nodes participates
-    std::vector<uint> relations_ ; // relations that this node participates directly
 } ;
 
+// Column store of the document nodes. Coordinates are kept in fixed point (1e-7 degrees) and tags are held in a sparse
+// side table only for the nodes that have any, since the vast majority of nodes are untagged way vertices.
+// Optionally coordinates are kept in a memory mapped NodeLocationFile instead of the heap.
+
+class NodeStore {
+public:
+
+    NodeStore() {}
+
+    size_t size() const { return ids_.size() ; }
+    bool empty() const { return ids_.empty() ; }
+
+    void reserve(size_t n) {
+        ids_.reserve(n) ; lat_.reserve(n) ; lon_.reserve(n) ;
+    }
+
+    void clear() ;
+
+    // keep coordinates of nodes added from now on in the given location file
+    void setLocationFile(const std::shared_ptr<NodeLocationFile> &locations) { locations_ = locations ; }
+
+    // append a node, returns false if its coordinates could not be stored in the location file
+    bool add(int64_t id, double lat, double lon) {
+        return addFixed(id, toFixed(lat), toFixed(lon)) ;
+    }
+
+    bool add(int64_t id, double lat, double lon, TagList &&tags) {
+        if ( !add(id, lat, lon) ) return false ;
+        if ( !tags.empty() ) {
+            tagged_.push_back(ids_.size() - 1) ;
+            tags_.push_back(std::move(tags)) ;
+        }
+        return true ;
+    }
+
+    // move all nodes of other to the end of this store, fails like add
+    bool append(NodeStore &other) ;
+
+    int64_t id(uint idx) const { return ids_[idx] ; }
+
+    double lat(uint idx) const {
+        int32_t lat, lon ;
+        getFixed(idx, lat, lon) ;
+        return fromFixed(lat) ;
+    }
+
+    double lon(uint idx) const {
+        int32_t lat, lon ;
+        getFixed(idx, lat, lon) ;
+        return fromFixed(lon) ;
+    }
+
+    // coordinates in fixed point
+    void getFixed(uint idx, int32_t &lat, int32_t &lon) const {
+        if ( locations_ ) locations_->get(ids_[idx], lat, lon) ;
+        else {
+            lat = lat_[idx] ;
+            lon = lon_[idx] ;
+        }
+    }
+
+    bool hasTags(uint idx) const { return findTags(idx) != nullptr ; }
+
+    // tags of the node, an empty list if the node is untagged
+    const TagList &tags(uint idx) const {
+        const TagList *tags = findTags(idx) ;
+        return ( tags ) ? *tags : empty_tags_ ;
+    }
+
+    // number of tagged nodes and index of the i-th tagged node
+    size_t taggedCount() const { return tagged_.size() ; }
+    uint taggedIndex(size_t i) const { return tagged_[i] ; }
+
+    // materialize node for evaluating filter rules
+    Node node(uint idx) const ;
+
+    static int32_t toFixed(double v) { return (int32_t)lround(v * 1.0e7) ; }
+    static double fromFixed(int32_t v) { return v * 1.0e-7 ; }
+
+private:
+
+    friend class Document ; // saves and restores the columns in snapshots
+
+    bool addFixed(int64_t id, int32_t lat, int32_t lon) {
+        if ( locations_ ) {
+            if ( !locations_->set(id, lat, lon) ) return false ;
+        }
+        else {
+            lat_.push_back(lat) ;
+            lon_.push_back(lon) ;
+        }
+        ids_.push_back(id) ;
+        return true ;
+    }
+
+    const TagList *findTags(uint idx) const {
+        auto it = std::lower_bound(tagged_.begin(), tagged_.end(), idx) ;
+        if ( it == tagged_.end() || *it != idx ) return nullptr ;
+        return &tags_[it - tagged_.begin()] ;
+    }
+
+    std::vector<int64_t> ids_ ;
+    std::vector<int32_t> lat_, lon_ ;   // empty when a location file is used
+    std::shared_ptr<NodeLocationFile> locations_ ;
+
+    std::vector<uint> tagged_ ;     // sorted indices of tagged nodes
+    std::vector<TagList> tags_ ; // tags of the above nodes
+
+    static const TagList empty_tags_ ;
+};
+
+
+// Members and back references of ways and relations are views into the adjacency arrays of the document, set once
+// all entities are loaded. Roles are StringPool ids.
 
 struct Way: public Feature {
 
     Way(): Feature(WayFeature) {}
 
     std::vector<uint> nodes_ ;     // nodes corresponding to this way
-    std::vector<uint> relations_ ; // relations that this way participates
+    Span<uint> relations_ ; // relations that this way participates
 } ;
 
 
@@ -49,32 +171,51 @@ struct Relation: public Feature {
 
     Relation(): Feature(RelationFeature) {}
 
-    std::vector<uint> nodes_ ;     // node members
-    std::vector<uint> ways_ ;      // way members
-    std::vector<uint> children_ ; // relation members
+    Span<uint> nodes_ ;     // node members
+    Span<uint> ways_ ;      // way members
+    Span<uint> children_ ; // relation members
 
-    std::vector<std::string> nodes_role_ ;
-    std::vector<std::string> ways_role_ ;
-    std::vector<std::string> children_role_ ;
+    Span<uint32_t> nodes_role_ ;
+    Span<uint32_t> ways_role_ ;
+    Span<uint32_t> children_role_ ;
 
-    std::vector<uint> parents_ ;    // parent relations
+    Span<uint> parents_ ;    // parent relations
 };
 
 struct Ring {
-    std::deque<uint> nodes_ ;
+    std::vector<uint> nodes_ ;
 };
 
 struct Polygon: public Feature {
 
-    Polygon(): Feature(PolygonFeature) {}
+    Polygon(): Feature(PolygonFeature), source_(WayFeature) {}
 
     std::vector<Ring> rings_ ;
+    Type source_ ; // type of the feature (way or relation) with id id_ that the polygon was built from
 };
 
 
+// Selects the entities kept when reading a document in streaming mode (see Document::read)
+
+class EntityFilter {
+public:
+
+    virtual ~EntityFilter() {}
+
+    // called for nodes not referenced by any accepted way or relation
+    virtual bool acceptNode(const Node &node) const = 0 ;
+    virtual bool acceptWay(const Way &way) const = 0 ;
+    virtual bool acceptRelation(const Relation &relation) const = 0 ;
+};
+
 class Document {
 public:
 
+    // ids of the entities created, modified or deleted by a set of change files (sorted)
+    struct ChangeSet {
+        std::vector<int64_t> nodes_, ways_, relations_ ;
+    };
+
     // empty document
     Document() {}
 
@@ -84,26 +225,108 @@ public:
     // create OSM document by filtering an existing one
     Document(const Document &other, const std::string &filter) ;
 
+    // not copyable, the member and back reference spans of ways and relations point into the document's own arrays
+    Document(const Document &) = delete ;
+    Document &operator=(const Document &) = delete ;
+
     // read Osm file (format determined by extension)
     bool read(const std::string &fileName) ;
 
+    // read Osm file in two passes keeping only the entities accepted by the filter. The first pass reads ways and
+    // relations and records the nodes referenced by the accepted ones, the second pass reads only those nodes
+    // plus any other node accepted by the filter.
+    bool read(const std::string &fileName, const EntityFilter &filter) ;
+
+    // read Osm file and apply the given osmChange files (.osc, .osc.gz) in order, i.e. the last version of an entity
+    // in the change files replaces the one in the file and deleted entities are dropped. The ids of all entities
+    // touched by the changes are returned in changes. The clip region is not applied.
+    bool read(const std::string &fileName, const std::vector<std::string> &changeFiles, ChangeSet &changes) ;
+
     // write Osm file (format determined by extension)
-    void write(const std::string &fileName) ;
+    bool write(const std::string &fileName) ;
+
+    // keep node coordinates in a memory mapped file at the given path rather than in memory, must be called before read
+    bool setNodeLocationFile(const std::string &fileName) ;
+
+    // discard nodes outside the given region while reading, must be called before read. Ways and relations with
+    // members inside the region are kept complete, i.e. together with their nodes outside the region.
+    void setClipRegion(const std::shared_ptr<ClipRegion> &clip) { clip_ = clip ; }
+
+    // read PBF files through a sidecar block index (see PbfIndex), which is created on the first read of a file.
+    // Blocks without requested entity types or with nodes only outside the clip region are then skipped.
+    void setUseBlockIndex(bool use) { use_block_index_ = use ; }
+
+    // keep only the tags with keys accepted by the filter while reading, must be called before read. The strings of
+    // the dropped tags are not added to the string pool.
+    void setTagFilter(const std::shared_ptr<TagFilter> &filter) { tag_filter_ = filter ; }
+
+    // read(fileName) keeps a binary snapshot of the loaded document next to the input file as <file>.snap, and later
+    // reads of an unchanged file with the same tag filter restore the document from it instead of parsing. Snapshots
+    // are not used with a clip region.
+    void setUseSnapshot(bool use) { use_snapshot_ = use ; }
 
 public:
 
-    std::vector<Node> nodes_ ;
+    NodeStore nodes_ ;
     std::vector<Way> ways_ ;
     std::vector<Relation> relations_ ;
 
+    // entity types loaded by a reader pass
+    enum { LoadNodes = 0x1, LoadWays = 0x2, LoadRelations = 0x4, LoadAll = 0x7 } ;
+
 protected:
 
-    bool readXML(std::istream &strm) ;
+    typedef std::function<bool (const Node &)> NodePredicate ;
+
+    // way and relation members by id as read from the file, resolved to document indices once all entities are loaded
+    struct References {
+        std::vector< std::vector<int64_t> > way_nodes_ ;
+        std::vector< std::vector<int64_t> > rel_nodes_, rel_ways_, rel_rels_ ;
+        std::vector< std::vector<uint32_t> > rel_node_roles_, rel_way_roles_, rel_rel_roles_ ;
+
+        // entities read from the delete section of an osmChange file, filled only when reading change files
+        std::vector<bool> node_deleted_, way_deleted_, rel_deleted_ ;
+    };
+
+    // nodes outside clip (if given) are discarded at decode time, keep_node is then applied to the remaining ones
+    bool load(const std::string &fileName, References &refs, int what, const NodePredicate &keep_node, const ClipRegion *clip) ;
+    void resolveReferences(References &refs) ;
+
+    // set the back references and the member views of ways and relations from the adjacency arrays
+    void linkMembers() ;
+
+    // see setUseSnapshot, implemented in osm_snapshot.cpp. loadSnapshot returns whether the document was restored,
+    // failed is set if it could not be restored because of an error that makes reading the input fail too.
+    bool loadSnapshot(const std::string &fileName, bool &failed) ;
+    bool saveSnapshot(const std::string &fileName) const ;
+    uint64_t snapshotOptions() const ;
+
+    // remove the ways and relations (and their references) not marked in the given masks
+    void removeFeatures(References &refs, const std::vector<bool> &keep_way, const std::vector<bool> &keep_rel) ;
+
+    bool readClipped(const std::string &fileName, const EntityFilter *filter) ;
+
+    bool readXML(XmlReader &rd, References &refs, int what, const NodePredicate &keep_node, const ClipRegion *clip) ;
     void writeXML(std::ostream &strm);
 
-    bool readPBF(const std::string &fileName) ;
+    bool readPBF(const std::string &fileName, References &refs, int what, const NodePredicate &keep_node, const ClipRegion *clip) ;
     bool isPBF(const std::string &fileName) ;
 
+    // o5m and o5c files, decoded sequentially on the calling thread (see osm_o5m_reader.cpp)
+    bool readO5M(const std::string &fileName, References &refs, int what, const NodePredicate &keep_node, const ClipRegion *clip) ;
+
+    // blocks are encoded and compressed on a pool of worker threads
+    bool writePBF(const std::string &fileName) ;
+
+    std::shared_ptr<ClipRegion> clip_ ;
+    bool use_block_index_ = false ;
+    std::shared_ptr<TagFilter> tag_filter_ ;
+    bool use_snapshot_ = false ;
+
+    // storage of the relation members and of the back references, indexed by relation and way respectively
+    Adjacency<uint> rel_nodes_, rel_ways_, rel_children_, rel_parents_, way_relations_ ;
+    Adjacency<uint32_t> rel_node_roles_, rel_way_roles_, rel_child_roles_ ;
+
 public:
 
     static bool makePolygonsFromRelation(const Document &doc, const Relation &rel, Polygon &polygon) ;
@@ -111,7 +334,6 @@ public:
 
 };
 
-
 }
 
 #endif
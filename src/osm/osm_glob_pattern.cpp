@@ -0,0 +1,258 @@
+#include "osm_glob_pattern.hpp"
+
+#include <cctype>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+using namespace std ;
+
+namespace OSM {
+namespace Filter {
+
+static unsigned char fold(char c)
+{
+    return tolower((unsigned char)c) ;
+}
+
+static bool isSeparator(char c)
+{
+    return c == '/' || c == '\\' ;
+}
+
+GlobPattern::GlobPattern(const string &pattern)
+{
+    // literals with stars only at the ends are tested directly
+
+    size_t begin = 0, end = pattern.size() ;
+
+    bool leading = ( begin < end && pattern[begin] == '*' ) ;
+    if ( leading ) ++begin ;
+
+    bool trailing = ( begin < end && pattern[end-1] == '*' ) ;
+    if ( trailing ) --end ;
+
+    string middle = pattern.substr(begin, end - begin) ;
+
+    if ( middle.find_first_of("*?[%\\") == string::npos )
+    {
+        for( char c: middle ) literal_ += fold(c) ;
+
+        if ( leading && trailing ) kind_ = Contains ;
+        else if ( leading ) kind_ = Suffix ;
+        else if ( trailing ) kind_ = Prefix ;
+        else kind_ = Exact ;
+    }
+    else
+    {
+        kind_ = Automaton ;
+        compile(pattern) ;
+    }
+}
+
+void GlobPattern::compile(const string &pattern)
+{
+    auto element = [&](bool loop) -> Element & {
+        Element e ;
+        memset(e.chars_, 0, sizeof(e.chars_)) ;
+        e.loop_ = loop ;
+        elements_.push_back(e) ;
+        return elements_.back() ;
+    } ;
+
+    auto anyChar = [](Element &e) {
+        for( int c=0 ; c<256 ; c++ )
+            if ( !isSeparator(c) ) e.add(c) ;
+    } ;
+
+    auto digit = [](Element &e) {
+        for( char d = '0' ; d <= '9' ; d++ ) e.add(d) ;
+    } ;
+
+    size_t i = 0, n = pattern.size() ;
+
+    while ( i < n )
+    {
+        char c = pattern[i++] ;
+
+        if ( c == '*' ) anyChar(element(true)) ;
+        else if ( c == '?' ) anyChar(element(false)) ;
+        else if ( c == '\\' && i < n ) element(false).add(fold(pattern[i++])) ;
+        else if ( c == '[' && pattern.find(']', i + 1) != string::npos )
+        {
+            Element &e = element(false) ;
+
+            bool negate = ( pattern[i] == '!' || pattern[i] == '^' ) ;
+            if ( negate ) ++i ;
+
+            // a closing bracket right after the opening one is part of the class
+
+            size_t start = i ;
+
+            while ( i < n && ( pattern[i] != ']' || i == start ) )
+            {
+                unsigned char lo = pattern[i], hi = lo ;
+
+                if ( i + 2 < n && pattern[i+1] == '-' && pattern[i+2] != ']' ) {
+                    hi = pattern[i+2] ;
+                    i += 3 ;
+                }
+                else ++i ;
+
+                for( int k=lo ; k<=hi ; k++ ) e.add(fold(k)) ;
+            }
+
+            ++i ; // skip ]
+
+            if ( negate ) {
+                for( int k=0 ; k<4 ; k++ ) e.chars_[k] = ~e.chars_[k] ;
+            }
+        }
+        else if ( c == '%' && i < n && pattern[i] == 'd' )
+        {
+            ++i ;
+            digit(element(false)) ;
+            digit(element(true)) ;
+        }
+        else if ( c == '%' && i + 1 < n && pattern[i] == '0' && isdigit((unsigned char)pattern[i+1]) )
+        {
+            size_t j = i + 1 ;
+            while ( j < n && isdigit((unsigned char)pattern[j]) ) ++j ;
+
+            if ( j < n && pattern[j] == 'd' )
+            {
+                int count = atoi(pattern.substr(i + 1, j - i - 1).c_str()) ;
+
+                for( int k=0 ; k<count ; k++ ) digit(element(false)) ;
+
+                i = j + 1 ;
+            }
+            else element(false).add(c) ;
+        }
+        else element(false).add(fold(c)) ;
+    }
+
+    if ( elements_.size() < 64 )
+    {
+        masks_.assign(256, 0) ;
+
+        for( size_t k=0 ; k<elements_.size() ; k++ )
+        {
+            for( int c=0 ; c<256 ; c++ )
+                if ( elements_[k].contains(c) ) masks_[c] |= 1ull << k ;
+
+            if ( elements_[k].loop_ ) loops_ |= 1ull << k ;
+        }
+    }
+}
+
+bool GlobPattern::match(const string &str) const
+{
+    size_t n = str.size(), m = literal_.size() ;
+
+    auto literalAt = [&](size_t pos) {
+        for( size_t k=0 ; k<m ; k++ )
+            if ( fold(str[pos + k]) != (unsigned char)literal_[k] ) return false ;
+        return true ;
+    } ;
+
+    // the parts matched by stars may not contain separators
+
+    auto noSeparators = [&](size_t from, size_t to) {
+        for( size_t k=from ; k<to ; k++ )
+            if ( isSeparator(str[k]) ) return false ;
+        return true ;
+    } ;
+
+    switch ( kind_ ) {
+    case Exact:
+        return n == m && literalAt(0) ;
+    case Prefix:
+        return n >= m && literalAt(0) && noSeparators(m, n) ;
+    case Suffix:
+        return n >= m && literalAt(n - m) && noSeparators(0, n - m) ;
+    case Contains:
+    {
+        if ( n < m ) return false ;
+
+        // the occurrence has to cover all separators
+
+        size_t first = 0 ;
+        while ( first < n && !isSeparator(str[first]) ) ++first ;
+
+        size_t last = n ;
+        while ( last > 0 && !isSeparator(str[last-1]) ) --last ;
+
+        for( size_t pos = 0 ; pos + m <= n && pos <= first ; pos++ )
+            if ( pos + m >= last && literalAt(pos) ) return true ;
+
+        return false ;
+    }
+    case Automaton:
+        return matchElements(str) ;
+    }
+
+    return false ;
+}
+
+// The states are the positions before each element and the final one. A loop element is optional, so its state also
+// enables the next one, and it keeps its state when it matches.
+
+bool GlobPattern::matchElements(const string &str) const
+{
+    size_t n = elements_.size() ;
+
+    if ( !masks_.empty() )
+    {
+        auto closure = [&](uint64_t s) {
+            uint64_t t ;
+            while ( ( t = s | ( ( s & loops_ ) << 1 ) ) != s ) s = t ;
+            return s ;
+        } ;
+
+        uint64_t state = closure(1) ;
+
+        for( char c: str )
+        {
+            uint64_t m = masks_[fold(c)] & state ;
+            state = closure(( ( m & ~loops_ ) << 1 ) | ( m & loops_ )) ;
+            if ( !state ) return false ;
+        }
+
+        return state & ( 1ull << n ) ;
+    }
+
+    vector<char> state(n + 1, 0), next(n + 1) ;
+
+    auto closure = [&](vector<char> &s) {
+        for( size_t k=0 ; k<n ; k++ )
+            if ( s[k] && elements_[k].loop_ ) s[k+1] = 1 ;
+    } ;
+
+    state[0] = 1 ;
+    closure(state) ;
+
+    for( char c: str )
+    {
+        std::fill(next.begin(), next.end(), 0) ;
+
+        bool any = false ;
+
+        for( size_t k=0 ; k<n ; k++ )
+        {
+            if ( !state[k] || !elements_[k].contains(fold(c)) ) continue ;
+            next[elements_[k].loop_ ? k : k+1] = 1 ;
+            any = true ;
+        }
+
+        if ( !any ) return false ;
+
+        closure(next) ;
+        state.swap(next) ;
+    }
+
+    return state[n] ;
+}
+
+} // namespace Filter
+} // namespace OSM
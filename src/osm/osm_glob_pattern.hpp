@@ -0,0 +1,59 @@
+#ifndef __OSM_GLOB_PATTERN_H__
+#define __OSM_GLOB_PATTERN_H__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace OSM {
+namespace Filter {
+
+// Case insensitive glob pattern of the match (~) operator, compiled when the rules are parsed. The pattern must match
+// the whole string:
+//
+//  *       any run of characters except slashes and backslashes
+//  ?       any character except a slash or backslash
+//  [...]   a character of the class, with ranges (a-z) and negation ([!...] or [^...])
+//  %d      one or more digits
+//  %0Nd    exactly N digits
+//  \c      the character c
+//
+// Literals with leading and/or trailing stars are tested directly as equality, prefix, suffix or substring. Other
+// patterns run as a bit-parallel NFA, i.e. one set of states updated with a few word operations per character.
+
+class GlobPattern {
+public:
+
+    GlobPattern() {}
+    GlobPattern(const std::string &pattern) ;
+
+    bool match(const std::string &str) const ;
+
+private:
+
+    // one character of the class, repeated zero or more times if loop_ is set
+    struct Element {
+        uint64_t chars_[4] ;
+        bool loop_ ;
+
+        bool contains(unsigned char c) const { return chars_[c >> 6] & ( 1ull << ( c & 63 ) ) ; }
+        void add(unsigned char c) { chars_[c >> 6] |= ( 1ull << ( c & 63 ) ) ; }
+    };
+
+    enum Kind { Exact, Prefix, Suffix, Contains, Automaton } ;
+
+    void compile(const std::string &pattern) ;
+    bool matchElements(const std::string &str) const ;
+
+    Kind kind_ = Exact ;
+    std::string literal_ ;  // lower case literal of the direct tests
+
+    std::vector<Element> elements_ ;
+    std::vector<uint64_t> masks_ ;  // per character the elements accepting it, if there are fewer than 64 elements
+    uint64_t loops_ = 0 ;
+};
+
+} // namespace Filter
+} // namespace OSM
+
+#endif
@@ -0,0 +1,99 @@
+#include "osm_id_index.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+using namespace std ;
+
+namespace OSM {
+
+void IdIndex::add(int64_t id, uint idx)
+{
+    if ( !ids_.empty() && id < ids_.back() ) sorted_ = false ;
+
+    if ( idx_.empty() && idx != ids_.size() ) {
+        // positions no longer implicit, materialize them
+        idx_.resize(ids_.size()) ;
+        std::iota(idx_.begin(), idx_.end(), 0) ;
+    }
+
+    ids_.push_back(id) ;
+    if ( !idx_.empty() || idx != ids_.size() - 1 ) idx_.push_back(idx) ;
+}
+
+void IdIndex::finalize()
+{
+    if ( sorted_ ) return ;
+
+    if ( idx_.empty() ) {
+        idx_.resize(ids_.size()) ;
+        std::iota(idx_.begin(), idx_.end(), 0) ;
+    }
+
+    // sort by id, on duplicates the first added entry wins
+
+    vector<uint> order(ids_.size()) ;
+    std::iota(order.begin(), order.end(), 0) ;
+    std::stable_sort(order.begin(), order.end(), [&](uint a, uint b) { return ids_[a] < ids_[b] ; }) ;
+
+    vector<int64_t> ids(ids_.size()) ;
+    vector<uint> idx(ids_.size()) ;
+
+    for( size_t i=0 ; i<order.size() ; i++ ) {
+        ids[i] = ids_[order[i]] ;
+        idx[i] = idx_[order[i]] ;
+    }
+
+    ids_.swap(ids) ;
+    idx_.swap(idx) ;
+
+    sorted_ = true ;
+}
+
+bool IdIndex::find(int64_t id, uint &idx) const
+{
+    if ( ids_.empty() ) return false ;
+
+    size_t lo = 0, hi = ids_.size() - 1 ;
+    int probes = 0 ;
+
+    while ( lo <= hi )
+    {
+        int64_t a = ids_[lo], b = ids_[hi] ;
+
+        if ( id < a || id > b ) return false ;
+
+        size_t mid ;
+
+        // interpolate while it makes progress, fall back to bisection on skewed ranges
+
+        if ( a != b && probes++ < 8 )
+            mid = lo + (size_t)( (double)(id - a) / (double)(b - a) * (hi - lo) ) ;
+        else
+            mid = lo + (hi - lo)/2 ;
+
+        int64_t v = ids_[mid] ;
+
+        if ( v == id ) {
+            while ( mid > 0 && ids_[mid-1] == id ) --mid ;
+            idx = ( idx_.empty() ) ? mid : idx_[mid] ;
+            return true ;
+        }
+        else if ( v < id ) lo = mid + 1 ;
+        else {
+            if ( mid == 0 ) return false ;
+            hi = mid - 1 ;
+        }
+    }
+
+    return false ;
+}
+
+void IdIndex::clear()
+{
+    ids_.clear() ;
+    idx_.clear() ;
+    sorted_ = true ;
+}
+
+}
@@ -0,0 +1,43 @@
+#ifndef __OSM_ID_INDEX_H__
+#define __OSM_ID_INDEX_H__
+
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+
+namespace OSM {
+
+// Maps OSM entity ids to positions in the document arrays. Ids are kept in a sorted vector that is searched by
+// interpolation, which needs one or two probes for the near uniform id distribution of real files. When ids are added
+// in increasing order with consecutive positions (the common case for sorted PBF files) no position array is stored at all.
+
+class IdIndex {
+public:
+
+    IdIndex() {}
+
+    void reserve(size_t n) { ids_.reserve(n) ; }
+
+    // add an entry, entries may be added in any order
+    void add(int64_t id, uint idx) ;
+
+    // sort the entries if they were not added in order, must be called before find
+    void finalize() ;
+
+    // lookup position of given id, returns false if the id is not in the index
+    bool find(int64_t id, uint &idx) const ;
+
+    size_t size() const { return ids_.size() ; }
+
+    void clear() ;
+
+private:
+
+    std::vector<int64_t> ids_ ;
+    std::vector<uint> idx_ ;      // positions, empty as long as positions coincide with the entry order
+    bool sorted_ = true ;
+};
+
+}
+
+#endif
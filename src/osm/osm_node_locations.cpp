@@ -0,0 +1,129 @@
+#include "osm_node_locations.hpp"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <cstdio>
+#include <algorithm>
+#include <iostream>
+
+using namespace std ;
+
+// the file is grown in steps of 16M slots (128MB)
+#define LOCATION_FILE_GROW_STEP (16*1024*1024ULL)
+
+namespace OSM {
+
+NodeLocationFile::NodeLocationFile(): fd_(-1), data_(nullptr), capacity_(0) {}
+
+NodeLocationFile::~NodeLocationFile()
+{
+    close() ;
+}
+
+bool NodeLocationFile::create(const string &path)
+{
+#ifndef _WIN32
+    close() ;
+
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644) ;
+
+    if ( fd_ == -1 ) {
+        cerr << "Cannot create node location file: " << path << endl ;
+        return false ;
+    }
+
+    path_ = path ;
+
+    return grow(LOCATION_FILE_GROW_STEP) ;
+#else
+    return false ;
+#endif
+}
+
+void NodeLocationFile::close()
+{
+#ifndef _WIN32
+    if ( data_ ) munmap(data_, capacity_ * 2 * sizeof(int32_t)) ;
+
+    if ( fd_ != -1 ) {
+        ::close(fd_) ;
+        ::unlink(path_.c_str()) ;
+    }
+#endif
+
+    data_ = nullptr ;
+    fd_ = -1 ;
+    capacity_ = 0 ;
+    negative_.clear() ;
+}
+
+bool NodeLocationFile::grow(uint64_t min_slots)
+{
+#ifndef _WIN32
+    uint64_t slots = std::max(min_slots, 2 * capacity_) ;
+    slots = ( slots + LOCATION_FILE_GROW_STEP - 1 ) / LOCATION_FILE_GROW_STEP * LOCATION_FILE_GROW_STEP ;
+
+    size_t bytes = slots * 2 * sizeof(int32_t) ;
+
+    if ( ftruncate(fd_, bytes) != 0 ) return false ;
+
+    if ( data_ ) munmap(data_, capacity_ * 2 * sizeof(int32_t)) ;
+
+    void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0) ;
+
+    if ( p == MAP_FAILED ) {
+        data_ = nullptr ;
+        capacity_ = 0 ;
+        return false ;
+    }
+
+    data_ = (int32_t *)p ;
+    capacity_ = slots ;
+
+    return true ;
+#else
+    return false ;
+#endif
+}
+
+bool NodeLocationFile::set(int64_t id, int32_t lat, int32_t lon)
+{
+    if ( id < 0 ) {
+        negative_[id] = make_pair(lat, lon) ;
+        return true ;
+    }
+
+    if ( (uint64_t)id >= capacity_ && !grow(id + 1) ) {
+        cerr << "Cannot grow node location file: " << path_ << endl ;
+        return false ;
+    }
+
+    data_[2*id] = lat ;
+    data_[2*id+1] = lon ;
+
+    return true ;
+}
+
+void NodeLocationFile::get(int64_t id, int32_t &lat, int32_t &lon) const
+{
+    if ( id < 0 ) {
+        auto it = negative_.find(id) ;
+        if ( it == negative_.end() ) lat = lon = 0 ;
+        else {
+            lat = it->second.first ;
+            lon = it->second.second ;
+        }
+    }
+    else if ( (uint64_t)id < capacity_ ) {
+        lat = data_[2*id] ;
+        lon = data_[2*id+1] ;
+    }
+    else lat = lon = 0 ;
+}
+
+}
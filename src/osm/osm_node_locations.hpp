@@ -0,0 +1,49 @@
+#ifndef __OSM_NODE_LOCATIONS_H__
+#define __OSM_NODE_LOCATIONS_H__
+
+#include <string>
+#include <cstdint>
+#include <unordered_map>
+
+namespace OSM {
+
+// Flat file of node coordinates indexed by node id and mapped in memory. Each slot holds the fixed point latitude
+// and longitude of a node (8 bytes), so the file size is proportional to the largest node id; slots of missing ids
+// are never written and remain holes in the (sparse) file. It keeps coordinates of very large inputs out of the
+// process heap and lets the operating system page cache hold the working set.
+
+class NodeLocationFile {
+public:
+
+    NodeLocationFile() ;
+    ~NodeLocationFile() ;
+
+    // create (or truncate) the file at given path, the file is deleted when the object is destroyed
+    bool create(const std::string &path) ;
+
+    bool isOpen() const { return fd_ != -1 ; }
+
+    // store the coordinates of a node, returns false if the file cannot be grown to hold the id
+    bool set(int64_t id, int32_t lat, int32_t lon) ;
+    void get(int64_t id, int32_t &lat, int32_t &lon) const ;
+
+private:
+
+    NodeLocationFile(const NodeLocationFile &) = delete ;
+    NodeLocationFile &operator = (const NodeLocationFile &) = delete ;
+
+    bool grow(uint64_t min_slots) ;
+    void close() ;
+
+    int fd_ ;
+    int32_t *data_ ;
+    uint64_t capacity_ ;       // number of slots currently mapped
+    std::string path_ ;
+
+    // negative ids (e.g. new objects in editor files) cannot index the file
+    std::unordered_map<int64_t, std::pair<int32_t, int32_t> > negative_ ;
+};
+
+}
+
+#endif
@@ -0,0 +1,493 @@
+#include <osm_document.hpp>
+
+#include <mapped_file.hpp>
+
+#include <cstring>
+
+using namespace std ;
+
+// Reader of the o5m format and of its change variant o5c (see https://wiki.openstreetmap.org/wiki/O5m). The file is a
+// sequence of datasets, each a type byte followed by its length, except for the single byte reset (0xff) and end
+// (0xfe) markers. Ids, coordinates and member references are delta coded and strings are either given inline or as
+// a back reference into a table of the most recent ones. Deltas and table are cleared by every reset. Since both
+// carry state from one entity to the next, the file is decoded sequentially, also for entities that are not kept.
+
+namespace OSM {
+
+namespace {
+
+// position in a dataset, reads past the end set the failed flag
+
+class O5mCursor {
+public:
+
+    O5mCursor(const unsigned char *begin, const unsigned char *end): p_(begin), end_(end) {}
+
+    bool atEnd() const { return p_ >= end_ ; }
+    bool failed() const { return failed_ ; }
+
+    uint64_t uvarint() {
+        uint64_t v = 0 ;
+
+        for( int shift = 0 ; p_ < end_ && shift < 64 ; shift += 7 )
+        {
+            unsigned char b = *p_++ ;
+            v |= (uint64_t)( b & 0x7f ) << shift ;
+            if ( !( b & 0x80 ) ) return v ;
+        }
+
+        failed_ = true ;
+        return 0 ;
+    }
+
+    // the lowest bit is the sign
+    int64_t svarint() {
+        uint64_t u = uvarint() ;
+        return ( u & 1 ) ? -(int64_t)( u >> 1 ) - 1 : (int64_t)( u >> 1 ) ;
+    }
+
+    // advance past the next n zero terminated strings, returns their start
+    const char *strings(int n) {
+        const unsigned char *start = p_ ;
+
+        while ( n > 0 && p_ < end_ )
+            if ( *p_++ == 0 ) --n ;
+
+        if ( n > 0 ) failed_ = true ;
+
+        return (const char *)start ;
+    }
+
+    const unsigned char *p_, *end_ ;
+
+private:
+
+    bool failed_ = false ;
+};
+
+// The table holds the last 15000 inline strings (or string pairs) of at most 250 characters. Entries also cache the
+// pool ids they were decoded to, so that each distinct tag or role is interned and tested against the tag filter
+// once per table entry instead of once per use.
+
+class O5mStringTable {
+public:
+
+    static const size_t Size = 15000 ;
+    static const size_t MaxLength = 250 + 2 ; // including the terminators
+
+    enum Kind { Raw, Tag, Member } ;
+
+    struct Entry {
+        char data_[MaxLength] ;
+        size_t size_ ;
+
+        Kind kind_ ;            // what the ids below were decoded for
+        uint32_t key_, val_ ;   // tag key (or TagFilter::Dropped) and value, or member type and role
+    };
+
+    O5mStringTable(): entries_(Size) {}
+
+    void clear() { count_ = next_ = 0 ; }
+
+    // store the string of given size, returns null if it is too long for the table
+    Entry *add(const char *s, size_t n) {
+        if ( n > MaxLength ) return nullptr ;
+
+        Entry &e = entries_[next_] ;
+        memcpy(e.data_, s, n) ;
+        e.size_ = n ;
+        e.kind_ = Raw ;
+
+        next_ = ( next_ + 1 ) % Size ;
+        if ( count_ < Size ) ++count_ ;
+
+        return &e ;
+    }
+
+    // the entry added ref strings ago (1 is the last one), null if there is none
+    Entry *get(uint64_t ref) {
+        if ( ref == 0 || ref > count_ ) return nullptr ;
+        return &entries_[( next_ + Size - ref ) % Size] ;
+    }
+
+private:
+
+    vector<Entry> entries_ ;
+    size_t count_ = 0, next_ = 0 ;
+};
+
+// a string read from a dataset, entry_ is set if it is in the table
+
+struct O5mString {
+    const char *data_ = nullptr ;
+    O5mStringTable::Entry *entry_ = nullptr ;
+};
+
+class O5mDecoder {
+public:
+
+    O5mDecoder(const TagFilter *filter): filter_(filter) {}
+
+    void reset() ;
+
+    // entities without anything after the version information are deleted (only found in change files). Tags,
+    // nodes and members are only decoded into the given containers if these are not null, otherwise the dataset is
+    // just consumed. The tags of a node are read separately, once it is known whether it is kept.
+
+    bool node(O5mCursor &c, int64_t &id, int32_t &lat, int32_t &lon, bool &deleted) ;
+    bool tags(O5mCursor &c, TagList *tags) ;
+    bool way(O5mCursor &c, int64_t &id, vector<int64_t> *nodes, TagList *tags, bool &deleted) ;
+    bool relation(O5mCursor &c, int64_t &id, vector<int64_t> *members, vector<uint32_t> *roles, TagList *tags, bool &deleted) ;
+
+private:
+
+    bool string(O5mCursor &c, int n, O5mString &s) ;
+    bool info(O5mCursor &c) ;
+
+    const TagFilter *filter_ ;
+    O5mStringTable table_ ;
+
+    int64_t id_ = 0, timestamp_ = 0, changeset_ = 0 ;
+    int64_t lat_ = 0, lon_ = 0, way_node_ = 0 ;
+    int64_t member_[3] = { 0, 0, 0 } ; // member references are delta coded per member type
+};
+
+void O5mDecoder::reset()
+{
+    table_.clear() ;
+
+    id_ = timestamp_ = changeset_ = 0 ;
+    lat_ = lon_ = way_node_ = 0 ;
+    member_[0] = member_[1] = member_[2] = 0 ;
+}
+
+// a string of n parts, inline ones are added to the table
+
+bool O5mDecoder::string(O5mCursor &c, int n, O5mString &s)
+{
+    if ( c.atEnd() ) return false ;
+
+    if ( *c.p_ == 0 )
+    {
+        ++c.p_ ;
+
+        s.data_ = c.strings(n) ;
+        s.entry_ = c.failed() ? nullptr : table_.add(s.data_, (const char *)c.p_ - s.data_) ;
+    }
+    else
+    {
+        s.entry_ = table_.get(c.uvarint()) ;
+        if ( !s.entry_ ) return false ;
+
+        s.data_ = s.entry_->data_ ;
+    }
+
+    return !c.failed() ;
+}
+
+// version, timestamp, changeset and author are skipped
+
+bool O5mDecoder::info(O5mCursor &c)
+{
+    uint64_t version = c.uvarint() ;
+
+    if ( version == 0 || c.atEnd() ) return !c.failed() ;
+
+    timestamp_ += c.svarint() ;
+
+    if ( timestamp_ == 0 || c.atEnd() ) return !c.failed() ;
+
+    changeset_ += c.svarint() ;
+
+    if ( c.atEnd() ) return !c.failed() ;
+
+    // the author is a uid/user pair with the uid as a varint, an anonymous author is a single zero uid
+
+    if ( *c.p_ == 0 )
+    {
+        ++c.p_ ;
+
+        const char *start = (const char *)c.p_ ;
+        uint64_t uid = c.uvarint() ;
+
+        if ( c.atEnd() ) return false ;
+        ++c.p_ ;
+
+        if ( uid == 0 ) table_.add("\0\0", 2) ;
+        else {
+            c.strings(1) ;
+            table_.add(start, (const char *)c.p_ - start) ;
+        }
+    }
+    else if ( !table_.get(c.uvarint()) ) return false ;
+
+    return !c.failed() ;
+}
+
+bool O5mDecoder::tags(O5mCursor &c, TagList *tags)
+{
+    while ( !c.atEnd() )
+    {
+        O5mString s ;
+
+        if ( !string(c, 2, s) ) return false ;
+
+        if ( !tags ) continue ;
+
+        uint32_t key, val ;
+
+        if ( s.entry_ && s.entry_->kind_ == O5mStringTable::Tag ) {
+            key = s.entry_->key_ ;
+            val = s.entry_->val_ ;
+        }
+        else
+        {
+            std::string k(s.data_), v(s.data_ + k.size() + 1) ;
+
+            key = ( filter_ && !filter_->accepts(k) ) ? TagFilter::Dropped : StringPool::intern(k) ;
+            val = ( key == TagFilter::Dropped ) ? TagFilter::Dropped : StringPool::intern(v) ;
+
+            if ( s.entry_ ) {
+                s.entry_->kind_ = O5mStringTable::Tag ;
+                s.entry_->key_ = key ;
+                s.entry_->val_ = val ;
+            }
+        }
+
+        if ( key != TagFilter::Dropped ) tags->add(key, val) ;
+    }
+
+    return true ;
+}
+
+bool O5mDecoder::node(O5mCursor &c, int64_t &id, int32_t &lat, int32_t &lon, bool &deleted)
+{
+    id = ( id_ += c.svarint() ) ;
+
+    if ( !info(c) ) return false ;
+
+    deleted = c.atEnd() ;
+    if ( deleted ) return true ;
+
+    // coordinates in 1e-7 degrees as in NodeStore
+
+    lon_ += c.svarint() ;
+    lat_ += c.svarint() ;
+
+    if ( c.failed() ) return false ;
+
+    lat = lat_ ;
+    lon = lon_ ;
+
+    return true ;
+}
+
+bool O5mDecoder::way(O5mCursor &c, int64_t &id, vector<int64_t> *nodes, TagList *tags, bool &deleted)
+{
+    id = ( id_ += c.svarint() ) ;
+
+    if ( !info(c) ) return false ;
+
+    deleted = c.atEnd() ;
+    if ( deleted ) return true ;
+
+    uint64_t size = c.uvarint() ;
+    if ( c.failed() || size > (uint64_t)( c.end_ - c.p_ ) ) return false ;
+
+    O5mCursor refs(c.p_, c.p_ + size) ;
+    c.p_ += size ;
+
+    while ( !refs.atEnd() )
+    {
+        way_node_ += refs.svarint() ;
+        if ( nodes ) nodes->push_back(way_node_) ;
+    }
+
+    if ( refs.failed() ) return false ;
+
+    return this->tags(c, tags) ;
+}
+
+bool O5mDecoder::relation(O5mCursor &c, int64_t &id, vector<int64_t> *members, vector<uint32_t> *roles, TagList *tags, bool &deleted)
+{
+    id = ( id_ += c.svarint() ) ;
+
+    if ( !info(c) ) return false ;
+
+    deleted = c.atEnd() ;
+    if ( deleted ) return true ;
+
+    uint64_t size = c.uvarint() ;
+    if ( c.failed() || size > (uint64_t)( c.end_ - c.p_ ) ) return false ;
+
+    O5mCursor refs(c.p_, c.p_ + size) ;
+    c.p_ += size ;
+
+    while ( !refs.atEnd() )
+    {
+        int64_t delta = refs.svarint() ;
+
+        // the type (0 node, 1 way, 2 relation) followed by the role
+
+        O5mString s ;
+
+        if ( refs.failed() || !string(refs, 1, s) ) return false ;
+
+        uint32_t type, role ;
+
+        if ( s.entry_ && s.entry_->kind_ == O5mStringTable::Member ) {
+            type = s.entry_->key_ ;
+            role = s.entry_->val_ ;
+        }
+        else
+        {
+            if ( s.data_[0] < '0' || s.data_[0] > '2' ) return false ;
+
+            type = s.data_[0] - '0' ;
+            role = roles ? StringPool::intern(s.data_ + 1) : 0 ;
+
+            if ( s.entry_ && roles ) {
+                s.entry_->kind_ = O5mStringTable::Member ;
+                s.entry_->key_ = type ;
+                s.entry_->val_ = role ;
+            }
+        }
+
+        int64_t ref = ( member_[type] += delta ) ;
+
+        if ( members ) {
+            members[type].push_back(ref) ;
+            roles[type].push_back(role) ;
+        }
+    }
+
+    return this->tags(c, tags) ;
+}
+
+}
+
+bool Document::readO5M(const string &fileName, References &refs, int what, const NodePredicate &keep_node, const ClipRegion *clip)
+{
+    MappedFile file ;
+
+    if ( !file.open(fileName) ) return false ;
+
+    const unsigned char *p = (const unsigned char *)file.data(), *end = p + file.size() ;
+
+    O5mDecoder decoder(tag_filter_.get()) ;
+
+    bool is_change = false, has_header = false ;
+
+    while ( p < end )
+    {
+        unsigned char type = *p++ ;
+
+        // single byte markers
+
+        if ( type >= 0xf0 )
+        {
+            if ( type == 0xff ) decoder.reset() ;
+            else if ( type == 0xfe ) break ;
+            continue ;
+        }
+
+        O5mCursor header(p, end) ;
+        uint64_t size = header.uvarint() ;
+
+        if ( header.failed() || size > (uint64_t)( end - header.p_ ) ) return false ;
+
+        O5mCursor c(header.p_, header.p_ + size) ;
+        p = header.p_ + size ;
+
+        bool deleted ;
+
+        if ( type == 0xe0 && !has_header )
+        {
+            if ( size != 4 || ( memcmp(c.p_, "o5m2", 4) != 0 && memcmp(c.p_, "o5c2", 4) != 0 ) ) return false ;
+
+            is_change = c.p_[2] == 'c' ;
+            has_header = true ;
+        }
+        else if ( !has_header ) return false ;
+        else if ( type == 0x10 )
+        {
+            int64_t id ;
+            int32_t lat = 0, lon = 0 ;
+
+            if ( !decoder.node(c, id, lat, lon, deleted) ) return false ;
+
+            // tags of discarded nodes are not interned, a deleted node has no location
+
+            bool keep = ( what & LoadNodes ) && ( !deleted || is_change ) &&
+                    ( !clip || deleted || clip->contains(NodeStore::fromFixed(lat), NodeStore::fromFixed(lon)) ) ;
+
+            TagList tags ;
+
+            if ( !decoder.tags(c, keep ? &tags : nullptr) ) return false ;
+
+            if ( !keep ) continue ;
+
+            if ( keep_node ) {
+                Node node ;
+                node.id_ = id ;
+                node.lat_ = NodeStore::fromFixed(lat) ;
+                node.lon_ = NodeStore::fromFixed(lon) ;
+                node.tags_ = std::move(tags) ;
+
+                if ( !keep_node(node) ) continue ;
+
+                if ( !nodes_.add(node.id_, node.lat_, node.lon_, std::move(node.tags_)) ) return false ;
+            }
+            else if ( !nodes_.add(id, NodeStore::fromFixed(lat), NodeStore::fromFixed(lon), std::move(tags)) ) return false ;
+
+            if ( is_change ) refs.node_deleted_.push_back(deleted) ;
+        }
+        else if ( type == 0x11 )
+        {
+            bool load = what & LoadWays ;
+
+            Way way ;
+            vector<int64_t> nodes ;
+
+            if ( !decoder.way(c, way.id_, load ? &nodes : nullptr, load ? &way.tags_ : nullptr, deleted) ) return false ;
+
+            if ( !load || ( deleted && !is_change ) ) continue ;
+
+            refs.way_nodes_.push_back(std::move(nodes)) ;
+            ways_.push_back(std::move(way)) ;
+
+            if ( is_change ) refs.way_deleted_.push_back(deleted) ;
+        }
+        else if ( type == 0x12 )
+        {
+            bool load = what & LoadRelations ;
+
+            Relation relation ;
+            vector<int64_t> members[3] ;
+            vector<uint32_t> roles[3] ;
+
+            if ( !decoder.relation(c, relation.id_, load ? members : nullptr, load ? roles : nullptr,
+                                   load ? &relation.tags_ : nullptr, deleted) ) return false ;
+
+            if ( !load || ( deleted && !is_change ) ) continue ;
+
+            refs.rel_nodes_.push_back(std::move(members[0])) ;
+            refs.rel_ways_.push_back(std::move(members[1])) ;
+            refs.rel_rels_.push_back(std::move(members[2])) ;
+
+            refs.rel_node_roles_.push_back(std::move(roles[0])) ;
+            refs.rel_way_roles_.push_back(std::move(roles[1])) ;
+            refs.rel_rel_roles_.push_back(std::move(roles[2])) ;
+
+            relations_.push_back(std::move(relation)) ;
+
+            if ( is_change ) refs.rel_deleted_.push_back(deleted) ;
+        }
+
+        // other datasets (bounding box, timestamp, sync and jump) are skipped
+    }
+
+    return has_header ;
+}
+
+}
@@ -0,0 +1,127 @@
+#include "osm_pbf_index.hpp"
+
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+
+using namespace std ;
+
+#define PBF_INDEX_MAGIC "OSMPBFIX"
+#define PBF_INDEX_VERSION 1
+
+namespace OSM {
+
+namespace {
+
+struct IndexHeader {
+    char magic_[8] ;
+    uint32_t version_ ;
+    uint32_t entry_size_ ;
+    uint64_t file_size_ ;
+    int64_t file_mtime_ ;
+    uint64_t count_ ;
+};
+
+}
+
+static bool file_stamp(const string &fileName, uint64_t &size, int64_t &mtime)
+{
+    struct stat st ;
+
+    if ( stat(fileName.c_str(), &st) != 0 ) return false ;
+
+    size = st.st_size ;
+    mtime = st.st_mtime ;
+
+    return true ;
+}
+
+PbfIndex::Entry::Entry(): offset_(0),
+    min_id_(std::numeric_limits<int64_t>::max()), max_id_(std::numeric_limits<int64_t>::min()),
+    min_lat_(std::numeric_limits<int32_t>::max()), min_lon_(std::numeric_limits<int32_t>::max()),
+    max_lat_(std::numeric_limits<int32_t>::min()), max_lon_(std::numeric_limits<int32_t>::min()),
+    types_(0), reserved_(0) {}
+
+void PbfIndex::Entry::add(uint32_t type, int64_t id)
+{
+    types_ |= type ;
+    min_id_ = std::min(min_id_, id) ;
+    max_id_ = std::max(max_id_, id) ;
+}
+
+void PbfIndex::Entry::addLocation(int32_t lat, int32_t lon)
+{
+    min_lat_ = std::min(min_lat_, lat) ;
+    max_lat_ = std::max(max_lat_, lat) ;
+    min_lon_ = std::min(min_lon_, lon) ;
+    max_lon_ = std::max(max_lon_, lon) ;
+}
+
+bool PbfIndex::load(const string &pbfFile)
+{
+    entries_.clear() ;
+
+    IndexHeader header ;
+    uint64_t file_size ;
+    int64_t file_mtime ;
+
+    if ( !file_stamp(pbfFile, file_size, file_mtime) ) return false ;
+
+    FILE *fp = fopen(indexPath(pbfFile).c_str(), "rb") ;
+
+    if ( !fp ) return false ;
+
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+            memcmp(header.magic_, PBF_INDEX_MAGIC, sizeof(header.magic_)) == 0 &&
+            header.version_ == PBF_INDEX_VERSION &&
+            header.entry_size_ == sizeof(Entry) &&
+            header.file_size_ == file_size &&
+            header.file_mtime_ == file_mtime ;
+
+    if ( ok ) {
+        entries_.resize(header.count_) ;
+        ok = fread(entries_.data(), sizeof(Entry), entries_.size(), fp) == entries_.size() ;
+    }
+
+    fclose(fp) ;
+
+    if ( !ok ) entries_.clear() ;
+
+    return ok ;
+}
+
+bool PbfIndex::save(const string &pbfFile) const
+{
+    IndexHeader header ;
+
+    memcpy(header.magic_, PBF_INDEX_MAGIC, sizeof(header.magic_)) ;
+    header.version_ = PBF_INDEX_VERSION ;
+    header.entry_size_ = sizeof(Entry) ;
+    header.count_ = entries_.size() ;
+
+    if ( !file_stamp(pbfFile, header.file_size_, header.file_mtime_) ) return false ;
+
+    // write to a temporary file first so that concurrent readers never see a partial index
+
+    string path = indexPath(pbfFile), tmp_path = path + ".tmp" ;
+
+    FILE *fp = fopen(tmp_path.c_str(), "wb") ;
+
+    if ( !fp ) return false ;
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+            fwrite(entries_.data(), sizeof(Entry), entries_.size(), fp) == entries_.size() ;
+
+    ok = ( fclose(fp) == 0 ) && ok ;
+
+    if ( ok ) ok = rename(tmp_path.c_str(), path.c_str()) == 0 ;
+
+    if ( !ok ) remove(tmp_path.c_str()) ;
+
+    return ok ;
+}
+
+}
@@ -0,0 +1,45 @@
+#ifndef __OSM_PBF_INDEX_H__
+#define __OSM_PBF_INDEX_H__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace OSM {
+
+// Sidecar index of the blocks of a PBF file, stored next to it as <file>.idx. For every blob frame it records the
+// file offset, the types of the entities it contains, their id range and the extent of its nodes, so that readers
+// can seek directly to the blocks they need. The index stores the size and modification time of the PBF file and is
+// ignored once these no longer match. It is a local cache and is written in native byte order.
+
+class PbfIndex {
+public:
+
+    struct Entry {
+        Entry() ;
+
+        // extend id range with an entity of the given type (see Document::LoadNodes etc.) and node extent with a location
+        void add(uint32_t type, int64_t id) ;
+        void addLocation(int32_t lat, int32_t lon) ;
+
+        uint64_t offset_ ;                          // start of the frame in the file
+        int64_t min_id_, max_id_ ;                  // id range over all entities of the block
+        int32_t min_lat_, min_lon_, max_lat_, max_lon_ ; // node extent in fixed point (see NodeStore::toFixed)
+        uint32_t types_ ;                           // mask of the entity types in the block, 0 for header blocks
+        uint32_t reserved_ ;
+    };
+
+    // load index of given PBF file, fails if there is none or it is out of date
+    bool load(const std::string &pbfFile) ;
+
+    // save index of given PBF file
+    bool save(const std::string &pbfFile) const ;
+
+    static std::string indexPath(const std::string &pbfFile) { return pbfFile + ".idx" ; }
+
+    std::vector<Entry> entries_ ;
+};
+
+}
+
+#endif
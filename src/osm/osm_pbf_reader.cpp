@@ -1,86 +1,163 @@
 #include <osm_document.hpp>
+#include <osm_pbf_index.hpp>
+
+#include <mapped_file.hpp>
 
 #include <fileformat.pb.h>
 #include <osmformat.pb.h>
-
-#include <fstream>
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/coded_stream.h>
+
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
 #ifndef _WIN32
 #include <arpa/inet.h>
 #endif
 #include <zlib.h>
 
+#include <boost/iterator/indirect_iterator.hpp>
+
 using namespace std ;
 
 #define MAX_BLOCK_HEADER_SIZE 64*1024
 #define MAX_BLOB_SIZE 32*1024*1024
+#define MAX_ARENA_BLOCK_SIZE 64*1024*1024
 #define NANO_DEGREE .000000001
 
 namespace OSM {
 
 using PBF::BlockHeader ;
-using PBF::Blob ;
 using PBF::PrimitiveGroup ;
 using PBF::StringTable ;
 using PBF::HeaderBlock;
 using PBF::PrimitiveBlock ;
 using PBF::DenseNodes ;
 
-static uint32_t get_length(ifstream &input)
+static uint32_t get_length(const char *data)
 {
-    char buf[4];
-
-    if ( !input.read(buf, sizeof(buf) ) ) return 0;
+    uint32_t len ;
+    memcpy(&len, data, sizeof(len)) ;
 
-    return ntohl(*((size_t *)buf));
+    return ntohl(len) ;
 }
 
-static bool read_header(BlockHeader &header_msg, ifstream &input)
+// locate the next frame of the mapped file starting at offset. Returns false at the end of the file or, with error
+// set, if the frame is malformed or truncated.
+
+static bool next_frame(const MappedFile &file, size_t &offset, BlockHeader &header_msg, const char *&blob, size_t &blob_size, bool &error)
 {
-    size_t length = get_length(input);
+    error = false ;
+
+    size_t remaining = file.size() - offset ;
+
+    if ( remaining == 0 ) return false ;
+
+    error = true ;
+
+    if ( remaining < 4 ) return false ;
+
+    size_t length = get_length(file.data() + offset) ;
+
+    offset += 4 ; remaining -= 4 ;
+
+    if ( length == 0 || length > MAX_BLOCK_HEADER_SIZE || length > remaining ) return false ;
+
+    if ( !header_msg.ParseFromArray(file.data() + offset, length) ) return false ;
 
-    if ( length == 0 ) return false ;
+    offset += length ; remaining -= length ;
 
-    std::unique_ptr<char []> buf(new char [length]) ;
+    int32_t datasize = header_msg.datasize() ;
 
-    if ( !buf || !input.read(buf.get(), length) ) return false ;
+    if ( datasize <= 0 || datasize > MAX_BLOB_SIZE || (size_t)datasize > remaining ) return false ;
 
-    return header_msg.ParseFromArray(buf.get(), length) ;
+    blob = file.data() + offset ;
+    blob_size = datasize ;
+
+    offset += datasize ;
+
+    error = false ;
+
+    return true ;
 }
 
-static bool read_blob(Blob &blob_msg, ifstream &input, int32_t length)
+// Blob message fields pointing into the mapped file. The message is decoded by hand since the generated parser would
+// copy the (large) payload into a string.
+
+struct BlobView {
+    const char *raw_ = nullptr, *zlib_data_ = nullptr ;
+    uint32_t raw_len_ = 0, zlib_len_ = 0 ;
+    int32_t raw_size_ = 0 ;
+};
+
+static bool parse_blob(const char *data, size_t size, BlobView &blob)
 {
-    std::unique_ptr<char []> buf(new char [length]) ;
+    google::protobuf::io::CodedInputStream strm((const uint8_t *)data, size) ;
+
+    while ( uint32_t tag = strm.ReadTag() )
+    {
+        uint32_t field = tag >> 3, wire_type = tag & 7 ;
+
+        if ( wire_type == 0 ) { // varint
+            uint64_t val ;
+            if ( !strm.ReadVarint64(&val) ) return false ;
+            if ( field == 2 ) blob.raw_size_ = (int32_t)val ;
+        }
+        else if ( wire_type == 2 ) { // length delimited
+            uint32_t len ;
+            if ( !strm.ReadVarint32(&len) ) return false ;
+
+            int pos = strm.CurrentPosition() ;
+            if ( len > size - pos ) return false ;
+
+            if ( field == 1 ) {
+                blob.raw_ = data + pos ;
+                blob.raw_len_ = len ;
+            }
+            else if ( field == 3 ) {
+                blob.zlib_data_ = data + pos ;
+                blob.zlib_len_ = len ;
+            }
 
-    if ( !buf || !input.read(buf.get(), length) ) return false ;
+            if ( !strm.Skip(len) ) return false ;
+        }
+        else if ( wire_type == 1 ) { // fixed64
+            if ( !strm.Skip(8) ) return false ;
+        }
+        else if ( wire_type == 5 ) { // fixed32
+            if ( !strm.Skip(4) ) return false ;
+        }
+        else return false ;
+    }
 
-    return blob_msg.ParseFromArray(buf.get(), length) ;
+    return strm.ConsumedEntireMessage() ;
 }
 
-static bool uncompress_blob(PBF::Blob &bmsg, char *ubuf)
+static bool uncompress_blob(const BlobView &blob, char *ubuf, size_t usize)
 {
-    if ( bmsg.has_raw() ) {
-        memcpy(ubuf, bmsg.raw().data(), bmsg.raw().size());
+    if ( blob.raw_ ) {
+        memcpy(ubuf, blob.raw_, usize);
     }
-    else if ( bmsg.has_zlib_data() ) {
+    else if ( blob.zlib_data_ ) {
 
         int ret;
         z_stream strm;
         strm.zalloc = Z_NULL;
         strm.zfree = Z_NULL;
         strm.opaque = Z_NULL;
-        strm.avail_in = bmsg.zlib_data().size();
-        strm.next_in = (unsigned char *)bmsg.zlib_data().data();
-        strm.avail_out = bmsg.raw_size();
+        strm.avail_in = blob.zlib_len_;
+        strm.next_in = (unsigned char *)blob.zlib_data_;
+        strm.avail_out = usize;
         strm.next_out = (unsigned char *)ubuf;
 
         ret = inflateInit(&strm);
 
-        if (ret != Z_OK) {
-            delete [] ubuf ;
-            return false ;
-        }
+        if (ret != Z_OK) return false ;
 
-        ret = inflate(&strm, Z_NO_FLUSH);
+        ret = inflate(&strm, Z_FINISH);
 
         (void)inflateEnd(&strm);
 
@@ -92,47 +169,55 @@ static bool uncompress_blob(PBF::Blob &bmsg, char *ubuf)
     return true ;
 }
 
-static string make_id(int64_t id)
-{
-    stringstream s ;
-    s << id ;
-    return s.str() ;
-}
+// entities decoded from a single OSMData block, merged into the document in file order
+
+struct DataBlock {
+    NodeStore nodes_ ;
+
+    vector<Way> ways_ ;
+    vector< vector<int64_t> > way_node_refs_ ;
+
+    vector<Relation> relations_ ;
+    vector< vector<int64_t> > rel_node_refs_, rel_way_refs_, rel_rel_refs_ ;
+    vector< vector<uint32_t> > rel_node_roles_, rel_way_roles_, rel_rel_roles_ ;
+
+    PbfIndex::Entry info_ ; // block summary for the index
+};
 
-static bool process_osm_data_nodes(vector<Node> &nodes, map<int64_t, uint64_t> &nodeMap, const PrimitiveGroup &group, const StringTable &string_table, double lat_offset, double lon_offset, double granularity)
+// nodes outside the clip region (if given) are discarded before their tags are decoded
+
+static bool process_osm_data_nodes(DataBlock &block, const PrimitiveGroup &group, const vector<uint32_t> &strings, const vector<uint32_t> &keys, double lat_offset, double lon_offset, double granularity, const ClipRegion *clip)
 {
 
     for ( unsigned node_id = 0; node_id < group.nodes_size() ; node_id++ )
     {
         const PBF::Node &node = group.nodes(node_id) ;
 
-        nodes.push_back(Node()) ;
-        Node &n = nodes.back() ;
-
-        n.id_ = make_id(node.id()) ;
+        double lat = lat_offset + (node.lat() * granularity);
+        double lon = lon_offset + (node.lon() * granularity);
 
-        n.lat_ = lat_offset + (node.lat() * granularity);
-        n.lon_ = lon_offset + (node.lon() * granularity);
+        if ( clip && !clip->contains(lat, lon) ) continue ;
 
-        nodeMap.insert(make_pair(node.id(), nodes.size()-1)) ;
+        TagList tags ;
 
         for ( unsigned key_id = 0; key_id < node.keys_size() ; key_id++ )
         {
             uint32_t key_idx = node.keys(key_id) ;
             uint32_t val_idx = node.vals(key_id) ;
 
-            string key = string_table.s(key_idx) ;
-            string val = string_table.s(val_idx) ;
+            if ( key_idx >= strings.size() || val_idx >= strings.size() ) return false ;
 
-            n.tags_.add(key, val) ;
+            if ( keys[key_idx] != TagFilter::Dropped ) tags.add(keys[key_idx], strings[val_idx]) ;
         }
+
+        block.nodes_.add(node.id(), lat, lon, std::move(tags)) ;
     }
 
     return true ;
 
 }
 
-static bool process_osm_data_dense_nodes(vector<Node> &nodes, map<int64_t, uint64_t> &nodeMap, const PrimitiveGroup &group, const StringTable &string_table, double lat_offset, double lon_offset, double granularity)
+static bool process_osm_data_dense_nodes(DataBlock &block, const PrimitiveGroup &group, const vector<uint32_t> &strings, const vector<uint32_t> &keys, double lat_offset, double lon_offset, double granularity, const ClipRegion *clip)
 {
     if ( !group.has_dense() ) return true ;
 
@@ -143,38 +228,42 @@ static bool process_osm_data_dense_nodes(vector<Node> &nodes, map<int64_t, uint6
 
     const DenseNodes &dense = group.dense() ;
 
+    if ( !clip ) block.nodes_.reserve(dense.id_size()) ;
+
     for ( unsigned node_id = 0; node_id < dense.id_size() ; node_id++ )
     {
-        nodes.push_back(Node()) ;
-        Node &n = nodes.back() ;
+        TagList tags ;
 
         deltaid += dense.id(node_id) ;
         deltalat += dense.lat(node_id);
         deltalon += dense.lon(node_id) ;
 
-        n.id_ = make_id(deltaid) ;
+        double lat = lat_offset + (deltalat * granularity);
+        double lon = lon_offset + (deltalon * granularity);
+
+        bool keep = !clip || clip->contains(lat, lon) ;
 
-        nodeMap.insert(make_pair(deltaid, nodes.size()-1)) ;
+        // the tags of discarded nodes still have to be skipped
 
         if ( l < dense.keys_vals_size() )
         {
-            while (dense.keys_vals(l) != 0 && l < dense.keys_vals_size() )
+            while ( l < dense.keys_vals_size() && dense.keys_vals(l) != 0 )
             {
-                uint32_t key_idx = dense.keys_vals(l) ;
-                uint32_t val_idx = dense.keys_vals(l+1) ;
+                if ( keep ) {
+                    uint32_t key_idx = dense.keys_vals(l) ;
+                    uint32_t val_idx = dense.keys_vals(l+1) ;
 
-                string key = string_table.s(key_idx) ;
-                string val = string_table.s(val_idx) ;
+                    if ( key_idx >= strings.size() || val_idx >= strings.size() ) return false ;
 
-                n.tags_.add(key, val) ;
+                    if ( keys[key_idx] != TagFilter::Dropped ) tags.add(keys[key_idx], strings[val_idx]) ;
+                }
 
                 l += 2;
             }
             l++ ;
         }
 
-        n.lat_ = lat_offset + (deltalat * granularity);
-        n.lon_ = lon_offset + (deltalon * granularity);
+        if ( keep ) block.nodes_.add(deltaid, lat, lon, std::move(tags)) ;
 
     }
 
@@ -183,7 +272,7 @@ static bool process_osm_data_dense_nodes(vector<Node> &nodes, map<int64_t, uint6
 }
 
 
-static bool process_osm_data_ways(vector<Way> &ways, map<int64_t, uint64_t> &wayMap, vector< vector<int64_t> > &wayNodeMap, const PrimitiveGroup &group, const StringTable &string_table)
+static bool process_osm_data_ways(DataBlock &block, const PrimitiveGroup &group, const vector<uint32_t> &strings, const vector<uint32_t> &keys)
 {
     for ( unsigned way_id = 0; way_id < group.ways_size() ; way_id++ )
     {
@@ -191,26 +280,25 @@ static bool process_osm_data_ways(vector<Way> &ways, map<int64_t, uint64_t> &way
 
         const PBF::Way &way = group.ways(way_id) ;
 
-        ways.push_back(Way()) ;
-        Way &w = ways.back() ;
-
-        w.id_ = make_id(way.id()) ;
+        block.ways_.push_back(Way()) ;
+        Way &w = block.ways_.back() ;
 
-        wayMap.insert(make_pair(way.id(), ways.size()-1)) ;
+        w.id_ = way.id() ;
 
         for ( unsigned key_id = 0; key_id < way.keys_size() ; key_id++ )
         {
             uint32_t key_idx = way.keys(key_id) ;
             uint32_t val_idx = way.vals(key_id) ;
 
-            string key = string_table.s(key_idx) ;
-            string val = string_table.s(val_idx) ;
+            if ( key_idx >= strings.size() || val_idx >= strings.size() ) return false ;
 
-            w.tags_.add(key, val) ;
+            if ( keys[key_idx] != TagFilter::Dropped ) w.tags_.add(keys[key_idx], strings[val_idx]) ;
         }
 
-        wayNodeMap.push_back( vector<int64_t>() ) ;
-        vector<int64_t> &node_refs = wayNodeMap.back() ;
+        block.way_node_refs_.push_back( vector<int64_t>() ) ;
+        vector<int64_t> &node_refs = block.way_node_refs_.back() ;
+
+        node_refs.reserve(way.refs_size()) ;
 
         for ( unsigned ref_id = 0; ref_id < way.refs_size() ; ref_id++ )
         {
@@ -225,59 +313,55 @@ static bool process_osm_data_ways(vector<Way> &ways, map<int64_t, uint64_t> &way
 }
 
 
-static bool process_osm_data_relations(vector<Relation> &relations, map<int64_t, uint64_t> &relMap,
-                                       vector< vector<int64_t> > &relNodeMap, vector< vector<int64_t> > &relWayMap, vector< vector<int64_t> > &relRelMap,
-                                       vector< vector<string> > &roleNodeMap, vector< vector<string> > &roleWayMap, vector< vector<string> > &roleRelMap,
-                                       const PrimitiveGroup &group, const StringTable &string_table)
+static bool process_osm_data_relations(DataBlock &block, const PrimitiveGroup &group, const vector<uint32_t> &strings, const vector<uint32_t> &keys)
 {
     for ( unsigned rel_id = 0; rel_id < group.relations_size() ; rel_id++ )
     {
         const PBF::Relation &relation = group.relations(rel_id) ;
 
-        relations.push_back(Relation()) ;
-        Relation &r = relations.back() ;
-
-        r.id_ = make_id(relation.id()) ;
+        block.relations_.push_back(Relation()) ;
+        Relation &r = block.relations_.back() ;
 
-        relMap.insert(make_pair(relation.id(), relations.size()-1)) ;
+        r.id_ = relation.id() ;
 
         for ( unsigned key_id = 0; key_id < relation.keys_size() ; key_id++ )
         {
             uint32_t key_idx = relation.keys(key_id) ;
             uint32_t val_idx = relation.vals(key_id) ;
 
-            string key = string_table.s(key_idx) ;
-            string val = string_table.s(val_idx) ;
+            if ( key_idx >= strings.size() || val_idx >= strings.size() ) return false ;
 
-            r.tags_.add(key, val) ;
+            if ( keys[key_idx] != TagFilter::Dropped ) r.tags_.add(keys[key_idx], strings[val_idx]) ;
         }
 
-        relNodeMap.push_back( vector<int64_t>() ) ;
-        vector<int64_t> &node_refs = relNodeMap.back() ;
+        block.rel_node_refs_.push_back( vector<int64_t>() ) ;
+        vector<int64_t> &node_refs = block.rel_node_refs_.back() ;
 
-        relWayMap.push_back( vector<int64_t>() ) ;
-        vector<int64_t> &way_refs = relWayMap.back() ;
+        block.rel_way_refs_.push_back( vector<int64_t>() ) ;
+        vector<int64_t> &way_refs = block.rel_way_refs_.back() ;
 
-        relRelMap.push_back( vector<int64_t>() ) ;
-        vector<int64_t> &rel_refs = relRelMap.back() ;
+        block.rel_rel_refs_.push_back( vector<int64_t>() ) ;
+        vector<int64_t> &rel_refs = block.rel_rel_refs_.back() ;
 
-        roleNodeMap.push_back( vector<string>() ) ;
-        vector<string> &node_roles = roleNodeMap.back() ;
+        block.rel_node_roles_.push_back( vector<uint32_t>() ) ;
+        vector<uint32_t> &node_roles = block.rel_node_roles_.back() ;
 
-        roleWayMap.push_back( vector<string>() ) ;
-        vector<string> &way_roles = roleWayMap.back() ;
+        block.rel_way_roles_.push_back( vector<uint32_t>() ) ;
+        vector<uint32_t> &way_roles = block.rel_way_roles_.back() ;
 
-        roleRelMap.push_back( vector<string>() ) ;
-        vector<string> &rel_roles = roleRelMap.back() ;
+        block.rel_rel_roles_.push_back( vector<uint32_t>() ) ;
+        vector<uint32_t> &rel_roles = block.rel_rel_roles_.back() ;
 
-        uint64_t deltaref = 0 ;
+        int64_t deltaref = 0 ;
 
         for( unsigned member_id = 0 ; member_id < relation.memids_size() ; member_id++ )
         {
             deltaref += relation.memids(member_id) ;
 
-            int32_t role_id = relation.roles_sid(member_id) ;
-            string role = string_table.s(role_id) ;
+            uint32_t role_id = relation.roles_sid(member_id) ;
+            if ( role_id >= strings.size() ) return false ;
+
+            uint32_t role = strings[role_id] ;
 
             switch (relation.types(member_id) ) {
                 case PBF::Relation::NODE:
@@ -302,172 +386,509 @@ static bool process_osm_data_relations(vector<Relation> &relations, map<int64_t,
 
 }
 
-bool Document::readPBF(const string &fileName)
+// summarize the contents of an OSMData block for the index, regardless of the entity types being loaded
+
+static void summarize_primitive_block(const PrimitiveBlock &pb_msg, PbfIndex::Entry &info)
+{
+    double lat_offset = NANO_DEGREE * pb_msg.lat_offset();
+    double lon_offset = NANO_DEGREE * pb_msg.lon_offset();
+    double granularity = NANO_DEGREE * pb_msg.granularity();
+
+    for ( int j = 0; j < pb_msg.primitivegroup_size(); j++ )
+    {
+        const PrimitiveGroup &group = pb_msg.primitivegroup(j) ;
+
+        for ( int i = 0; i < group.nodes_size() ; i++ )
+        {
+            const PBF::Node &node = group.nodes(i) ;
+
+            info.add(Document::LoadNodes, node.id()) ;
+            info.addLocation(NodeStore::toFixed(lat_offset + node.lat() * granularity), NodeStore::toFixed(lon_offset + node.lon() * granularity)) ;
+        }
+
+        if ( group.has_dense() )
+        {
+            const DenseNodes &dense = group.dense() ;
+
+            int64_t id = 0, lat = 0, lon = 0 ;
+
+            for ( int i = 0; i < dense.id_size() ; i++ )
+            {
+                id += dense.id(i) ;
+                lat += dense.lat(i) ;
+                lon += dense.lon(i) ;
+
+                info.add(Document::LoadNodes, id) ;
+                info.addLocation(NodeStore::toFixed(lat_offset + lat * granularity), NodeStore::toFixed(lon_offset + lon * granularity)) ;
+            }
+        }
+
+        for ( int i = 0; i < group.ways_size() ; i++ )
+            info.add(Document::LoadWays, group.ways(i).id()) ;
+
+        for ( int i = 0; i < group.relations_size() ; i++ )
+            info.add(Document::LoadRelations, group.relations(i).id()) ;
+    }
+}
+
+// With a tag filter only the strings of the block used as keys or values of kept tags and as roles are interned, the
+// others are mapped to TagFilter::Dropped. Keys are tested once per string table entry and mapped separately, since a
+// string may be the value of a kept tag as well as the key of a dropped one (e.g. highway=service and
+// service=driveway).
+
+static void intern_kept_strings(const PrimitiveBlock &pb_msg, const TagFilter &filter, vector<uint32_t> &strings,
+                                vector<uint32_t> &keys)
 {
-    map<int64_t, uint64_t> nodeMap, wayMap, relMap ;
-    vector< vector<int64_t> > wayNodeMap, relNodeMap, relWayMap, relRelMap ;
-    vector< vector<string> > roleNodeMap, roleWayMap, roleRelMap ;
+    const StringTable &string_table = pb_msg.stringtable() ;
+    size_t n = string_table.s_size() ;
 
-    BlockHeader header_msg;
-    Blob blob_msg ;
+    vector<char> kept_key(n), used(n, 0) ;
 
-    ifstream input ;
-    input.open(fileName.c_str(), ios::in | ios::binary) ;
+    for( size_t i=0 ; i<n ; i++ )
+        kept_key[i] = filter.accepts(string_table.s(i)) ;
 
-    if ( !input ) return false ;
+    auto mark = [&](uint32_t key_idx, uint32_t val_idx) {
+        if ( key_idx < n && val_idx < n && kept_key[key_idx] ) used[key_idx] = used[val_idx] = 1 ;
+    } ;
 
-    while ( input.good() )
+    for ( int j = 0; j < pb_msg.primitivegroup_size(); j++ )
     {
-        // reader header and blob data
+        const PrimitiveGroup &group = pb_msg.primitivegroup(j) ;
+
+        for( const PBF::Node &node: group.nodes() )
+            for ( int k = 0; k < node.keys_size() ; k++ ) mark(node.keys(k), node.vals(k)) ;
+
+        if ( group.has_dense() )
+        {
+            const DenseNodes &dense = group.dense() ;
+
+            // key/value pairs with a zero delimiter after the tags of each node
 
-        if ( !read_header(header_msg, input) ) break ;
+            for ( int l = 0 ; l < dense.keys_vals_size() ; l++ )
+            {
+                if ( dense.keys_vals(l) == 0 || l + 1 == dense.keys_vals_size() ) continue ;
+                mark(dense.keys_vals(l), dense.keys_vals(l+1)) ;
+                ++l ;
+            }
+        }
 
-        if ( !read_blob(blob_msg, input, header_msg.datasize()) )
-           return false ;
+        for( const PBF::Way &way: group.ways() )
+            for ( int k = 0; k < way.keys_size() ; k++ ) mark(way.keys(k), way.vals(k)) ;
 
-       // uncompress data
+        for( const PBF::Relation &relation: group.relations() )
+        {
+            for ( int k = 0; k < relation.keys_size() ; k++ ) mark(relation.keys(k), relation.vals(k)) ;
 
-       size_t bsize = blob_msg.raw_size() ;
+            for ( int k = 0; k < relation.roles_sid_size() ; k++ )
+                if ( (uint32_t)relation.roles_sid(k) < n ) used[relation.roles_sid(k)] = 1 ;
+        }
+    }
 
-       std::unique_ptr<char []> bbuf(new char [bsize]) ;
+    vector<const string *> kept ;
+    vector<uint32_t> pos ;
 
-       if ( !bbuf || !uncompress_blob(blob_msg, bbuf.get()) ) return false ;
+    for( size_t i=0 ; i<n ; i++ )
+    {
+        if ( !used[i] ) continue ;
+        kept.push_back(&string_table.s(i)) ;
+        pos.push_back(i) ;
+    }
 
-       // process data
+    vector<uint32_t> ids(kept.size()) ;
+    StringPool::intern(boost::make_indirect_iterator(kept.begin()), boost::make_indirect_iterator(kept.end()), ids.data()) ;
 
-       if ( header_msg.type() == "OSMHeader" )
-       {
-           // Ignore header contents for now
+    strings.assign(n, TagFilter::Dropped) ;
 
-           HeaderBlock hb_msg ;
+    for( size_t k=0 ; k<pos.size() ; k++ )
+        strings[pos[k]] = ids[k] ;
 
-           if ( !hb_msg.ParseFromArray(bbuf.get(), bsize) ) return false ;
+    keys.assign(n, TagFilter::Dropped) ;
 
-       }
-       else if ( header_msg.type() == "OSMData" )
-       {
-           PrimitiveBlock pb_msg ;
+    for( size_t i=0 ; i<n ; i++ )
+        if ( kept_key[i] ) keys[i] = strings[i] ;
+}
 
-           if ( !pb_msg.ParseFromArray(bbuf.get(), bsize) ) return false ;
+// decode the entities of an OSMData block, the block summary is only filled in if an index is being built
 
-           double lat_offset = NANO_DEGREE * pb_msg.lat_offset();
-           double lon_offset = NANO_DEGREE * pb_msg.lon_offset();
-           double granularity = NANO_DEGREE * pb_msg.granularity();
+static bool decode_primitive_block(const PrimitiveBlock &pb_msg, int what, const ClipRegion *clip, const TagFilter *tags,
+                                   bool summarize, DataBlock &block)
+{
+    if ( summarize ) summarize_primitive_block(pb_msg, block.info_) ;
 
-           for ( int j = 0; j < pb_msg.primitivegroup_size(); j++ )
-           {
-                const PrimitiveGroup &group = pb_msg.primitivegroup(j) ;
-                const StringTable &string_table = pb_msg.stringtable() ;
+    double lat_offset = NANO_DEGREE * pb_msg.lat_offset();
+    double lon_offset = NANO_DEGREE * pb_msg.lon_offset();
+    double granularity = NANO_DEGREE * pb_msg.granularity();
 
+    // map the block string table to pool ids once, entities then refer to the ids directly
 
-                if ( !process_osm_data_nodes(nodes_, nodeMap, group, string_table, lat_offset, lon_offset, granularity) ) return false ;
-                if ( !process_osm_data_dense_nodes(nodes_, nodeMap, group, string_table, lat_offset, lon_offset, granularity) ) return false ;
-                if ( !process_osm_data_ways(ways_, wayMap, wayNodeMap, group, string_table) ) return false ;
-                if ( !process_osm_data_relations(relations_, relMap, relNodeMap, relWayMap, relRelMap,
-                                                 roleNodeMap, roleWayMap, roleRelMap,
-                                                 group, string_table) ) return false ;
-           }
-       }
+    const StringTable &string_table = pb_msg.stringtable() ;
 
-     } ;
+    vector<uint32_t> strings(string_table.s_size()), kept_keys ;
 
+    if ( tags ) intern_kept_strings(pb_msg, *tags, strings, kept_keys) ;
+    else StringPool::intern(string_table.s().begin(), string_table.s().end(), strings.data()) ;
 
-    // establish feature dependencies
+    // ids of the strings used as tag keys, TagFilter::Dropped for the keys of dropped tags
+    const vector<uint32_t> &keys = ( tags ) ? kept_keys : strings ;
 
-    for(int i=0 ; i<ways_.size() ; i++ )
+    for ( int j = 0; j < pb_msg.primitivegroup_size(); j++ )
     {
-        Way &way = ways_[i] ;
+        const PrimitiveGroup &group = pb_msg.primitivegroup(j) ;
 
-        vector<int64_t> &node_refs = wayNodeMap[i] ;
+        if ( what & Document::LoadNodes ) {
+            if ( !process_osm_data_nodes(block, group, strings, keys, lat_offset, lon_offset, granularity, clip) ) return false ;
+            if ( !process_osm_data_dense_nodes(block, group, strings, keys, lat_offset, lon_offset, granularity, clip) ) return false ;
+        }
+        if ( ( what & Document::LoadWays ) && !process_osm_data_ways(block, group, strings, keys) ) return false ;
+        if ( ( what & Document::LoadRelations ) && !process_osm_data_relations(block, group, strings, keys) ) return false ;
+    }
 
-        for(int j=0 ; j<node_refs.size() ; j++ )
-        {
+    return true ;
+}
 
-            int idx = nodeMap[node_refs[j]] ;
-            way.nodes_.push_back(idx) ;
+// buffers reused by a worker thread across blocks
 
-            nodes_[idx].ways_.push_back(i) ;
-        }
+struct DecodeBuffers {
+    vector<char> inflate_ ;     // uncompressed blob data
+    vector<char> arena_block_ ; // initial block of the message arena, sized after the largest block seen so far
+};
 
-    }
+// inflate and decode a single blob, this runs on the worker threads
+
+static bool decode_block(const string &type, const char *blob_data, size_t blob_size, int what, const ClipRegion *clip, const TagFilter *tags,
+                         bool summarize, DecodeBuffers &buffers, DataBlock &block)
+{
+    BlobView blob ;
+
+    if ( !parse_blob(blob_data, blob_size, blob) ) return false ;
+
+    // uncompress data
+
+    int64_t bsize = blob.raw_ ? blob.raw_len_ : blob.raw_size_ ;
+
+    if ( bsize < 0 || bsize > MAX_BLOB_SIZE ) return false ;
+
+    if ( buffers.inflate_.size() < (size_t)bsize ) buffers.inflate_.resize(bsize) ;
+
+    if ( !uncompress_blob(blob, buffers.inflate_.data(), bsize) ) return false ;
+
+    // process data
 
-    for(int i=0 ; i<relations_.size() ; i++ )
+    if ( type == "OSMHeader" )
     {
-        Relation &relation = relations_[i] ;
+        // Ignore header contents for now
 
-        vector<int64_t> &node_refs = relNodeMap[i] ;
-        vector<string> &node_roles = roleNodeMap[i] ;
+        HeaderBlock hb_msg ;
+
+        if ( !hb_msg.ParseFromArray(buffers.inflate_.data(), bsize) ) return false ;
+
+    }
+    else if ( type == "OSMData" )
+    {
+        // parse the block on an arena that starts on the reusable buffer, everything is released at once when the
+        // arena goes out of scope
+
+        google::protobuf::ArenaOptions options ;
+        options.initial_block = buffers.arena_block_.data() ;
+        options.initial_block_size = buffers.arena_block_.size() ;
+
+        size_t arena_used ;
+        bool ok ;
 
-        for(int j=0 ; j<node_refs.size() ; j++ )
         {
-            auto it = nodeMap.find(node_refs[j]) ;
+            google::protobuf::Arena arena(options) ;
 
-            if ( it != nodeMap.end() )
-            {
-                int idx = (*it).second ;
-                relation.nodes_.push_back(idx) ;
-                relation.nodes_role_.push_back(node_roles[j]) ;
+            PrimitiveBlock *pb_msg = google::protobuf::Arena::CreateMessage<PrimitiveBlock>(&arena) ;
 
-                nodes_[idx].relations_.push_back(i) ;
-            }
+            ok = pb_msg->ParseFromArray(buffers.inflate_.data(), bsize) && decode_primitive_block(*pb_msg, what, clip, tags, summarize, block) ;
+
+            arena_used = arena.SpaceAllocated() ;
         }
 
+        if ( arena_used > buffers.arena_block_.size() )
+            buffers.arena_block_.resize(std::min<size_t>(arena_used, MAX_ARENA_BLOCK_SIZE)) ;
+
+        return ok ;
     }
 
-    for(int i=0 ; i<relations_.size() ; i++ )
-    {
-        Relation &relation = relations_[i] ;
+    return true ;
+}
+
+// Decoding pipeline: a reader thread splits the mapped file into blob frames, a pool of workers inflates and decodes
+// them and the caller collects the decoded blocks in file order through next().
+
+class BlockPipeline {
+public:
+
+    // if offsets is given only the frames starting at these (increasing) offsets are read, if summarize is set the
+    // index summary of every block is computed
+    BlockPipeline(const MappedFile &file, int what, const ClipRegion *clip, const TagFilter *tags, const vector<uint64_t> *offsets,
+                  bool summarize, unsigned int n_workers) ;
+    ~BlockPipeline() ;
+
+    // get the next block in file order, returns false when all blocks have been consumed or an error occurred
+    bool next(DataBlock &block) ;
+
+    bool failed() const { return failed_ ; }
+
+private:
+
+    struct Frame {
+        size_t seq_ ;
+        size_t offset_ ;    // start of the frame
+        string type_ ;
+        const char *data_ ; // blob message inside the mapped file
+        size_t size_ ;
+    };
+
+    void readFrames() ;
+    void decodeFrames() ;
+    void abort() ;
+
+    const MappedFile &file_ ;
+    size_t offset_ = 0 ;
+    int what_ ;
+    const ClipRegion *clip_ ;
+    const TagFilter *tags_ ;
+    const vector<uint64_t> *offsets_ ;
+    bool summarize_ ;
+    size_t next_offset_ = 0 ;
+
+    std::mutex mutex_ ;
+    std::condition_variable frame_ready_, block_ready_, slot_free_ ;
+
+    std::deque<Frame> frames_ ;                             // frames waiting to be decoded
+    map<size_t, std::unique_ptr<DataBlock> > blocks_ ;      // decoded blocks waiting to be merged
+
+    size_t n_read_ = 0, n_merged_ = 0, max_in_flight_ ;
+    bool eof_ = false, failed_ = false ;
 
-        vector<int64_t> &way_refs = relWayMap[i] ;
-        vector<string> &way_roles = roleWayMap[i] ;
+    std::thread reader_ ;
+    std::vector<std::thread> workers_ ;
+};
+
+BlockPipeline::BlockPipeline(const MappedFile &file, int what, const ClipRegion *clip, const TagFilter *tags, const vector<uint64_t> *offsets,
+                             bool summarize, unsigned int n_workers):
+    file_(file), what_(what), clip_(clip), tags_(tags), offsets_(offsets), summarize_(summarize), max_in_flight_(4 * n_workers)
+{
+    reader_ = std::thread(&BlockPipeline::readFrames, this) ;
+
+    for( unsigned int i=0 ; i<n_workers ; i++ )
+        workers_.push_back(std::thread(&BlockPipeline::decodeFrames, this)) ;
+}
+
+BlockPipeline::~BlockPipeline()
+{
+    abort() ;
+
+    reader_.join() ;
+    for( auto &t: workers_ ) t.join() ;
+}
+
+void BlockPipeline::abort()
+{
+    std::unique_lock<std::mutex> lock(mutex_) ;
+
+    if ( !eof_ ) failed_ = true ;
+    eof_ = true ;
+
+    frame_ready_.notify_all() ;
+    block_ready_.notify_all() ;
+    slot_free_.notify_all() ;
+}
+
+void BlockPipeline::readFrames()
+{
+    BlockHeader header_msg ;
+
+    while ( true )
+    {
+        Frame frame ;
 
-        for(int j=0 ; j<way_refs.size() ; j++ )
         {
-            auto it = wayMap.find(way_refs[j]) ;
+            // bound the number of blocks held in memory
 
-            if ( it != wayMap.end() )
-            {
+            std::unique_lock<std::mutex> lock(mutex_) ;
+            slot_free_.wait(lock, [&]() { return eof_ || n_read_ - n_merged_ < max_in_flight_ ; }) ;
+            if ( eof_ ) return ;
+        }
 
-                int idx = (*it).second ;
-                relation.ways_.push_back(idx) ;
-                relation.ways_role_.push_back(way_roles[j]) ;
+        bool error = false, has_frame ;
 
-                ways_[idx].relations_.push_back(i) ;
+        if ( offsets_ ) {
+            // seek to the next frame selected from the block index
+            has_frame = next_offset_ < offsets_->size() ;
+
+            if ( has_frame ) {
+                offset_ = frame.offset_ = (*offsets_)[next_offset_++] ;
+                if ( offset_ >= file_.size() || !next_frame(file_, offset_, header_msg, frame.data_, frame.size_, error) )
+                    has_frame = false, error = true ;
             }
         }
+        else {
+            frame.offset_ = offset_ ;
+            has_frame = next_frame(file_, offset_, header_msg, frame.data_, frame.size_, error) ;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_) ;
+
+        if ( !has_frame ) {
+            if ( error ) failed_ = true ;
+            eof_ = true ;
+            frame_ready_.notify_all() ;
+            block_ready_.notify_all() ;
+            return ;
+        }
+
+        frame.seq_ = n_read_++ ;
+        frame.type_ = header_msg.type() ;
 
+        frames_.push_back(std::move(frame)) ;
+        frame_ready_.notify_one() ;
     }
+}
 
-    for(int i=0 ; i<relations_.size() ; i++ )
-    {
-        Relation &relation = relations_[i] ;
+void BlockPipeline::decodeFrames()
+{
+    DecodeBuffers buffers ;
 
-        vector<int64_t> &rel_refs = relRelMap[i] ;
-        vector<string> &rel_roles = roleRelMap[i] ;
+    while ( true )
+    {
+        Frame frame ;
 
-        for(int j=0 ; j<rel_refs.size() ; j++ )
         {
-            auto it = relMap.find(rel_refs[j]) ;
+            std::unique_lock<std::mutex> lock(mutex_) ;
+            frame_ready_.wait(lock, [&]() { return failed_ || !frames_.empty() || eof_ ; }) ;
 
-            if ( it != relMap.end() )
-            {
-                int idx = relMap[rel_refs[j]] ;
-                relation.children_.push_back(idx) ;
-                relation.children_role_.push_back(rel_roles[j]) ;
+            if ( failed_ || frames_.empty() ) return ;
 
-                relations_[idx].parents_.push_back(i) ;
-            }
+            frame = std::move(frames_.front()) ;
+            frames_.pop_front() ;
         }
 
+        std::unique_ptr<DataBlock> block(new DataBlock) ;
+        block->info_.offset_ = frame.offset_ ;
+
+        bool ok = decode_block(frame.type_, frame.data_, frame.size_, what_, clip_, tags_, summarize_, buffers, *block) ;
+
+        std::unique_lock<std::mutex> lock(mutex_) ;
+
+        if ( !ok ) {
+            failed_ = eof_ = true ;
+            frame_ready_.notify_all() ;
+            slot_free_.notify_all() ;
+        }
+        else
+            blocks_[frame.seq_] = std::move(block) ;
+
+        block_ready_.notify_all() ;
     }
+}
+
+bool BlockPipeline::next(DataBlock &block)
+{
+    std::unique_lock<std::mutex> lock(mutex_) ;
+
+    block_ready_.wait(lock, [&]() {
+        return failed_ || blocks_.count(n_merged_) || ( eof_ && n_merged_ == n_read_ ) ;
+    }) ;
+
+    if ( failed_ ) return false ;
+
+    auto it = blocks_.find(n_merged_) ;
+    if ( it == blocks_.end() ) return false ;
+
+    block = std::move(*it->second) ;
+    blocks_.erase(it) ;
+
+    ++n_merged_ ;
+    slot_free_.notify_one() ;
+
+    return true ;
+}
+
+template<class T>
+static void append(vector<T> &dst, vector<T> &src)
+{
+    dst.insert(dst.end(), std::make_move_iterator(src.begin()), std::make_move_iterator(src.end())) ;
+}
 
-     return true ;
+// check if an indexed block may hold any of the requested entities
 
+static bool block_needed(const PbfIndex::Entry &info, int what, const ClipRegion *clip)
+{
+    if ( !( info.types_ & what ) ) return false ;
+
+    // blocks that provide only nodes are skipped when their extent (widened by the rounding error) is outside the region
 
+    if ( clip && ( info.types_ & what ) == Document::LoadNodes )
+        return clip->intersects(NodeStore::fromFixed(info.min_lat_) - 1.0e-7, NodeStore::fromFixed(info.min_lon_) - 1.0e-7,
+                                NodeStore::fromFixed(info.max_lat_) + 1.0e-7, NodeStore::fromFixed(info.max_lon_) + 1.0e-7) ;
+
+    return true ;
 }
 
+bool Document::readPBF(const string &fileName, References &refs, int what, const NodePredicate &keep_node, const ClipRegion *clip)
+{
+    MappedFile file ;
+
+    if ( !file.open(fileName) ) return false ;
+
+    // with a valid block index only the blocks that may hold requested entities are read, otherwise the index is
+    // built along the way
+
+    PbfIndex index ;
+    vector<uint64_t> offsets ;
+
+    bool indexed = use_block_index_ && index.load(fileName) ;
+
+    if ( indexed ) {
+        for( const PbfIndex::Entry &info: index.entries_ )
+            if ( block_needed(info, what, clip) ) offsets.push_back(info.offset_) ;
+    }
+
+    unsigned int n_workers = std::max(1u, std::thread::hardware_concurrency()) ;
+
+    bool build_index = use_block_index_ && !indexed ;
 
+    BlockPipeline pipeline(file, what, clip, tag_filter_.get(), indexed ? &offsets : nullptr, build_index, n_workers) ;
 
+    DataBlock block ;
 
+    while ( pipeline.next(block) )
+    {
+        if ( build_index ) index.entries_.push_back(block.info_) ;
+
+        // merge decoded entities in file order
+
+        if ( keep_node ) {
+            for( uint i=0 ; i<block.nodes_.size() ; i++ ) {
+                Node node = block.nodes_.node(i) ;
+                if ( keep_node(node) && !nodes_.add(node.id_, node.lat_, node.lon_, std::move(node.tags_)) ) return false ;
+            }
+        }
+        else if ( !nodes_.append(block.nodes_) ) return false ;
+
+        append(ways_, block.ways_) ;
+        append(refs.way_nodes_, block.way_node_refs_) ;
+        append(relations_, block.relations_) ;
+        append(refs.rel_nodes_, block.rel_node_refs_) ;
+        append(refs.rel_ways_, block.rel_way_refs_) ;
+        append(refs.rel_rels_, block.rel_rel_refs_) ;
+        append(refs.rel_node_roles_, block.rel_node_roles_) ;
+        append(refs.rel_way_roles_, block.rel_way_roles_) ;
+        append(refs.rel_rel_roles_, block.rel_rel_roles_) ;
+
+        block = DataBlock() ;
+    }
+
+    if ( pipeline.failed() ) return false ;
+
+    // the index is only a cache, failing to save it (e.g. in a read-only directory) is not an error
+
+    if ( build_index ) index.save(fileName) ;
+
+    return true ;
+}
 
 }
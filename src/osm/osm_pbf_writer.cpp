@@ -0,0 +1,394 @@
+#include <osm_document.hpp>
+
+#include <fileformat.pb.h>
+#include <osmformat.pb.h>
+
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <functional>
+#ifndef _WIN32
+#include <arpa/inet.h>
+#endif
+#include <zlib.h>
+
+using namespace std ;
+
+#define MAX_BLOCK_ENTITIES 8000
+#define GRANULARITY 100
+
+namespace OSM {
+
+using PBF::BlockHeader ;
+using PBF::Blob ;
+using PBF::PrimitiveGroup ;
+using PBF::StringTable ;
+using PBF::HeaderBlock;
+using PBF::PrimitiveBlock ;
+using PBF::DenseNodes ;
+
+// string table of a single block, maps pool ids to table indices. Index 0 is reserved as the delimiter of dense
+// node tags.
+
+class BlockStrings {
+public:
+
+    uint32_t index(uint32_t id) {
+        auto res = index_.emplace(id, ids_.size() + 1) ;
+        if ( res.second ) ids_.push_back(id) ;
+        return res.first->second ;
+    }
+
+    void fill(StringTable &table) const {
+        table.add_s(string()) ;
+        for( uint32_t id: ids_ )
+            table.add_s(StringPool::str(id)) ;
+    }
+
+private:
+
+    unordered_map<uint32_t, uint32_t> index_ ;
+    vector<uint32_t> ids_ ;
+};
+
+// coordinates are stored in fixed point of 1e-7 degrees which is exactly the unit of the default granularity
+
+static void encode_nodes(const Document &doc, uint begin, uint end, PrimitiveBlock &pb_msg)
+{
+    BlockStrings strings ;
+
+    DenseNodes *dense = pb_msg.add_primitivegroup()->mutable_dense() ;
+
+    int64_t last_id = 0, last_lat = 0, last_lon = 0 ;
+    bool has_tags = false ;
+
+    for( uint i=begin ; i<end ; i++ )
+    {
+        int32_t lat, lon ;
+        doc.nodes_.getFixed(i, lat, lon) ;
+
+        int64_t id = doc.nodes_.id(i) ;
+
+        dense->add_id(id - last_id) ;
+        dense->add_lat(lat - last_lat) ;
+        dense->add_lon(lon - last_lon) ;
+
+        last_id = id ; last_lat = lat ; last_lon = lon ;
+
+        const TagList &tags = doc.nodes_.tags(i) ;
+
+        for( const TagList::Tag &tag: tags ) {
+            dense->add_keys_vals(strings.index(tag.key_)) ;
+            dense->add_keys_vals(strings.index(tag.val_)) ;
+        }
+
+        dense->add_keys_vals(0) ;
+
+        if ( !tags.empty() ) has_tags = true ;
+    }
+
+    // keys_vals may be omitted altogether if no node has tags
+
+    if ( !has_tags ) dense->clear_keys_vals() ;
+
+    strings.fill(*pb_msg.mutable_stringtable()) ;
+}
+
+static void encode_ways(const Document &doc, uint begin, uint end, PrimitiveBlock &pb_msg)
+{
+    BlockStrings strings ;
+
+    PrimitiveGroup *group = pb_msg.add_primitivegroup() ;
+
+    for( uint i=begin ; i<end ; i++ )
+    {
+        const Way &way = doc.ways_[i] ;
+
+        PBF::Way *w = group->add_ways() ;
+
+        w->set_id(way.id_) ;
+
+        for( const TagList::Tag &tag: way.tags_ ) {
+            w->add_keys(strings.index(tag.key_)) ;
+            w->add_vals(strings.index(tag.val_)) ;
+        }
+
+        int64_t last_ref = 0 ;
+
+        for( uint idx: way.nodes_ ) {
+            int64_t ref = doc.nodes_.id(idx) ;
+            w->add_refs(ref - last_ref) ;
+            last_ref = ref ;
+        }
+    }
+
+    strings.fill(*pb_msg.mutable_stringtable()) ;
+}
+
+static void add_members(PBF::Relation *r, BlockStrings &strings, int64_t &last_ref, PBF::Relation::MemberType type,
+                        const vector<int64_t> &ids, const Span<uint32_t> &roles)
+{
+    for( size_t j=0 ; j<ids.size() ; j++ )
+    {
+        r->add_roles_sid(strings.index(roles[j])) ;
+        r->add_memids(ids[j] - last_ref) ;
+        r->add_types(type) ;
+
+        last_ref = ids[j] ;
+    }
+}
+
+static void encode_relations(const Document &doc, uint begin, uint end, PrimitiveBlock &pb_msg)
+{
+    BlockStrings strings ;
+
+    PrimitiveGroup *group = pb_msg.add_primitivegroup() ;
+
+    vector<int64_t> ids ;
+
+    for( uint i=begin ; i<end ; i++ )
+    {
+        const Relation &relation = doc.relations_[i] ;
+
+        PBF::Relation *r = group->add_relations() ;
+
+        r->set_id(relation.id_) ;
+
+        for( const TagList::Tag &tag: relation.tags_ ) {
+            r->add_keys(strings.index(tag.key_)) ;
+            r->add_vals(strings.index(tag.val_)) ;
+        }
+
+        int64_t last_ref = 0 ;
+
+        ids.clear() ;
+        for( uint idx: relation.nodes_ ) ids.push_back(doc.nodes_.id(idx)) ;
+        add_members(r, strings, last_ref, PBF::Relation::NODE, ids, relation.nodes_role_) ;
+
+        ids.clear() ;
+        for( uint idx: relation.ways_ ) ids.push_back(doc.ways_[idx].id_) ;
+        add_members(r, strings, last_ref, PBF::Relation::WAY, ids, relation.ways_role_) ;
+
+        ids.clear() ;
+        for( uint idx: relation.children_ ) ids.push_back(doc.relations_[idx].id_) ;
+        add_members(r, strings, last_ref, PBF::Relation::RELATION, ids, relation.children_role_) ;
+    }
+
+    strings.fill(*pb_msg.mutable_stringtable()) ;
+}
+
+// compress serialized block and prepend blob header, i.e. produce a complete file frame
+
+static bool make_frame(const string &type, const string &data, string &frame)
+{
+    Blob blob ;
+
+    uLongf zsize = compressBound(data.size()) ;
+
+    string *zdata = blob.mutable_zlib_data() ;
+    zdata->resize(zsize) ;
+
+    if ( compress2((Bytef *)&(*zdata)[0], &zsize, (const Bytef *)data.data(), data.size(), Z_DEFAULT_COMPRESSION) != Z_OK )
+        return false ;
+
+    zdata->resize(zsize) ;
+    blob.set_raw_size(data.size()) ;
+
+    string blob_data, header_data ;
+
+    if ( !blob.SerializeToString(&blob_data) ) return false ;
+
+    BlockHeader header_msg ;
+    header_msg.set_type(type) ;
+    header_msg.set_datasize(blob_data.size()) ;
+
+    if ( !header_msg.SerializeToString(&header_data) ) return false ;
+
+    uint32_t len = htonl(header_data.size()) ;
+
+    frame.reserve(sizeof(len) + header_data.size() + blob_data.size()) ;
+    frame.assign((const char *)&len, sizeof(len)) ;
+    frame.append(header_data) ;
+    frame.append(blob_data) ;
+
+    return true ;
+}
+
+// Writing pipeline: the caller queues jobs that produce file frames, a pool of workers runs them (encoding and
+// compression) and the frames are written out in the order the jobs were queued.
+
+class FrameWriter {
+public:
+
+    typedef std::function<bool (string &frame)> Job ;
+
+    FrameWriter(ostream &strm, unsigned int n_workers) ;
+    ~FrameWriter() ;
+
+    void submit(Job job) ;
+
+    // write all pending frames and stop the workers, returns false if any job or write failed
+    bool finish() ;
+
+private:
+
+    void runJobs() ;
+    void writeNext(std::unique_lock<std::mutex> &lock) ;
+
+    ostream &strm_ ;
+
+    std::mutex mutex_ ;
+    std::condition_variable job_ready_, frame_ready_ ;
+
+    std::deque< std::pair<size_t, Job> > jobs_ ;        // jobs waiting for a worker
+    map<size_t, string> frames_ ;                       // finished frames waiting to be written
+
+    size_t n_submitted_ = 0, n_written_ = 0, max_in_flight_ ;
+    bool stop_ = false, failed_ = false ;
+
+    std::vector<std::thread> workers_ ;
+};
+
+FrameWriter::FrameWriter(ostream &strm, unsigned int n_workers): strm_(strm), max_in_flight_(4 * n_workers)
+{
+    for( unsigned int i=0 ; i<n_workers ; i++ )
+        workers_.push_back(std::thread(&FrameWriter::runJobs, this)) ;
+}
+
+FrameWriter::~FrameWriter()
+{
+    finish() ;
+}
+
+void FrameWriter::submit(Job job)
+{
+    std::unique_lock<std::mutex> lock(mutex_) ;
+
+    // bound the number of frames held in memory
+
+    while ( n_submitted_ - n_written_ >= max_in_flight_ ) writeNext(lock) ;
+
+    jobs_.push_back(std::make_pair(n_submitted_++, std::move(job))) ;
+    job_ready_.notify_one() ;
+}
+
+void FrameWriter::writeNext(std::unique_lock<std::mutex> &lock)
+{
+    frame_ready_.wait(lock, [&]() { return frames_.count(n_written_) != 0 ; }) ;
+
+    auto it = frames_.find(n_written_) ;
+    string frame = std::move(it->second) ;
+    frames_.erase(it) ;
+
+    ++n_written_ ;
+
+    lock.unlock() ;
+    strm_.write(frame.data(), frame.size()) ;
+    lock.lock() ;
+}
+
+bool FrameWriter::finish()
+{
+    std::unique_lock<std::mutex> lock(mutex_) ;
+
+    while ( n_written_ < n_submitted_ ) writeNext(lock) ;
+
+    stop_ = true ;
+    job_ready_.notify_all() ;
+
+    lock.unlock() ;
+
+    for( auto &t: workers_ ) t.join() ;
+    workers_.clear() ;
+
+    strm_.flush() ;
+
+    return !failed_ && strm_.good() ;
+}
+
+void FrameWriter::runJobs()
+{
+    while ( true )
+    {
+        std::pair<size_t, Job> job ;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_) ;
+            job_ready_.wait(lock, [&]() { return stop_ || !jobs_.empty() ; }) ;
+
+            if ( jobs_.empty() ) return ;
+
+            job = std::move(jobs_.front()) ;
+            jobs_.pop_front() ;
+        }
+
+        string frame ;
+
+        bool ok = job.second(frame) ;
+
+        std::unique_lock<std::mutex> lock(mutex_) ;
+
+        // a failed job leaves an empty frame so that the following ones are still written in order
+        if ( !ok ) {
+            failed_ = true ;
+            frame.clear() ;
+        }
+
+        frames_[job.first] = std::move(frame) ;
+        frame_ready_.notify_all() ;
+    }
+}
+
+typedef void (*EncodeFunction)(const Document &, uint, uint, PrimitiveBlock &) ;
+
+static void submit_blocks(FrameWriter &writer, const Document &doc, size_t count, EncodeFunction encode)
+{
+    for( size_t begin = 0 ; begin < count ; begin += MAX_BLOCK_ENTITIES )
+    {
+        uint end = std::min<size_t>(begin + MAX_BLOCK_ENTITIES, count) ;
+
+        writer.submit([&doc, begin, end, encode](string &frame) {
+            PrimitiveBlock pb_msg ;
+            pb_msg.set_granularity(GRANULARITY) ;
+
+            encode(doc, begin, end, pb_msg) ;
+
+            string data ;
+            return pb_msg.SerializeToString(&data) && make_frame("OSMData", data, frame) ;
+        }) ;
+    }
+}
+
+bool Document::writePBF(const string &fileName)
+{
+    ofstream strm(fileName.c_str(), ios::out | ios::binary) ;
+
+    if ( !strm ) return false ;
+
+    HeaderBlock hb_msg ;
+    hb_msg.add_required_features("OsmSchema-V0.6") ;
+    hb_msg.add_required_features("DenseNodes") ;
+    hb_msg.set_writingprogram("osm2mbtiles") ;
+
+    string data, frame ;
+
+    if ( !hb_msg.SerializeToString(&data) || !make_frame("OSMHeader", data, frame) ) return false ;
+
+    strm.write(frame.data(), frame.size()) ;
+
+    unsigned int n_workers = std::max(1u, std::thread::hardware_concurrency()) ;
+
+    FrameWriter writer(strm, n_workers) ;
+
+    submit_blocks(writer, *this, nodes_.size(), encode_nodes) ;
+    submit_blocks(writer, *this, ways_.size(), encode_ways) ;
+    submit_blocks(writer, *this, relations_.size(), encode_relations) ;
+
+    return writer.finish() ;
+}
+
+}
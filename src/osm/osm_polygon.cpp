@@ -1,199 +1,224 @@
 #include "osm_document.hpp"
 
-#include <list>
+#include <unordered_map>
+#include <algorithm>
 
 using namespace std ;
 
 namespace OSM {
 
-// the function will create linear rings from relation members ignoring inner, outer roles
-// the topology will be fixed by spatialite function ST_BuildArea
+// Joins open member ways of a relation into chains. Ways are only joined with ways of the same group (e.g. role).
+// The result is the same as repeatedly sweeping the list of unassigned ways in member order and attaching each way
+// that shares an endpoint with the current chain: the next way attached is always the first unassigned one after the
+// last attached way (wrapping around once) with an endpoint at either end of the chain. These are found through a
+// map from endpoints to the ways ending there, so assembly takes linear time instead of one sweep per attached way.
 
-bool Document::makePolygonsFromRelation(const Document &doc, const Relation &rel, Polygon &polygon)
-{
-    vector<string> roles ;
-    vector<Ring> &rings = polygon.rings_ ;
+class ChainBuilder {
+public:
 
-    list<uint> unassigned_ways ;
+    ChainBuilder(const Document &doc, const vector<uint> &ways, const vector<uint32_t> &groups) ;
 
-    // first create rings from closed ways
+    // build the next chain, returns false if all ways are assigned
+    bool next(vector<uint> &chain) ;
 
-    for(uint i=0 ; i<rel.ways_.size() ; i++)
+private:
+
+    static uint64_t key(uint32_t group, uint node) { return ( (uint64_t)group << 32 ) | node ; }
+
+    const vector<uint> &wayNodes(uint i) const { return doc_.ways_[ways_[i]].nodes_ ; }
+
+    void assign(uint i) ;
+
+    // first unassigned way at a position >= pos with an endpoint at node, or -1 if none
+    int find(uint32_t group, uint node, uint pos) const ;
+
+    const Document &doc_ ;
+    const vector<uint> &ways_ ;
+    const vector<uint32_t> &groups_ ;
+
+    vector<bool> assigned_ ;
+    uint first_ = 0 ; // all ways before this one are assigned
+
+    unordered_map<uint64_t, vector<uint>> ends_ ; // ways (in increasing order) by endpoint
+};
+
+ChainBuilder::ChainBuilder(const Document &doc, const vector<uint> &ways, const vector<uint32_t> &groups):
+    doc_(doc), ways_(ways), groups_(groups), assigned_(ways.size(), false)
+{
+    ends_.reserve(2 * ways.size()) ;
+
+    for( uint i=0 ; i<ways.size() ; i++ )
     {
-        const Way &way = doc.ways_[rel.ways_[i]] ;
-        const string &role = rel.ways_role_[i] ;
+        const vector<uint> &nodes = wayNodes(i) ;
 
-        if (  way.nodes_.front() == way.nodes_.back() )
-        {
-            Ring r ;
-            r.nodes_.insert(r.nodes_.end(), way.nodes_.begin(), way.nodes_.end()) ;
-            rings.push_back(r) ;
-            roles.push_back(role) ;
-        }
-        else unassigned_ways.push_back(i) ;
+        ends_[key(groups[i], nodes.front())].push_back(i) ;
+        if ( nodes.back() != nodes.front() ) ends_[key(groups[i], nodes.back())].push_back(i) ;
     }
+}
+
+void ChainBuilder::assign(uint i)
+{
+    assigned_[i] = true ;
+
+    const vector<uint> &nodes = wayNodes(i) ;
 
-    while ( !unassigned_ways.empty() )
+    for( uint node: { nodes.front(), nodes.back() } )
     {
-        Ring current ;
+        auto it = ends_.find(key(groups_[i], node)) ;
+        if ( it == ends_.end() ) continue ;
 
-        uint idx = unassigned_ways.front() ;
+        vector<uint> &v = it->second ;
+        v.erase(std::remove(v.begin(), v.end(), i), v.end()) ;
+    }
+}
 
-        const Way &way = doc.ways_[rel.ways_[idx]] ;
+int ChainBuilder::find(uint32_t group, uint node, uint pos) const
+{
+    auto it = ends_.find(key(group, node)) ;
+    if ( it == ends_.end() ) return -1 ;
 
-        string current_role = rel.ways_role_[idx] ;
+    const vector<uint> &v = it->second ;
 
-        current.nodes_.insert(current.nodes_.end(), way.nodes_.begin(), way.nodes_.end()) ;
-        unassigned_ways.pop_front() ;
+    auto vit = std::lower_bound(v.begin(), v.end(), pos) ;
+    return ( vit == v.end() ) ? -1 : (int)*vit ;
+}
 
-        // merge ways into circular rings
+bool ChainBuilder::next(vector<uint> &chain)
+{
+    while ( first_ < ways_.size() && assigned_[first_] ) ++first_ ;
 
-        bool finished ;
+    if ( first_ == ways_.size() ) return false ;
 
-        do
-        {
-            finished = true ;
-
-            auto itu = unassigned_ways.begin() ;
-
-            while ( itu != unassigned_ways.end() )
-            {
-                int idx = *itu ;
-
-                const Way &way = doc.ways_[rel.ways_[idx]] ;
-                string role = rel.ways_role_[idx] ;
-
-                if ( role != current_role ) { ++itu ; continue ; }
-
-                if ( current.nodes_.front() == way.nodes_.front() )
-                {
-                    auto it = way.nodes_.begin() ;
-                    ++it ;
-                    while ( it != way.nodes_.end() )
-                       current.nodes_.push_front(*it++) ;
-                    finished = false ;
-                    itu = unassigned_ways.erase(itu) ;
-                }
-                else if ( current.nodes_.back() == way.nodes_.front() )
-                {
-                    current.nodes_.insert(current.nodes_.end(), way.nodes_.begin()+1, way.nodes_.end()) ;
-                    finished = false ;
-                    itu = unassigned_ways.erase(itu) ;
-                }
-                else if ( current.nodes_.front() == way.nodes_.back() )
-                {
-                    auto it = way.nodes_.rbegin() ;
-                    ++it ;
-                    while ( it != way.nodes_.rend() )
-                        current.nodes_.push_front(*it++) ;
-                    finished = false ;
-                    itu = unassigned_ways.erase(itu) ;
-                }
-                else if ( current.nodes_.back() == way.nodes_.back() )
-                {
-                    current.nodes_.insert(current.nodes_.end(), way.nodes_.rbegin()+1, way.nodes_.rend()) ;
-                    finished = false ;
-                    itu = unassigned_ways.erase(itu) ;
-                }
-                else  ++itu ;
-            }
-        } while ( !finished ) ;
+    uint start = first_ ;
+    uint32_t group = groups_[start] ;
 
+    assign(start) ;
 
-        // we should have a closed way otherwise something is wrong
-        if ( current.nodes_.front() != current.nodes_.back() ) return false ;
+    // the chain is the reverse of head followed by tail
+
+    const vector<uint> &nodes = wayNodes(start) ;
+
+    vector<uint> head, tail(nodes.begin(), nodes.end()) ;
+    uint front = nodes.front(), back = nodes.back() ;
+
+    uint pos = 0 ;
+
+    while ( true )
+    {
+        int c1 = find(group, front, pos), c2 = find(group, back, pos) ;
+
+        if ( c1 < 0 && c2 < 0 ) {
+            // end of the sweep, try again from the start unless nothing was attached since then
+            if ( pos == 0 ) break ;
+            pos = 0 ;
+            continue ;
+        }
+
+        uint idx = ( c1 < 0 ) ? c2 : ( c2 < 0 ) ? c1 : std::min(c1, c2) ;
 
-        rings.push_back(current) ;
-        roles.push_back(current_role) ;
-        current.nodes_.clear() ;
+        assign(idx) ;
+        pos = idx + 1 ;
+
+        const vector<uint> &way = wayNodes(idx) ;
+
+        if ( front == way.front() )
+        {
+            head.insert(head.end(), way.begin() + 1, way.end()) ;
+            front = way.back() ;
+        }
+        else if ( back == way.front() )
+        {
+            tail.insert(tail.end(), way.begin() + 1, way.end()) ;
+            back = way.back() ;
+        }
+        else if ( front == way.back() )
+        {
+            head.insert(head.end(), way.rbegin() + 1, way.rend()) ;
+            front = way.front() ;
+        }
+        else
+        {
+            tail.insert(tail.end(), way.rbegin() + 1, way.rend()) ;
+            back = way.front() ;
+        }
     }
 
+    chain.clear() ;
+    chain.reserve(head.size() + tail.size()) ;
+    chain.insert(chain.end(), head.rbegin(), head.rend()) ;
+    chain.insert(chain.end(), tail.begin(), tail.end()) ;
+
     return true ;
 }
 
+// the function will create linear rings from relation members ignoring inner, outer roles
+// the topology will be fixed by spatialite function ST_BuildArea
 
-bool Document::makeWaysFromRelation(const Document &doc, const Relation &rel, std::vector<Way> &ways)
+bool Document::makePolygonsFromRelation(const Document &doc, const Relation &rel, Polygon &polygon)
 {
-    vector<Ring> rings ;
+    vector<Ring> &rings = polygon.rings_ ;
 
-    list<uint> unassigned_ways ;
+    vector<uint> open_ways ;
+    vector<uint32_t> roles ;
 
-    for(uint i=0 ; i<rel.ways_.size() ; i++)
-         unassigned_ways.push_back(i) ;
+    // first create rings from closed ways
 
-    while ( !unassigned_ways.empty() )
+    for(uint i=0 ; i<rel.ways_.size() ; i++)
     {
-        Ring current ;
+        const Way &way = doc.ways_[rel.ways_[i]] ;
 
-        uint idx = unassigned_ways.front() ;
+        if ( way.nodes_.empty() ) continue ;
 
-        const Way &way = doc.ways_[rel.ways_[idx]] ;
+        if (  way.nodes_.front() == way.nodes_.back() )
+        {
+            Ring r ;
+            r.nodes_.assign(way.nodes_.begin(), way.nodes_.end()) ;
+            rings.push_back(std::move(r)) ;
+        }
+        else {
+            open_ways.push_back(rel.ways_[i]) ;
+            roles.push_back(rel.ways_role_[i]) ;
+        }
+    }
 
-        current.nodes_.insert(current.nodes_.end(), way.nodes_.begin(), way.nodes_.end()) ;
-        unassigned_ways.pop_front() ;
+    // merge ways with the same role into circular rings
 
-        // merge ways into circular rings
+    ChainBuilder builder(doc, open_ways, roles) ;
 
-        bool finished ;
+    Ring current ;
 
-        do
-        {
-            finished = true ;
-
-            list<uint>::iterator itu = unassigned_ways.begin() ;
-
-            while ( itu != unassigned_ways.end() )
-            {
-                int idx = *itu ;
-
-                const Way &way = doc.ways_[rel.ways_[idx]] ;
-
-                if ( current.nodes_.front() == way.nodes_.front() )
-                {
-                    auto it = way.nodes_.begin() ;
-                    ++it ;
-                    while ( it != way.nodes_.end() )
-                       current.nodes_.push_front(*it++) ;
-                    finished = false ;
-                    itu = unassigned_ways.erase(itu) ;
-                }
-                else if ( current.nodes_.back() == way.nodes_.front() )
-                {
-                    current.nodes_.insert(current.nodes_.end(), way.nodes_.begin()+1, way.nodes_.end()) ;
-                    finished = false ;
-                    itu = unassigned_ways.erase(itu) ;
-                }
-                else if ( current.nodes_.front() == way.nodes_.back() )
-                {
-                    auto it = way.nodes_.rbegin() ;
-                    ++it ;
-                    while ( it != way.nodes_.rend() )
-                        current.nodes_.push_front(*it++) ;
-                    finished = false ;
-                    itu = unassigned_ways.erase(itu) ;
-                }
-                else if ( current.nodes_.back() == way.nodes_.back() )
-                {
-                    current.nodes_.insert(current.nodes_.end(), way.nodes_.rbegin()+1, way.nodes_.rend()) ;
-                    finished = false ;
-                    itu = unassigned_ways.erase(itu) ;
-                }
-                else  ++itu ;
-            }
-        } while ( !finished ) ;
-
-
-        rings.push_back(current) ;
-        current.nodes_.clear() ;
+    while ( builder.next(current.nodes_) )
+    {
+        // we should have a closed way otherwise something is wrong
+        if ( current.nodes_.front() != current.nodes_.back() ) return false ;
 
+        rings.push_back(std::move(current)) ;
     }
 
-    for(int i=0 ; i< rings.size() ; i++ )
+    return true ;
+}
+
+
+bool Document::makeWaysFromRelation(const Document &doc, const Relation &rel, std::vector<Way> &ways)
+{
+    vector<uint> member_ways ;
+
+    for(uint i=0 ; i<rel.ways_.size() ; i++)
+        if ( !doc.ways_[rel.ways_[i]].nodes_.empty() ) member_ways.push_back(rel.ways_[i]) ;
+
+    vector<uint32_t> groups(member_ways.size(), 0) ;
+
+    ChainBuilder builder(doc, member_ways, groups) ;
+
+    while ( true )
     {
         ways.push_back(Way()) ;
         Way &way = ways.back() ;
 
-        way.nodes_.insert(way.nodes_.end(), rings[i].nodes_.begin(), rings[i].nodes_.end()) ;
+        if ( !builder.next(way.nodes_) ) {
+            ways.pop_back() ;
+            break ;
+        }
 
         way.tags_ = rel.tags_ ;
     }
@@ -1,5 +1,11 @@
 #include "map_file.hpp"
 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+
 using namespace std ;
 
 static bool processSetTagActions(const OSM::Filter::Rule *r, OSM::Filter::Context &ctx, OSM::Feature *node)
@@ -12,14 +18,11 @@ static bool processSetTagActions(const OSM::Filter::Rule *r, OSM::Filter::Contex
    {
        if ( action->cmd_ ==  OSM::Filter::Command::Add )
        {
-           node->tags_.add(action->tag_, action->expression_->eval(ctx).toString()) ;
+           node->tags_.add(action->key_, OSM::StringPool::intern(action->expression_->eval(ctx).toString())) ;
        }
        else if ( action->cmd_ == OSM::Filter::Command::Set )
        {
-           if ( node->tags_.contains(action->tag_) )
-               node->tags_[action->tag_] = action->expression_->eval(ctx).toString() ;
-           else
-               node->tags_.add(action->tag_, action->expression_->eval(ctx).toString()) ;
+           node->tags_.set(action->key_, OSM::StringPool::intern(action->expression_->eval(ctx).toString())) ;
        }
        else if ( action->cmd_ == OSM::Filter::Command::Continue )
        {
@@ -27,7 +30,7 @@ static bool processSetTagActions(const OSM::Filter::Rule *r, OSM::Filter::Contex
        }
        else if ( action->cmd_ == OSM::Filter::Command::Delete )
        {
-           node->tags_.remove(action->tag_) ;
+           node->tags_.remove(action->key_) ;
        }
 
        action = action->next_ ;
@@ -38,7 +41,7 @@ static bool processSetTagActions(const OSM::Filter::Rule *r, OSM::Filter::Contex
 
 }
 
-static bool processStoreActions(const OSM::Filter::Rule *r, OSM::Filter::Context &ctx, OSM::Feature *node, vector<Action> &actions)
+static bool processStoreActions(const OSM::Filter::Rule *r, OSM::Filter::Context &ctx, const OSM::Feature *node, vector<Action> &actions)
 {
    OSM::Filter::Command *action = r->actions_ ;
 
@@ -70,7 +73,7 @@ static bool processStoreActions(const OSM::Filter::Rule *r, OSM::Filter::Context
 
 extern string escape_tag(const string &) ;
 
-void bindActions(const vector<Action> &actions, SQLite::Command &cmd)
+static string serializeActions(const vector<Action> &actions)
 {
    string kvl ;
 
@@ -84,27 +87,37 @@ void bindActions(const vector<Action> &actions, SQLite::Command &cmd)
        if ( !val.empty() ) kvl += escape_tag(key) + '@' + escape_tag(val) + ';' ;
    }
 
-   if ( kvl.empty() ) cmd.bind(2, SQLite::Nil) ;
-   else cmd.bind(2, kvl) ;
+   return kvl ;
 }
 
-bool MapFile::addOSMLayerPoints(OSM::Document &doc, const OSM::Filter::LayerDefinition *layer,
-                      const vector<NodeRuleMap > &node_idxs)
-{
-   SQLite::Database &db = handle() ;
-
-   SQLite::Session session(&db) ;
-   SQLite::Connection &con = session.handle() ;
+// append a row with the given geometry (consumed), the stored tags and the key of the source feature
 
+static void addRow(MapFile::LayerRows &batch, gaiaGeomCollPtr geom, const vector<Action> &actions,
+                   OSM::Feature::Type type, int64_t id)
+{
    unsigned char *blob;
    int blob_size;
 
-   if ( layer->type_ != "points" ) return false ;
+   gaiaToSpatiaLiteBlobWkb (geom, &blob, &blob_size);
 
-   SQLite::Transaction trans(con) ;
+   gaiaFreeGeomColl (geom);
 
-   string geoCmd = "Transform(?," + layer->srid_ + ")" ;
-   SQLite::Command cmd(con, insertFeatureSQL(layer->name_, geoCmd)) ;
+   batch.rows_.push_back(MapFile::FeatureRow()) ;
+   MapFile::FeatureRow &row = batch.rows_.back() ;
+
+   row.geom_.assign(blob, blob + blob_size) ;
+   row.tags_ = serializeActions(actions) ;
+   row.key_ = MapFile::FeatureKey(type, id) ;
+
+   free(blob) ;
+}
+
+bool MapFile::addOSMLayerPoints(OSM::Document &doc, const OSM::Filter::LayerDefinition *layer,
+                      const vector<NodeRuleMap > &node_idxs, LayerRows &batch)
+{
+   if ( layer->type_ != "points" ) return false ;
+
+   batch.layer_ = layer ;
 
    for(int i=0 ; i<node_idxs.size() ; i++ )
    {
@@ -113,7 +126,10 @@ bool MapFile::addOSMLayerPoints(OSM::Document &doc, const OSM::Filter::LayerDefi
        const NodeRuleMap &nr = node_idxs[i] ;
 
        int node_idx = nr.node_idx_ ;
-       OSM::Node &node = doc.nodes_[node_idx] ;
+       OSM::Node node = doc.nodes_.node(node_idx) ;
+
+       // the store actions see the tags as changed by the set-tag actions
+       if ( nr.modified_ ) node.tags_ = nr.tags_ ;
 
        OSM::Filter::Context ctx(&node) ;
 
@@ -124,55 +140,45 @@ bool MapFile::addOSMLayerPoints(OSM::Document &doc, const OSM::Filter::LayerDefi
            if ( ! processStoreActions(r, ctx, &node, actions) ) break ;
        }
 
-       cmd.clear() ;
-
-       bindActions(actions, cmd) ;
-
        gaiaGeomCollPtr geo_pt = gaiaAllocGeomColl();
 
        geo_pt->Srid = 4326;
 
        gaiaAddPointToGeomColl (geo_pt, node.lon_, node.lat_);
 
-       gaiaToSpatiaLiteBlobWkb (geo_pt, &blob, &blob_size);
+       addRow(batch, geo_pt, actions, OSM::Feature::NodeFeature, doc.nodes_.id(node_idx)) ;
+   }
+
+   return true ;
+}
 
-       gaiaFreeGeomColl (geo_pt);
+static gaiaGeomCollPtr makeLineGeometry(const OSM::Document &doc, const vector<uint> &nodes)
+{
+   gaiaGeomCollPtr geo_line = gaiaAllocGeomColl();
+   geo_line->Srid = 4326;
 
-       cmd.bind(1, blob, blob_size) ;
+   gaiaLinestringPtr ls = gaiaAddLinestringToGeomColl (geo_line, nodes.size());
 
-       cmd.exec() ;
-       cmd.clear() ;
-       free(blob);
+   for(int j=0 ; j<nodes.size() ; j++)
+   {
+       uint idx = nodes[j] ;
 
+       gaiaSetPoint (ls->Coords, j, doc.nodes_.lon(idx), doc.nodes_.lat(idx));
    }
 
-   trans.commit() ;
-
-   return true ;
+   return geo_line ;
 }
 
-
 bool MapFile::addOSMLayerLines(OSM::Document &doc, const OSM::Filter::LayerDefinition *layer,
                      const vector<NodeRuleMap> &way_idxs,
                      vector<OSM::Way> &chunk_list,
-                     const vector<NodeRuleMap > &rule_map
+                     const vector<NodeRuleMap > &rule_map,
+                     LayerRows &batch
                      )
 {
-
-   SQLite::Database &db = handle() ;
-
-   SQLite::Session session(&db) ;
-   SQLite::Connection &con = session.handle() ;
-
-   unsigned char *blob;
-   int blob_size;
-
    if ( layer->type_ != "lines" ) return false ;
 
-   SQLite::Transaction trans(con) ;
-
-   string geoCmd = "CompressGeometry(Transform(?," + layer->srid_ + "))" ;
-   SQLite::Command cmd(con, insertFeatureSQL(layer->name_, geoCmd)) ;
+   batch.layer_ = layer ;
 
    for(int i=0 ; i<way_idxs.size() ; i++ )
    {
@@ -181,43 +187,31 @@ bool MapFile::addOSMLayerLines(OSM::Document &doc, const OSM::Filter::LayerDefin
        const NodeRuleMap &nr = way_idxs[i] ;
 
        int node_idx = nr.node_idx_ ;
-       OSM::Way &way = doc.ways_[node_idx] ;
-
-       OSM::Filter::Context ctx(&way) ;
-
-       for(int j=0 ; j<nr.matched_rules_.size() ; j++ ) {
-           const OSM::Filter::Rule *r = nr.matched_rules_[j] ;
-           if ( ! processStoreActions(r, ctx, &way, actions) ) break ;
-       }
+       const OSM::Way &way = doc.ways_[node_idx] ;
 
-       cmd.clear() ;
-
-       bindActions(actions, cmd) ;
-
-       gaiaGeomCollPtr geo_line = gaiaAllocGeomColl();
-       geo_line->Srid = 4326;
+       // the store actions see the tags as changed by the set-tag actions
 
-       gaiaLinestringPtr ls = gaiaAddLinestringToGeomColl (geo_line, way.nodes_.size());
+       OSM::Feature modified(OSM::Feature::WayFeature) ;
+       const OSM::Feature *feature = &way ;
 
-       for(int j=0 ; j<way.nodes_.size() ; j++)
-       {
-           const OSM::Node &node = doc.nodes_[way.nodes_[j]] ;
-
-           gaiaSetPoint (ls->Coords, j, node.lon_, node.lat_);
+       if ( nr.modified_ ) {
+           modified.id_ = way.id_ ;
+           modified.tags_ = nr.tags_ ;
+           feature = &modified ;
        }
 
-       gaiaToSpatiaLiteBlobWkb (geo_line, &blob, &blob_size);
-
-       gaiaFreeGeomColl (geo_line);
+       OSM::Filter::Context ctx(feature) ;
 
-       cmd.bind(1, blob, blob_size) ;
-
-       cmd.exec() ;
-
-       free(blob) ;
+       for(int j=0 ; j<nr.matched_rules_.size() ; j++ ) {
+           const OSM::Filter::Rule *r = nr.matched_rules_[j] ;
+           if ( ! processStoreActions(r, ctx, feature, actions) ) break ;
+       }
 
+       addRow(batch, makeLineGeometry(doc, way.nodes_), actions, OSM::Feature::WayFeature, way.id_) ;
    }
 
+   // chunks of route relations carry the id of the relation
+
    for( int i=0 ; i<rule_map.size() ; i++ )
    {
        vector<Action> actions ;
@@ -233,56 +227,19 @@ bool MapFile::addOSMLayerLines(OSM::Document &doc, const OSM::Filter::LayerDefin
            if ( ! processStoreActions(r, ctx, &way, actions) ) break ;
        }
 
-       cmd.clear() ;
-
-       bindActions(actions, cmd) ;
-
-       gaiaGeomCollPtr geo_line = gaiaAllocGeomColl();
-       geo_line->Srid = 4326;
-
-       gaiaLinestringPtr ls = gaiaAddLinestringToGeomColl (geo_line, way.nodes_.size());
-
-       for(int j=0 ; j<way.nodes_.size() ; j++)
-       {
-           const OSM::Node &node = doc.nodes_[way.nodes_[j]] ;
-
-           gaiaSetPoint (ls->Coords, j, node.lon_, node.lat_);
-       }
-
-       gaiaToSpatiaLiteBlobWkb (geo_line, &blob, &blob_size);
-
-       gaiaFreeGeomColl (geo_line);
-
-       cmd.bind(1, blob, blob_size) ;
-
-       cmd.exec() ;
-
-       free(blob) ;
-
+       addRow(batch, makeLineGeometry(doc, way.nodes_), actions, OSM::Feature::RelationFeature, way.id_) ;
    }
 
-   trans.commit() ;
-
    return true ;
 }
 
 bool MapFile::addOSMLayerPolygons(const OSM::Document &doc, const OSM::Filter::LayerDefinition *layer,
-                        vector<OSM::Polygon> &polygons, const vector<NodeRuleMap > &poly_idxs)
+                        vector<OSM::Polygon> &polygons, const vector<NodeRuleMap > &poly_idxs,
+                        LayerRows &batch)
 {
-   SQLite::Database &db = handle() ;
-
-   SQLite::Session session(&db) ;
-   SQLite::Connection &con = session.handle() ;
-
-   unsigned char *blob;
-   int blob_size;
-
    if ( layer->type_ != "polygons" ) return false ;
 
-   SQLite::Transaction trans(con) ;
-
-   string geoCmd = "CompressGeometry(Transform(ST_BuildArea(?)," + layer->srid_ + "))" ;
-   SQLite::Command cmd(con, insertFeatureSQL(layer->name_,  geoCmd)) ;
+   batch.layer_ = layer ;
 
    for( int i=0 ; i< poly_idxs.size() ; i++ )
    {
@@ -300,35 +257,66 @@ bool MapFile::addOSMLayerPolygons(const OSM::Document &doc, const OSM::Filter::L
            if ( ! processStoreActions(r, ctx, &poly, actions) ) break ;
        }
 
-       cmd.clear() ;
-
-       bindActions(actions, cmd) ;
-
        gaiaGeomCollPtr geo_poly = gaiaAllocGeomColl();
        geo_poly->Srid = 4326;
 
        for(int j=0 ; j<poly.rings_.size() ; j++)
        {
-           auto ring = poly.rings_[j] ;
+           const OSM::Ring &ring = poly.rings_[j] ;
            gaiaLinestringPtr gpoly = gaiaAddLinestringToGeomColl(geo_poly,ring.nodes_.size());
 
            for(int k=0 ; k<ring.nodes_.size() ; k++)
            {
-               auto node = doc.nodes_[ring.nodes_[k]] ;
+               uint idx = ring.nodes_[k] ;
 
-               gaiaSetPoint (gpoly->Coords, k, node.lon_, node.lat_);
+               gaiaSetPoint (gpoly->Coords, k, doc.nodes_.lon(idx), doc.nodes_.lat(idx));
            }
        }
 
-       gaiaToSpatiaLiteBlobWkb (geo_poly, &blob, &blob_size);
+       addRow(batch, geo_poly, actions, poly.source_, poly.id_) ;
+   }
 
-       gaiaFreeGeomColl (geo_poly);
+   return true ;
+}
 
-       cmd.bind(1, blob, blob_size) ;
+bool MapFile::writeLayerRows(const LayerRows &batch)
+{
+   const OSM::Filter::LayerDefinition *layer = batch.layer_ ;
 
-       cmd.exec() ;
+   string geoCmd ;
+
+   if ( layer->type_ == "points" )
+       geoCmd = "Transform(?," + layer->srid_ + ")" ;
+   else if ( layer->type_ == "lines" )
+       geoCmd = "CompressGeometry(Transform(?," + layer->srid_ + "))" ;
+   else if ( layer->type_ == "polygons" )
+       geoCmd = "CompressGeometry(Transform(ST_BuildArea(?)," + layer->srid_ + "))" ;
+   else
+       return false ;
+
+   SQLite::Database &db = handle() ;
+
+   SQLite::Session session(&db) ;
+   SQLite::Connection &con = session.handle() ;
 
-       free(blob) ;
+   SQLite::Transaction trans(con) ;
+
+   SQLite::Command cmd(con, insertFeatureSQL(layer->name_, geoCmd)) ;
+
+   for( const FeatureRow &row: batch.rows_ )
+   {
+       cmd.clear() ;
+
+       cmd.bind(1, row.geom_.data(), row.geom_.size()) ;
+
+       if ( row.tags_.empty() ) cmd.bind(2, SQLite::Nil) ;
+       else cmd.bind(2, row.tags_) ;
+
+       // key of the row, i.e. type and id of the OSM feature it was created from
+       cmd.bind(3, row.key_.first) ;
+       cmd.bind(4, (long long)row.key_.second) ;
+
+       cmd.exec() ;
    }
 
    trans.commit() ;
@@ -337,208 +325,794 @@ bool MapFile::addOSMLayerPolygons(const OSM::Document &doc, const OSM::Filter::L
 }
 
 
-bool MapFile::processOsmFiles(const vector<string> &osmFiles, const ImportConfig &cfg)
-{
-    // read files from memory and write to spatialite database
+// Accepts the features that would pass the rules of at least one layer, used for streaming import
+
+class LayerRuleFilter: public OSM::EntityFilter {
+public:
+
+    LayerRuleFilter(const OSM::Filter::LayerDefinition *layers): layers_(layers) {
+        type_key_ = OSM::StringPool::intern("type") ;
+        route_val_ = OSM::StringPool::intern("route") ;
+        multipolygon_val_ = OSM::StringPool::intern("multipolygon") ;
+        boundary_val_ = OSM::StringPool::intern("boundary") ;
+    }
+
+    bool acceptNode(const OSM::Node &node) const {
+        return matchLayers(node, "points", nullptr) ;
+    }
 
-    for(int i=0 ; i<osmFiles.size() ; i++ ) {
+    bool acceptWay(const OSM::Way &way) const {
+        return matchLayers(way, "lines", "polygons") ;
+    }
+
+    bool acceptRelation(const OSM::Relation &relation) const {
+        const uint32_t *rel_type = relation.tags_.find(type_key_) ;
+        if ( !rel_type || ( *rel_type != route_val_ && *rel_type != multipolygon_val_ && *rel_type != boundary_val_ ) ) return false ;
 
-        OSM::Document doc ;
+        return matchLayers(relation, "lines", "polygons") ;
+    }
 
-        cout << "Reading file: " << osmFiles[i] << endl ;
+private:
 
-        if ( !doc.read(osmFiles[i]) )
+    // set-tag actions only run after a rule has matched, so the first match can be decided on the original tags
+    bool matchLayers(const OSM::Feature &feature, const char *type1, const char *type2) const
+    {
+        for( const OSM::Filter::LayerDefinition *layer = layers_ ; layer ; layer = layer->next_ )
         {
-            cerr << "Error reading from " << osmFiles[i] << endl ;
-            continue ;
+            if ( layer->type_ != type1 && ( !type2 || layer->type_ != type2 ) ) continue ;
+
+            OSM::Filter::Context ctx(&feature) ;
+
+            vector<uint> candidates ;
+            layer->index_.candidates(feature.tags_, candidates) ;
+
+            for( uint pos: candidates )
+            {
+                if ( !layer->index_.rule(pos)->matches(ctx) ) continue ;
+                return true ;
+            }
         }
 
-        for( OSM::Filter::LayerDefinition *layer = cfg.layers_ ;
-             layer ; layer = layer->next_ )
+        return false ;
+    }
+
+    const OSM::Filter::LayerDefinition *layers_ ;
+    uint32_t type_key_, route_val_, multipolygon_val_, boundary_val_ ;
+};
+
+// read a file into a new document, with the location file of the given worker slot if the node locations are kept
+// in a file
+
+static bool readOsmFile(OSM::Document &doc, const string &fileName, const ImportConfig &cfg, unsigned int slot, unsigned int n_slots)
+{
+    if ( !cfg.node_locations_file_.empty() )
+    {
+        string locations_file = cfg.node_locations_file_ ;
+        if ( n_slots > 1 ) locations_file += "." + to_string(slot) ;
+
+        if ( !doc.setNodeLocationFile(locations_file) )
         {
+            cerr << "Cannot use node location file " << locations_file << endl ;
+            return false ;
+        }
+    }
+
+    if ( cfg.clip_ ) doc.setClipRegion(cfg.clip_) ;
+    if ( cfg.tag_filter_ ) doc.setTagFilter(cfg.tag_filter_) ;
+    doc.setUseBlockIndex(cfg.pbf_index_) ;
+    doc.setUseSnapshot(cfg.snapshot_) ;
+
+    bool ok ;
 
-            std::vector<NodeRuleMap> passFilterNodes, passFilterWays, passFilterPoly, passFilterRel ;
+    if ( cfg.streaming_ )
+        ok = doc.read(fileName, LayerRuleFilter(cfg.layers_)) ;
+    else
+        ok = doc.read(fileName) ;
+
+    if ( !ok ) cerr << "Error reading from " << fileName << endl ;
+
+    return ok ;
+}
+
+// Files are read and evaluated on up to max_concurrent_files_ threads, each with its own document. The rows of each
+// file are written by the thread that produced them once all previous files are written, so that a single thread
+// writes at a time and the map file is the same as with sequential processing.
+
+bool MapFile::processOsmFiles(const vector<string> &osmFiles, const ImportConfig &cfg)
+{
+    unsigned int n_slots = std::max(1u, std::min<unsigned int>(cfg.max_concurrent_files_, osmFiles.size())) ;
+
+    std::mutex mutex ;
+    std::condition_variable written ;
+    size_t next_file = 0, next_write = 0 ;
+    bool ok = true ;
+
+    auto run = [&](unsigned int slot) {
+        while ( true )
+        {
+            size_t i ;
 
-            if ( layer->type_ == "points" )
             {
-                for(int k=0 ; k<doc.nodes_.size() ; k++ )
-                {
-                    auto node = doc.nodes_[k] ;
+                std::lock_guard<std::mutex> lock(mutex) ;
 
-                    OSM::Filter::Context ctx(&node) ;
+                if ( next_file == osmFiles.size() ) return ;
+                i = next_file++ ;
 
-                    NodeRuleMap nr ;
+                cout << "Reading file: " << osmFiles[i] << endl ;
+            }
+
+            vector<LayerRows> batches ;
+
+            {
+                OSM::Document doc ;
 
-                    nr.node_idx_ = k ;
+                if ( readOsmFile(doc, osmFiles[i], cfg, slot, n_slots) )
+                    processOsmDocument(doc, cfg, nullptr, batches) ;
+            }
 
-                    for( OSM::Filter::Rule *r = layer->rules_ ; r ; r = r->next_ )
-                    {
-                        if ( r->node_ && !r->node_->eval(ctx).toBoolean() ) continue ;
-                        processSetTagActions(r, ctx, &node) ;
-                        nr.matched_rules_.push_back(r) ;
-                    }
+            std::unique_lock<std::mutex> lock(mutex) ;
 
-                    if ( !nr.matched_rules_.empty() ) passFilterNodes.push_back(nr) ;
+            written.wait(lock, [&]() { return next_write == i ; }) ;
 
-                }
+            lock.unlock() ;
 
-                addOSMLayerPoints(doc, layer, passFilterNodes) ;
+            try {
+                for( const LayerRows &batch: batches )
+                    writeLayerRows(batch) ;
             }
-            else if ( layer->type_ == "lines" )
+            catch ( SQLite::Exception &e )
             {
-                for(int k=0 ; k<doc.ways_.size() ; k++ )
-                {
-                    auto way = doc.ways_[k] ;
+                cerr << e.what() << endl ;
+                lock.lock() ;
+                ok = false ;
+                lock.unlock() ;
+            }
 
-                    OSM::Filter::Context ctx(&way) ;
+            lock.lock() ;
+            ++next_write ;
+            written.notify_all() ;
+        }
+    } ;
 
-                    NodeRuleMap nr ;
+    vector<std::thread> workers ;
 
-                    nr.node_idx_ = k ;
+    for( unsigned int slot = 1 ; slot < n_slots ; slot++ )
+        workers.push_back(std::thread(run, slot)) ;
 
-                    for( const OSM::Filter::Rule *r = layer->rules_ ; r ; r = r->next_ )
-                    {
-                        if ( r->node_ && !r->node_->eval(ctx).toBoolean() ) continue ;
-                        processSetTagActions(r, ctx, &way) ;
-                        nr.matched_rules_.push_back(r) ;
-                    }
+    run(0) ;
 
-                    // deal with closed ways
+    for( auto &t: workers ) t.join() ;
 
-                    if ( way.nodes_.front() == way.nodes_.back() )
-                    {
-                        if ( way.tags_.get("area") == "yes" ) continue ;
-                        if ( !way.tags_.contains("highway") && !way.tags_.contains("barrier") && !way.tags_.contains("contour") ) continue ;
-                    }
+    return ok ;
 
-                    if ( !nr.matched_rules_.empty() ) passFilterWays.push_back(nr) ;
-                }
+}
 
-                // relations of type route, merge ways into chunks
+// Evaluates the rules of a layer in order against a feature of the document. Only the rules that the rule index
+// returns for the feature tags are tested, the others cannot match. Set-tag actions of the matched rules apply to a
+// copy of the tags made by the first such action, so that all layers share the document features and only the
+// features a layer modifies are copied. The modified tags are kept in the match for the store actions, and the
+// remaining candidates are looked up again since the change may make other rules match.
 
-                vector<OSM::Way> chunk_list ;
+static bool hasSetTagActions(const OSM::Filter::Rule *r)
+{
+    for( const OSM::Filter::Command *action = r->actions_ ; action ; action = action->next_ )
+    {
+        if ( action->cmd_ == OSM::Filter::Command::Add ||
+             action->cmd_ == OSM::Filter::Command::Set ||
+             action->cmd_ == OSM::Filter::Command::Delete ) return true ;
+    }
 
-                for(int k=0 ; k<doc.relations_.size() ; k++ )
-                {
-                    auto relation = doc.relations_[k] ;
+    return false ;
+}
+
+// evaluate the rule condition, timing it if profiling
+static bool matchRule(const OSM::Filter::Rule *r, OSM::Filter::Context &ctx, OSM::Filter::RuleProfiler *profiler)
+{
+    if ( !profiler ) return r->matches(ctx) ;
 
-                    if ( relation.tags_.get("type") != "route" ) continue ;
+    auto start = std::chrono::steady_clock::now() ;
 
-                    OSM::Filter::Context ctx(&relation) ;
+    bool matched = r->matches(ctx) ;
 
-                    vector<const OSM::Filter::Rule *> matched ;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count() ;
+    profiler->addEvaluation(r, matched, ns) ;
 
-                    for( const OSM::Filter::Rule *r = layer->rules_ ; r ; r = r->next_ )
-                    {
-                        if ( r->node_ && !r->node_->eval(ctx).toBoolean() ) continue ;
-                        processSetTagActions(r, ctx, &relation) ;
-                        matched.push_back(r) ;
-                    }
+    return matched ;
+}
 
-                    if ( matched.empty() ) continue ;
+static bool matchLayerRules(const OSM::Filter::LayerDefinition *layer, const OSM::Feature &feature, NodeRuleMap &nr,
+                            vector<uint> &candidates, OSM::Filter::RuleProfiler *profiler)
+{
+    const OSM::Filter::RuleIndex &index = layer->index_ ;
 
-                    vector<OSM::Way> chunks ;
-                    if ( !OSM::Document::makeWaysFromRelation(doc, relation, chunks) ) continue ;
+    OSM::Filter::Context ctx(&feature) ;
 
-                    for(int c=0 ; c<chunks.size() ; c++)
-                    {
-                        NodeRuleMap nr ;
+    OSM::Feature copy(feature.type_) ;
 
-                        nr.node_idx_ = chunk_list.size() ;
-                        nr.matched_rules_ = matched ;
+    index.candidates(feature.tags_, candidates) ;
 
-                        chunk_list.push_back(chunks[i]) ;
-                        passFilterRel.push_back(nr) ;
-                    }
+    auto it = candidates.begin() ;
 
-                }
+    while ( it != candidates.end() )
+    {
+        uint pos = *it++ ;
 
-                addOSMLayerLines(doc, layer, passFilterWays, chunk_list, passFilterRel) ;
+        const OSM::Filter::Rule *r = index.rule(pos) ;
+
+        if ( !matchRule(r, ctx, profiler) ) continue ;
+
+        if ( hasSetTagActions(r) )
+        {
+            if ( ctx.feat_ != &copy ) {
+                copy.id_ = feature.id_ ;
+                copy.tags_ = feature.tags_ ;
+                ctx.feat_ = &copy ;
             }
-            else if ( layer->type_ == "polygons" )
+
+            processSetTagActions(r, ctx, &copy) ;
+
+            index.candidates(copy.tags_, candidates) ;
+            it = std::upper_bound(candidates.begin(), candidates.end(), pos) ;
+        }
+
+        nr.matched_rules_.push_back(r) ;
+    }
+
+    if ( ctx.feat_ == &copy )
+    {
+        nr.modified_ = true ;
+        nr.tags_ = std::move(copy.tags_) ;
+    }
+
+    if ( profiler ) profiler->addFeature(layer, !nr.matched_rules_.empty()) ;
+
+    return !nr.matched_rules_.empty() ;
+}
+
+// tags of a matched feature as left by the set-tag actions of the layer
+static const OSM::TagList &matchedTags(const OSM::Feature &feature, const NodeRuleMap &nr)
+{
+    return ( nr.modified_ ) ? nr.tags_ : feature.tags_ ;
+}
+
+// matches of a single layer, collected during the passes over the document
+
+struct LayerMatches {
+    vector<NodeRuleMap> nodes_, ways_, polygons_, chunks_ ;
+    vector<OSM::Way> chunk_list_ ;
+    vector<OSM::Polygon> polygon_list_ ;
+
+    // append the matches of a following range of entities
+    void append(LayerMatches &&other) ;
+};
+
+template<class T>
+static void moveAppend(vector<T> &dst, vector<T> &src)
+{
+    if ( dst.empty() ) dst.swap(src) ;
+    else dst.insert(dst.end(), std::make_move_iterator(src.begin()), std::make_move_iterator(src.end())) ;
+}
+
+void LayerMatches::append(LayerMatches &&other)
+{
+    // chunks and polygons refer to the lists by position
+
+    for( NodeRuleMap &nr: other.chunks_ ) nr.node_idx_ += chunk_list_.size() ;
+    for( NodeRuleMap &nr: other.polygons_ ) nr.node_idx_ += polygon_list_.size() ;
+
+    moveAppend(nodes_, other.nodes_) ;
+    moveAppend(ways_, other.ways_) ;
+    moveAppend(polygons_, other.polygons_) ;
+    moveAppend(chunks_, other.chunks_) ;
+    moveAppend(chunk_list_, other.chunk_list_) ;
+    moveAppend(polygon_list_, other.polygon_list_) ;
+}
+
+// Matches a range of document entities of one type against the layers that take them. Ranges are independent: the
+// document is only read and set-tag actions work on private copies, so they are evaluated on separate threads.
+
+class DocumentMatcher {
+public:
+
+    DocumentMatcher(const OSM::Document &doc, const ImportConfig &cfg, const MapFile::FeatureMask *mask) ;
+
+    size_t numLayers() const { return layers_.size() ; }
+    const OSM::Filter::LayerDefinition *layer(uint l) const { return layers_[l] ; }
+
+    bool hasPointLayers() const { return !point_layers_.empty() ; }
+
+    void matchNodes(size_t begin, size_t end, vector<LayerMatches> &matches) const ;
+    void matchRelations(size_t begin, size_t end, vector<LayerMatches> &matches) const ;
+    void matchWays(size_t begin, size_t end, vector<LayerMatches> &matches) const ;
+
+private:
+
+    const OSM::Document &doc_ ;
+    const MapFile::FeatureMask *mask_ ;
+    OSM::Filter::RuleProfiler *profiler_ ;
+
+    vector<const OSM::Filter::LayerDefinition *> layers_ ;
+    vector<uint> point_layers_, line_layers_, polygon_layers_ ; // indices of the layers taking each kind of feature
+
+    // keys and values tested by the matcher itself, interned once so that the worker threads do not contend for the
+    // string pool lock
+    uint32_t type_key_, area_key_, highway_key_, barrier_key_, contour_key_ ;
+    uint32_t route_val_, multipolygon_val_, boundary_val_, yes_val_, no_val_ ;
+};
+
+static bool hasTagValue(const OSM::TagList &tags, uint32_t key, uint32_t val)
+{
+    const uint32_t *v = tags.find(key) ;
+    return v && *v == val ;
+}
+
+DocumentMatcher::DocumentMatcher(const OSM::Document &doc, const ImportConfig &cfg, const MapFile::FeatureMask *mask):
+    doc_(doc), mask_(mask), profiler_(cfg.profiler_.get())
+{
+    type_key_ = OSM::StringPool::intern("type") ;
+    area_key_ = OSM::StringPool::intern("area") ;
+    highway_key_ = OSM::StringPool::intern("highway") ;
+    barrier_key_ = OSM::StringPool::intern("barrier") ;
+    contour_key_ = OSM::StringPool::intern("contour") ;
+
+    route_val_ = OSM::StringPool::intern("route") ;
+    multipolygon_val_ = OSM::StringPool::intern("multipolygon") ;
+    boundary_val_ = OSM::StringPool::intern("boundary") ;
+    yes_val_ = OSM::StringPool::intern("yes") ;
+    no_val_ = OSM::StringPool::intern("no") ;
+
+    for( const OSM::Filter::LayerDefinition *layer = cfg.layers_ ; layer ; layer = layer->next_ )
+    {
+        if ( layer->type_ == "points" ) point_layers_.push_back(layers_.size()) ;
+        else if ( layer->type_ == "lines" ) line_layers_.push_back(layers_.size()) ;
+        else if ( layer->type_ == "polygons" ) polygon_layers_.push_back(layers_.size()) ;
+
+        layers_.push_back(layer) ;
+    }
+}
+
+// nodes are materialized once into the same object
+
+void DocumentMatcher::matchNodes(size_t begin, size_t end, vector<LayerMatches> &matches) const
+{
+    OSM::Node node ;
+    vector<uint> candidates ;
+
+    for( size_t k=begin ; k<end ; k++ )
+    {
+        if ( mask_ && !mask_->nodes_[k] ) continue ;
+
+        node.id_ = doc_.nodes_.id(k) ;
+        node.tags_ = doc_.nodes_.tags(k) ;
+
+        for( uint l: point_layers_ )
+        {
+            NodeRuleMap nr ;
+
+            nr.node_idx_ = k ;
+
+            if ( matchLayerRules(layers_[l], node, nr, candidates, profiler_) ) matches[l].nodes_.push_back(std::move(nr)) ;
+        }
+    }
+}
+
+// routes become lines made of the merged member ways and multi-polygons become polygons
+
+void DocumentMatcher::matchRelations(size_t begin, size_t end, vector<LayerMatches> &matches) const
+{
+    vector<uint> candidates ;
+
+    for( size_t k=begin ; k<end ; k++ )
+    {
+        if ( mask_ && !mask_->relations_[k] ) continue ;
+
+        const OSM::Relation &relation = doc_.relations_[k] ;
+
+        const uint32_t *rel_type = relation.tags_.find(type_key_) ;
+
+        if ( !rel_type ) continue ;
+
+        if ( *rel_type == route_val_ )
+        {
+            for( uint l: line_layers_ )
             {
-                vector<OSM::Polygon> polygons ;
+                NodeRuleMap matched ;
 
-                // first look for multi-polygon relations
+                if ( !matchLayerRules(layers_[l], relation, matched, candidates, profiler_) ) continue ;
 
-                for(int k=0 ; k<doc.relations_.size() ; k++ )
+                vector<OSM::Way> chunks ;
+                if ( !OSM::Document::makeWaysFromRelation(doc_, relation, chunks) ) continue ;
+
+                LayerMatches &lm = matches[l] ;
+
+                for(int c=0 ; c<chunks.size() ; c++)
                 {
-                    OSM::Relation &relation = doc.relations_[k] ;
+                    NodeRuleMap nr ;
 
-                    string rel_type = relation.tags_.get("type") ;
-                    if (  rel_type != "multipolygon" && rel_type != "boundary" ) continue ;
+                    nr.node_idx_ = lm.chunk_list_.size() ;
+                    nr.matched_rules_ = matched.matched_rules_ ;
 
-                    OSM::Filter::Context ctx(&relation) ;
+                    chunks[c].id_ = relation.id_ ;
+                    chunks[c].tags_ = matchedTags(relation, matched) ;
+                    lm.chunk_list_.push_back(chunks[c]) ;
+                    lm.chunks_.push_back(nr) ;
+                }
+            }
+        }
+        else if ( *rel_type == multipolygon_val_ || *rel_type == boundary_val_ )
+        {
+            for( uint l: polygon_layers_ )
+            {
+                NodeRuleMap matched ;
 
-                    vector<const OSM::Filter::Rule *> matched ;
+                if ( !matchLayerRules(layers_[l], relation, matched, candidates, profiler_) ) continue ;
 
-                    for( const OSM::Filter::Rule *r = layer->rules_ ; r ; r = r->next_ )
-                    {
-                        if ( r->node_ && !r->node_->eval(ctx).toBoolean() ) continue ;
-                        processSetTagActions(r, ctx, &relation) ;
-                        matched.push_back(r) ;
-                    }
+                OSM::Polygon polygon ;
+                if ( !OSM::Document::makePolygonsFromRelation(doc_, relation, polygon) ) continue ;
 
-                    if ( matched.empty() ) continue ;
+                polygon.id_ = relation.id_ ;
+                polygon.tags_ = matchedTags(relation, matched) ;
+                polygon.source_ = OSM::Feature::RelationFeature ;
 
-                    OSM::Polygon polygon ;
-                    if ( !OSM::Document::makePolygonsFromRelation(doc, relation, polygon) ) continue ;
+                LayerMatches &lm = matches[l] ;
 
-                    NodeRuleMap nr ;
+                NodeRuleMap nr ;
 
-                    nr.node_idx_ = polygons.size() ;
-                    nr.matched_rules_ = matched ;
-                    polygons.push_back(polygon) ;
+                nr.node_idx_ = lm.polygon_list_.size() ;
+                nr.matched_rules_ = matched.matched_rules_ ;
+                lm.polygon_list_.push_back(std::move(polygon)) ;
+                lm.polygons_.push_back(nr) ;
+            }
+        }
+    }
+}
 
-                    passFilterPoly.push_back(nr) ;
+// ways become lines unless closed areas and simple polygons if closed
 
-                }
+void DocumentMatcher::matchWays(size_t begin, size_t end, vector<LayerMatches> &matches) const
+{
+    vector<uint> candidates ;
 
-                // check simple polygons
+    for( size_t k=begin ; k<end ; k++ )
+    {
+        if ( mask_ && !mask_->ways_[k] ) continue ;
 
-                for(int k=0 ; k<doc.ways_.size() ; k++ )
-                {
-                    auto way = doc.ways_[k] ;
+        const OSM::Way &way = doc_.ways_[k] ;
 
-                    if ( way.nodes_.front() != way.nodes_.back() ) continue ;
-                    if ( way.tags_.get("area") == "no" ) continue ;
-                    if ( way.tags_.contains("highway") ) continue ;
-                    if ( way.tags_.contains("barrier") ) continue ;
+        if ( way.nodes_.size() < 2 ) continue ;
 
-                    OSM::Filter::Context ctx(&way) ;
+        bool closed = way.nodes_.front() == way.nodes_.back() ;
 
-                    NodeRuleMap nr ;
+        for( uint l: line_layers_ )
+        {
+            NodeRuleMap nr ;
 
-                    nr.node_idx_ = polygons.size()  ;
+            nr.node_idx_ = k ;
 
-                    for( const OSM::Filter::Rule *r = layer->rules_ ; r ; r = r->next_ )
-                    {
-                        if ( r->node_ && !r->node_->eval(ctx).toBoolean() ) continue ;
-                        processSetTagActions(r, ctx, &way) ;
-                        nr.matched_rules_.push_back(r) ;
-                    }
+            if ( !matchLayerRules(layers_[l], way, nr, candidates, profiler_) ) continue ;
 
-                    if ( nr.matched_rules_.empty() ) continue ;
+            // deal with closed ways
 
-                    OSM::Polygon poly ;
+            if ( closed )
+            {
+                const OSM::TagList &tags = matchedTags(way, nr) ;
 
-                    OSM::Ring ring ;
-                    ring.nodes_.insert(ring.nodes_.end(), way.nodes_.begin(), way.nodes_.end()) ;
-                    poly.rings_.push_back(ring) ;
-                    poly.tags_ = way.tags_ ;
-                    polygons.push_back(poly) ;
-                    passFilterPoly.push_back(nr) ;
+                if ( hasTagValue(tags, area_key_, yes_val_) ) continue ;
+                if ( !tags.contains(highway_key_) && !tags.contains(barrier_key_) && !tags.contains(contour_key_) ) continue ;
+            }
 
-                }
+            matches[l].ways_.push_back(std::move(nr)) ;
+        }
+
+        if ( !closed || way.nodes_.size() < 4 ) continue ;
+        if ( hasTagValue(way.tags_, area_key_, no_val_) ) continue ;
+        if ( way.tags_.contains(highway_key_) ) continue ;
+        if ( way.tags_.contains(barrier_key_) ) continue ;
+
+        for( uint l: polygon_layers_ )
+        {
+            NodeRuleMap matched ;
+
+            if ( !matchLayerRules(layers_[l], way, matched, candidates, profiler_) ) continue ;
+
+            LayerMatches &lm = matches[l] ;
+
+            OSM::Polygon poly ;
+
+            OSM::Ring ring ;
+            ring.nodes_.insert(ring.nodes_.end(), way.nodes_.begin(), way.nodes_.end()) ;
+            poly.rings_.push_back(std::move(ring)) ;
+            poly.tags_ = matchedTags(way, matched) ;
+            poly.id_ = way.id_ ;
+            poly.source_ = OSM::Feature::WayFeature ;
+
+            NodeRuleMap nr ;
+
+            nr.node_idx_ = lm.polygon_list_.size() ;
+            nr.matched_rules_ = matched.matched_rules_ ;
+            lm.polygon_list_.push_back(std::move(poly)) ;
+            lm.polygons_.push_back(nr) ;
+        }
+    }
+}
+
+// the rules whose store actions made the row of a matched feature, i.e. up to the first one without continue
+
+static void addStoredRules(OSM::Filter::RuleProfiler *profiler, const NodeRuleMap &nr)
+{
+    for( const OSM::Filter::Rule *r: nr.matched_rules_ )
+    {
+        profiler->addStored(r) ;
+
+        bool cont = false ;
+
+        for( const OSM::Filter::Command *action = r->actions_ ; action ; action = action->next_ )
+            if ( action->cmd_ == OSM::Filter::Command::Continue ) cont = true ;
+
+        if ( !cont ) break ;
+    }
+}
+
+// Splits [0, n) into contiguous ranges matched on up to n_threads threads, the calling one included. The matches of
+// the ranges are appended in range order, so the result does not depend on the number of threads.
+
+template<class Pass>
+static void matchInParallel(size_t n, unsigned int n_threads, vector<LayerMatches> &matches, Pass pass)
+{
+    static const size_t MinRangeSize = 4096 ;
 
-                addOSMLayerPolygons(doc, layer, polygons, passFilterPoly) ;
+    size_t n_ranges = std::max<size_t>(1, std::min<size_t>(n_threads, n / MinRangeSize)) ;
+
+    if ( n_ranges == 1 ) {
+        pass(0, n, matches) ;
+        return ;
+    }
+
+    vector<vector<LayerMatches>> results(n_ranges, vector<LayerMatches>(matches.size())) ;
+
+    vector<std::thread> workers ;
+
+    for( size_t r = 1 ; r < n_ranges ; r++ )
+        workers.push_back(std::thread(pass, n * r / n_ranges, n * (r + 1) / n_ranges, std::ref(results[r]))) ;
+
+    pass(0, n / n_ranges, results[0]) ;
+
+    for( auto &t: workers ) t.join() ;
+
+    for( auto &result: results )
+        for( size_t l=0 ; l<matches.size() ; l++ )
+            matches[l].append(std::move(result[l])) ;
+}
+
+// The document is traversed once per entity type and each entity is evaluated against all layers that take it, instead
+// of traversing (and copying) the whole document once per layer. Each traversal is split among the available cores,
+// shared with the other files being processed concurrently. The batches are produced in layer order.
+
+void MapFile::processOsmDocument(OSM::Document &doc, const ImportConfig &cfg, const FeatureMask *mask, vector<LayerRows> &batches)
+{
+    DocumentMatcher matcher(doc, cfg, mask) ;
+
+    unsigned int n_threads = std::max(1u, std::thread::hardware_concurrency() / std::max(1u, cfg.max_concurrent_files_)) ;
+
+    vector<LayerMatches> matches(matcher.numLayers()) ;
+
+    using namespace std::placeholders ;
+
+    if ( matcher.hasPointLayers() )
+        matchInParallel(doc.nodes_.size(), n_threads, matches, std::bind(&DocumentMatcher::matchNodes, &matcher, _1, _2, _3)) ;
+
+    // relations first so that relation polygons precede way polygons
+
+    matchInParallel(doc.relations_.size(), n_threads, matches, std::bind(&DocumentMatcher::matchRelations, &matcher, _1, _2, _3)) ;
+    matchInParallel(doc.ways_.size(), n_threads, matches, std::bind(&DocumentMatcher::matchWays, &matcher, _1, _2, _3)) ;
+
+    for( uint l=0 ; l<matcher.numLayers() ; l++ )
+    {
+        const OSM::Filter::LayerDefinition *layer = matcher.layer(l) ;
+        LayerMatches &lm = matches[l] ;
+
+        if ( layer->type_ == "points" )
+        {
+            batches.push_back(LayerRows()) ;
+            addOSMLayerPoints(doc, layer, lm.nodes_, batches.back()) ;
+        }
+        else if ( layer->type_ == "lines" )
+        {
+            batches.push_back(LayerRows()) ;
+            addOSMLayerLines(doc, layer, lm.ways_, lm.chunk_list_, lm.chunks_, batches.back()) ;
+        }
+        else if ( layer->type_ == "polygons" )
+        {
+            batches.push_back(LayerRows()) ;
+            addOSMLayerPolygons(doc, layer, lm.polygon_list_, lm.polygons_, batches.back()) ;
+        }
+
+        if ( cfg.profiler_ && !batches.empty() && batches.back().layer_ == layer )
+        {
+            for( auto *list: { &lm.nodes_, &lm.ways_, &lm.chunks_, &lm.polygons_ } )
+                for( const NodeRuleMap &nr: *list ) addStoredRules(cfg.profiler_.get(), nr) ;
+
+            cfg.profiler_->addRows(layer, batches.back().rows_.size()) ;
+        }
+
+        lm = LayerMatches() ;
+    }
+}
+
+// the features whose rows depend on the changed entities, i.e. the changed ones, the ways with a changed node and the
+// relations with an affected member
+
+static void affected_features(const OSM::Document &doc, const OSM::Document::ChangeSet &changes, MapFile::FeatureMask &mask)
+{
+    auto changed = [](const vector<int64_t> &ids, int64_t id) {
+        return std::binary_search(ids.begin(), ids.end(), id) ;
+    } ;
+
+    mask.nodes_.assign(doc.nodes_.size(), false) ;
+    mask.ways_.assign(doc.ways_.size(), false) ;
+    mask.relations_.assign(doc.relations_.size(), false) ;
+
+    for( uint i=0 ; i<doc.nodes_.size() ; i++ )
+        mask.nodes_[i] = changed(changes.nodes_, doc.nodes_.id(i)) ;
+
+    for( uint i=0 ; i<doc.ways_.size() ; i++ )
+    {
+        const OSM::Way &way = doc.ways_[i] ;
+
+        mask.ways_[i] = changed(changes.ways_, way.id_) ||
+                std::any_of(way.nodes_.begin(), way.nodes_.end(), [&](uint idx) { return mask.nodes_[idx] ; }) ;
+    }
+
+    for( uint i=0 ; i<doc.relations_.size() ; i++ )
+    {
+        const OSM::Relation &relation = doc.relations_[i] ;
+
+        mask.relations_[i] = changed(changes.relations_, relation.id_) ||
+                std::any_of(relation.nodes_.begin(), relation.nodes_.end(), [&](uint idx) { return mask.nodes_[idx] ; }) ||
+                std::any_of(relation.ways_.begin(), relation.ways_.end(), [&](uint idx) { return mask.ways_[idx] ; }) ;
+    }
+
+    // propagate to parent relations
+
+    vector<uint> pending ;
+
+    for( uint i=0 ; i<doc.relations_.size() ; i++ )
+        if ( mask.relations_[i] ) pending.push_back(i) ;
+
+    while ( !pending.empty() )
+    {
+        uint idx = pending.back() ;
+        pending.pop_back() ;
+
+        for( uint parent: doc.relations_[idx].parents_ )
+            if ( !mask.relations_[parent] ) {
+                mask.relations_[parent] = true ;
+                pending.push_back(parent) ;
+            }
+    }
+}
+
+void MapFile::queryFeatureExtents(const ImportConfig &cfg, const vector<FeatureKey> &keys, vector<BBox> &boxes)
+{
+    SQLite::Session session(db_) ;
+    SQLite::Connection &con = session.handle() ;
+
+    for( const OSM::Filter::LayerDefinition *layer = cfg.layers_ ; layer ; layer = layer->next_ )
+    {
+        if ( !hasLayer(layer->name_) ) continue ;
+
+        string sql = "SELECT MbrMinX(g), MbrMinY(g), MbrMaxX(g), MbrMaxY(g) FROM (SELECT Transform(" + geom_column_name_ +
+                ", 3857) AS g FROM " + layer->name_ + " WHERE osm_type=? AND osm_id=?) WHERE g NOT NULL" ;
+
+        SQLite::Query q(con, sql) ;
+
+        for( const FeatureKey &key: keys )
+        {
+            q.clear() ;
+            q.bind(1, key.first) ;
+            q.bind(2, (long long)key.second) ;
+
+            for( SQLite::QueryResult res = q.exec() ; res ; res.next() )
+            {
+                BBox box ;
+
+                box.minx_ = res.get<double>(0) ;
+                box.miny_ = res.get<double>(1) ;
+                box.maxx_ = res.get<double>(2) ;
+                box.maxy_ = res.get<double>(3) ;
+                box.srid_ = 3857 ;
+
+                boxes.push_back(box) ;
             }
+        }
+    }
+}
 
+void MapFile::deleteFeatures(const ImportConfig &cfg, const vector<FeatureKey> &keys)
+{
+    SQLite::Session session(db_) ;
+    SQLite::Connection &con = session.handle() ;
+
+    SQLite::Transaction trans(con) ;
+
+    for( const OSM::Filter::LayerDefinition *layer = cfg.layers_ ; layer ; layer = layer->next_ )
+    {
+        if ( !hasLayer(layer->name_) ) continue ;
 
+        SQLite::Command cmd(con, "DELETE FROM " + layer->name_ + " WHERE osm_type=? AND osm_id=?") ;
 
+        for( const FeatureKey &key: keys )
+        {
+            cmd.clear() ;
+            cmd.bind(1, key.first) ;
+            cmd.bind(2, (long long)key.second) ;
+            cmd.exec() ;
         }
     }
 
-    return true ;
+    trans.commit() ;
+}
 
+bool MapFile::updateOsmFiles(const string &baseFile, const vector<string> &changeFiles, const ImportConfig &cfg, vector<BBox> &dirty)
+{
+    OSM::Document doc ;
+    OSM::Document::ChangeSet changes ;
+
+    if ( !cfg.node_locations_file_.empty() && !doc.setNodeLocationFile(cfg.node_locations_file_) )
+    {
+        cerr << "Cannot use node location file " << cfg.node_locations_file_ << endl ;
+        return false ;
+    }
+
+    if ( cfg.tag_filter_ ) doc.setTagFilter(cfg.tag_filter_) ;
+
+    cout << "Applying changes to file: " << baseFile << endl ;
+
+    if ( !doc.read(baseFile, changeFiles, changes) )
+    {
+        cerr << "Error reading from " << baseFile << " or the change files" << endl ;
+        return false ;
+    }
+
+    FeatureMask mask ;
+    affected_features(doc, changes, mask) ;
+
+    // rows to replace, including those of deleted features which are no longer in the document
+
+    vector<FeatureKey> keys ;
+
+    for( int64_t id: changes.nodes_ ) keys.push_back(FeatureKey(OSM::Feature::NodeFeature, id)) ;
+    for( int64_t id: changes.ways_ ) keys.push_back(FeatureKey(OSM::Feature::WayFeature, id)) ;
+    for( int64_t id: changes.relations_ ) keys.push_back(FeatureKey(OSM::Feature::RelationFeature, id)) ;
+
+    for( uint i=0 ; i<doc.ways_.size() ; i++ )
+        if ( mask.ways_[i] ) keys.push_back(FeatureKey(OSM::Feature::WayFeature, doc.ways_[i].id_)) ;
+
+    for( uint i=0 ; i<doc.relations_.size() ; i++ )
+        if ( mask.relations_[i] ) keys.push_back(FeatureKey(OSM::Feature::RelationFeature, doc.relations_[i].id_)) ;
+
+    std::sort(keys.begin(), keys.end()) ;
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end()) ;
+
+    cout << "Updating " << keys.size() << " features" << endl ;
+
+    try {
+        queryFeatureExtents(cfg, keys, dirty) ;
+        deleteFeatures(cfg, keys) ;
+
+        vector<LayerRows> batches ;
+        processOsmDocument(doc, cfg, &mask, batches) ;
+
+        for( const LayerRows &batch: batches )
+            writeLayerRows(batch) ;
+
+        queryFeatureExtents(cfg, keys, dirty) ;
+    }
+    catch ( SQLite::Exception &e )
+    {
+        cerr << e.what() << endl ;
+        return false ;
+    }
+
+    return true ;
 }
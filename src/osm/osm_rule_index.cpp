@@ -0,0 +1,199 @@
+#include "osm_rule_index.hpp"
+#include "osm_rule_parser.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <errno.h>
+
+using namespace std ;
+
+namespace OSM {
+namespace Filter {
+
+void RuleGuard::addKey(uint32_t key)
+{
+    Atom a ;
+    a.key_ = key ;
+    a.val_ = 0 ;
+    a.any_value_ = true ;
+    a.numeric_ = false ;
+
+    atoms_.push_back(a) ;
+}
+
+void RuleGuard::addValue(uint32_t key, uint32_t val, bool numeric)
+{
+    Atom a ;
+    a.key_ = key ;
+    a.val_ = val ;
+    a.any_value_ = false ;
+    a.numeric_ = numeric ;
+
+    atoms_.push_back(a) ;
+}
+
+bool RuleGuard::valuesOnly() const
+{
+    for( const Atom &a: atoms_ )
+        if ( a.any_value_ ) return false ;
+
+    return true ;
+}
+
+void RuleIndex::build(Rule *rules)
+{
+    rules_.clear() ;
+    unguarded_.clear() ;
+    by_key_.clear() ;
+    numeric_by_key_.clear() ;
+    by_value_.clear() ;
+
+    for( Rule *r = rules ; r ; r = r->next_ )
+    {
+        uint pos = rules_.size() ;
+
+        rules_.push_back(r) ;
+
+        RuleGuard guard ;
+
+        if ( !r->node_ || !r->node_->guard(guard) )
+        {
+            unguarded_.push_back(pos) ;
+            continue ;
+        }
+
+        for( const RuleGuard::Atom &a: guard.atoms_ )
+        {
+            if ( a.any_value_ ) by_key_[a.key_].push_back(pos) ;
+            else {
+                by_value_[key(a.key_, a.val_)].push_back(pos) ;
+                if ( a.numeric_ ) numeric_by_key_[a.key_].push_back(pos) ;
+            }
+        }
+    }
+}
+
+// same test as the auto-converting Literal constructor
+static bool isNumber(const string &s)
+{
+    char *e ;
+    std::strtod(s.c_str(), &e) ;
+    return *e == 0 && errno == 0 ;
+}
+
+void RuleIndex::candidates(const TagList &tags, vector<uint> &pos) const
+{
+    pos.assign(unguarded_.begin(), unguarded_.end()) ;
+
+    if ( pos.size() == rules_.size() ) return ;
+
+    for( const TagList::Tag &t: tags )
+    {
+        auto kit = by_key_.find(t.key_) ;
+        if ( kit != by_key_.end() ) pos.insert(pos.end(), kit->second.begin(), kit->second.end()) ;
+
+        auto vit = by_value_.find(key(t.key_, t.val_)) ;
+        if ( vit != by_value_.end() ) pos.insert(pos.end(), vit->second.begin(), vit->second.end()) ;
+
+        auto nit = numeric_by_key_.find(t.key_) ;
+        if ( nit != numeric_by_key_.end() && isNumber(t.value()) ) pos.insert(pos.end(), nit->second.begin(), nit->second.end()) ;
+    }
+
+    std::sort(pos.begin(), pos.end()) ;
+    pos.erase(std::unique(pos.begin(), pos.end()), pos.end()) ;
+}
+
+///////////////////////////////////////////////////////////////////
+
+// A node without a guard may be true for any feature. A tag reference, an existence test, a list test and a comparison
+// with a tag are false when the tag is missing, conjunctions are guarded by either operand and disjunctions by both.
+
+bool ExpressionNode::guard(RuleGuard &) const
+{
+    return false ;
+}
+
+bool Attribute::guard(RuleGuard &g) const
+{
+    g.addKey(key_) ;
+    return true ;
+}
+
+bool ExistsPredicate::guard(RuleGuard &g) const
+{
+    g.addKey(key_) ;
+    return true ;
+}
+
+bool ListPredicate::guard(RuleGuard &g) const
+{
+    if ( !is_pos_ ) g.addKey(key_) ;
+    else {
+        for( uint32_t val: lvals_ )
+            g.addValue(key_, val, false) ;
+    }
+
+    return true ;
+}
+
+bool ComparisonPredicate::guard(RuleGuard &g) const
+{
+    const Attribute *lhs = dynamic_cast<const Attribute *>(children_[0]) ;
+    const Attribute *rhs = dynamic_cast<const Attribute *>(children_[1]) ;
+
+    if ( lhs )
+    {
+        const LiteralExpressionNode *val = dynamic_cast<const LiteralExpressionNode *>(children_[1]) ;
+
+        // equal to a (non numeric) string constant, a tag value that is a number is compared as a number instead
+
+        if ( op_ == Equal && val && val->val_.type_ == Literal::String )
+            g.addValue(lhs->key(), StringPool::intern(val->val_.string_val_), true) ;
+        else
+            g.addKey(lhs->key()) ;
+
+        return true ;
+    }
+    else if ( rhs )
+    {
+        g.addKey(rhs->key()) ;
+        return true ;
+    }
+
+    return false ;
+}
+
+bool BooleanOperator::guard(RuleGuard &g) const
+{
+    switch ( op ) {
+    case And:
+    {
+        RuleGuard g1, g2 ;
+
+        bool has1 = children_[0]->guard(g1) ;
+        bool has2 = children_[1]->guard(g2) ;
+
+        if ( has1 && ( !has2 || g1.valuesOnly() || !g2.valuesOnly() ) ) g = g1 ;
+        else if ( has2 ) g = g2 ;
+        else return false ;
+
+        return true ;
+    }
+    case Or:
+    {
+        RuleGuard g1, g2 ;
+
+        if ( !children_[0]->guard(g1) || !children_[1]->guard(g2) ) return false ;
+
+        g.atoms_.insert(g.atoms_.end(), g1.atoms_.begin(), g1.atoms_.end()) ;
+        g.atoms_.insert(g.atoms_.end(), g2.atoms_.begin(), g2.atoms_.end()) ;
+
+        return true ;
+    }
+    default:
+        return false ;
+    }
+}
+
+} // namespace Filter
+} // namespace OSM
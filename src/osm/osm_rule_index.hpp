@@ -0,0 +1,66 @@
+#ifndef __OSM_RULE_INDEX_H__
+#define __OSM_RULE_INDEX_H__
+
+#include "osm_tag_list.hpp"
+
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+namespace OSM {
+namespace Filter {
+
+class Rule ;
+
+// Condition on the tags of a feature that holds whenever a rule condition is true, i.e. the feature has one of the
+// atoms. An atom is a key or a key/value pair, the latter optionally also satisfied by any numeric value of the key
+// since comparisons with a number convert the tag value.
+
+struct RuleGuard {
+    struct Atom {
+        uint32_t key_ ;
+        uint32_t val_ ;
+        bool any_value_ ;
+        bool numeric_ ;
+    };
+
+    void addKey(uint32_t key) ;
+    void addValue(uint32_t key, uint32_t val, bool numeric) ;
+
+    // true if all atoms test values, used to pick the more selective operand of a conjunction
+    bool valuesOnly() const ;
+
+    std::vector<Atom> atoms_ ;
+};
+
+// Index of the rules of a layer by their guards. Rules without a guard are candidates for all features while the
+// others are found by probing the index with the feature tags, so that a feature is only tested against the rules
+// that may match it.
+
+class RuleIndex {
+public:
+
+    RuleIndex() {}
+
+    void build(Rule *rules) ;
+
+    size_t size() const { return rules_.size() ; }
+    const Rule *rule(uint i) const { return rules_[i] ; }
+
+    // positions of the rules that may match a feature with these tags, in increasing order
+    void candidates(const TagList &tags, std::vector<uint> &pos) const ;
+
+private:
+
+    static uint64_t key(uint32_t key, uint32_t val) { return ( (uint64_t)key << 32 ) | val ; }
+
+    std::vector<const Rule *> rules_ ;
+    std::vector<uint> unguarded_ ;
+    std::unordered_map<uint32_t, std::vector<uint>> by_key_, numeric_by_key_ ;
+    std::unordered_map<uint64_t, std::vector<uint>> by_value_ ;
+};
+
+} // namespace Filter
+} // namespace OSM
+
+#endif
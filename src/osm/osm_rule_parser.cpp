@@ -1,7 +1,6 @@
 #include "osm_rule_scanner.hpp"
 #include "osm_rule_parser.hpp"
 
-#include <boost/regex.hpp>
 #include <boost/format.hpp>
 
 #include <errno.h>
@@ -21,7 +20,12 @@ bool Parser::parse() {
     loc_.initialize() ;
     int res = parser_.parse();
 
-    return ( res == 0 ) ;
+    if ( res != 0 ) return false ;
+
+    for( LayerDefinition *layer = layers_ ; layer ; layer = layer->next_ )
+        layer->index_.build(layer->rules_) ;
+
+    return true ;
 }
 
 void Parser::error(const OSM::BisonParser::location_type &loc,
@@ -42,7 +46,7 @@ void Parser::error(const OSM::BisonParser::location_type &loc,
 std::string Context::id() const {
 
     assert(feat_) ;
-    return feat_->id_ ;
+    return std::to_string(feat_->id_) ;
 }
 
 bool Context::has_tag(const string &key) const
@@ -59,6 +63,13 @@ string Context::value(const string &key) const
     return feat_->tags_.get(key) ;
 }
 
+const uint32_t *Context::find(uint32_t key) const
+{
+    assert(feat_) ;
+
+    return feat_->tags_.find(key) ;
+}
+
 
 ///////////////////////////////////////////////////////////////////
 
@@ -114,6 +125,18 @@ string Literal::toString() const {
     }
 }
 
+Rule::Rule(ExpressionNode *exp, Command *cmd): node_(exp), actions_(cmd)
+{
+    if ( node_ ) program_.compile(node_) ;
+}
+
+bool Rule::matches(Context &ctx) const
+{
+    if ( !node_ ) return true ;
+    if ( !program_.empty() ) return program_.evalBoolean(ctx) ;
+    return node_->eval(ctx).toBoolean() ;
+}
+
 
 Literal BooleanOperator::eval(Context &ctx)
 {
@@ -158,109 +181,9 @@ Literal ComparisonPredicate::eval(Context &ctx)
 
     return Literal() ;
 }
-static string globToRegex(const char *pat)
-{
-    // Convert pattern
-    string rx = "(?i)^", be ;
-
-    int i = 0;
-    const char *pc = pat ;
-    int clen = strlen(pat) ;
-    bool inCharClass = false ;
-
-    while (i < clen)
-    {
-        char c = pc[i++];
-
-        switch (c)
-        {
-        case '*':
-            rx += "[^\\\\/]*" ;
-            break;
-        case '?':
-            rx += "[^\\\\/]" ;
-            break;
-        case '$':  //Regex special characters
-        case '(':
-        case ')':
-        case '+':
-        case '.':
-        case '|':
-            rx += '\\';
-            rx += c;
-            break;
-        case '\\':
-            if ( pc[i] == '*' ) rx += "\\*" ;
-            else if ( pc[i] == '?' )  rx += "\\?" ;
-            ++i ;
-            break ;
-        case '[':
-        {
-            if ( inCharClass )  rx += "\\[";
-            else {
-                inCharClass = true ;
-                be += c ;
-            }
-            break ;
-        }
-        case ']':
-        {
-            if ( inCharClass ) {
-                inCharClass = false ;
-                rx += be ;
-                rx += c ;
-                rx += "{1}" ;
-                be.clear() ;
-            }
-            else rx += "\\]" ;
-
-            break ;
-        }
-        case '%':
-        {
-            boost::regex rd("(0\\d)?d") ;
-            boost::smatch what;
-
-            if ( boost::regex_match(std::string(pat + i), what, rd,  boost::match_extra) )
-            {
-
-                rx += "[[:digit:]]" ;
-
-                if ( what.size() == 2 )
-                {
-                    rx +=  "{" ;
-                    rx += what[1] ;
-                    rx += "}" ;
-                }
-                else
-                    rx += "+" ;
-
-                i += what.size() ;
-            }
-            else
-            {
-                if ( inCharClass ) be += c ;
-                else rx += c;
-            }
-            break ;
-
-        }
-        default:
-            if ( inCharClass ) be += c ;
-            else rx += c;
-        }
-    }
-
-    rx += "$" ;
-    return rx ;
-}
-
 LikeTextPredicate::LikeTextPredicate(ExpressionNode *op, const std::string &pattern, bool is_pos):
-    ExpressionNode(op), is_pos_(is_pos)
+    ExpressionNode(op), pattern_(pattern), is_pos_(is_pos)
 {
-    if ( !pattern.empty() )
-        pattern_ = std::regex(globToRegex(pattern.c_str())) ;
-
 }
 
 
@@ -268,19 +191,18 @@ Literal LikeTextPredicate::eval(Context &ctx)
 {
     Literal op = children_[0]->eval(ctx) ;
 
-    return std::regex_match(op.toString(), pattern_) ;
-
+    return pattern_.match(op.toString()) == is_pos_ ;
 }
 
 ListPredicate::ListPredicate(const string &id, ExpressionNode *op, bool is_pos):
-    id_(id), ExpressionNode(op), is_pos_(is_pos)
+    ExpressionNode(op), id_(id), key_(StringPool::intern(id)), is_pos_(is_pos)
 {
     Context ctx ;
 
     for(int i=0 ; i<children_[0]->children_.size() ; i++)
     {
         string lval = children_[0]->children_[i]->eval(ctx).toString() ;
-        lvals_.push_back(lval) ;
+        lvals_.push_back(StringPool::intern(lval)) ;
     }
 
 }
@@ -288,12 +210,12 @@ ListPredicate::ListPredicate(const string &id, ExpressionNode *op, bool is_pos):
 
 Literal ListPredicate::eval(Context &ctx)
 {
-    if ( !ctx.has_tag(id_) ) return Literal() ;
+    const uint32_t *val = ctx.find(key_) ;
 
-    string val = ctx.value(id_) ;
+    if ( !val ) return Literal() ;
 
     for(int i=0 ; i<lvals_.size() ; i++)
-        if ( val == lvals_[i] ) return is_pos_ ;
+        if ( *val == lvals_[i] ) return is_pos_ ;
 
     return !is_pos_ ;
 }
@@ -320,9 +242,11 @@ Literal IsTypePredicate::eval(Context &ctx)
 
 Literal Attribute::eval(Context &ctx)
 {
-    if ( !ctx.has_tag(name_) ) return Literal() ;
+    const uint32_t *val = ctx.find(key_) ;
 
-    return ctx.value(name_) ;
+    if ( !val ) return Literal() ;
+
+    return StringPool::str(*val) ;
 }
 
 
@@ -359,8 +283,14 @@ Literal BinaryOperator::eval(Context &ctx)
 
 Literal ExistsPredicate::eval(Context &ctx)
 {
-    return ctx.has_tag(tag_) ;
+    return ctx.find(key_) != nullptr ;
+
+}
 
+void ExpressionNode::addKeys(TagFilter &filter) const
+{
+    for( const ExpressionNode *child: children_ )
+        child->addKeys(filter) ;
 }
 
 } // namespace Filter
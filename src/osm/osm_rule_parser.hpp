@@ -3,6 +3,9 @@
 
 #include "osm_rule_scanner.hpp"
 #include "osm_document.hpp"
+#include "osm_rule_program.hpp"
+#include "osm_rule_index.hpp"
+#include "osm_glob_pattern.hpp"
 
 #include <deque>
 #include <string>
@@ -10,8 +13,6 @@
 #include <sstream>
 #include <map>
 
-#include <regex>
-
 namespace OSM {
 
 class FlexScanner ;
@@ -53,6 +54,9 @@ public:
     bool has_tag(const std::string &tag) const ;
     std::string value(const std::string &key) const ;
     std::string id() const ;
+
+    // lookup by interned key, returns the interned value or null if the tag does not exist
+    const uint32_t *find(uint32_t key) const ;
 };
 
 
@@ -80,12 +84,18 @@ public:
 class Rule {
 public:
 
-    Rule(ExpressionNode *exp, Command *cmd): node_(exp), actions_(cmd) {}
+    Rule(ExpressionNode *exp, Command *cmd) ;
     ~Rule() ;
 
+    // test the condition against the feature, rules without condition match all features
+    bool matches(Context &ctx) const ;
+
     ExpressionNode *node_ = nullptr ;
     Command *actions_ = nullptr ;
     Rule *next_ = nullptr ;
+
+    Program program_ ; // compiled condition, empty if the tree is evaluated instead
+    int line_ = 0 ; // line of the rule in the configuration file
 };
 
 
@@ -101,6 +111,8 @@ public:
 
     Rule *rules_ = nullptr;
     LayerDefinition *next_ = nullptr;
+
+    RuleIndex index_ ; // built once the layer is parsed
 };
 
 class ExpressionNode {
@@ -111,6 +123,16 @@ class ExpressionNode {
 
     virtual Literal eval(Context &ctx) { return false ; }
 
+    // emit the instructions computing the node value and return the result register, by default the node is
+    // evaluated through the tree
+    virtual int compile(Program &prog) ;
+
+    // add to the guard the tags that the feature must have for the node to be true, returns false if there are none
+    virtual bool guard(RuleGuard &g) const ;
+
+    // add the keys of the tags read by the node and its children
+    virtual void addKeys(TagFilter &filter) const ;
+
     ExpressionNode(ExpressionNode *child) { appendChild(child) ; }
     ExpressionNode(ExpressionNode *a1, ExpressionNode *a2) {
         appendChild(a1) ;
@@ -140,10 +162,12 @@ class Command {
 public:
     enum Type { Set, Add, Store, Continue, Delete } ;
 
-    Command(Type cmd, std::string ident = std::string(), ExpressionNode *val = 0): cmd_(cmd), tag_(ident), expression_(val), next_(0) {}
+    Command(Type cmd, std::string ident = std::string(), ExpressionNode *val = 0):
+        expression_(val), tag_(ident), key_(StringPool::intern(ident)), cmd_(cmd), next_(0) {}
 
     ExpressionNode *expression_ ;
     std::string tag_ ;
+    uint32_t key_ ; // tag_ in the string pool
     Type cmd_ ;
     Command *next_ ;
 };
@@ -157,18 +181,25 @@ public:
     LiteralExpressionNode(const bool val): val_(val) {}
 
     Literal eval(Context &ctx) { return val_ ; }
+    int compile(Program &prog) { return prog.emitConst(val_) ; }
 
     Literal val_ ;
 };
 
 class Attribute: public ExpressionNode {
 public:
-    Attribute(const std::string name): name_(name) {}
+    Attribute(const std::string name): name_(name), key_(StringPool::intern(name)) {}
 
     Literal eval(Context &ctx) ;
+    int compile(Program &prog) { return prog.emitTag(key_) ; }
+    bool guard(RuleGuard &g) const ;
+    void addKeys(TagFilter &filter) const { filter.addKey(name_) ; }
+
+    uint32_t key() const { return key_ ; }
 
 private:
     std::string name_ ;
+    uint32_t key_ ;
 };
 
 
@@ -204,6 +235,8 @@ public:
     BooleanOperator(Type op_, ExpressionNode *op1, ExpressionNode *op2): op(op_), ExpressionNode(op1, op2) {}
 
     Literal eval(Context &ctx) ;
+    int compile(Program &prog) ;
+    bool guard(RuleGuard &g) const ;
 private:
     Type op ;
 
@@ -216,6 +249,8 @@ public:
     ComparisonPredicate(Type op, ExpressionNode *lhs, ExpressionNode *rhs): op_(op), ExpressionNode(lhs, rhs) {}
 
     Literal eval(Context &ctx) ;
+    int compile(Program &prog) ;
+    bool guard(RuleGuard &g) const ;
 
 private:
     Type op_ ;
@@ -228,7 +263,7 @@ public:
 
     Literal eval(Context &ctx) ;
 private:
-    std::regex pattern_ ;
+    GlobPattern pattern_ ;
     bool is_pos_ ;
 
 };
@@ -240,10 +275,14 @@ public:
 
 
     Literal eval(Context &ctx) ;
+    int compile(Program &prog) ;
+    bool guard(RuleGuard &g) const ;
+    void addKeys(TagFilter &filter) const { filter.addKey(id_) ; }
 
 private:
     std::string id_ ;
-    std::vector<std::string> lvals_ ;
+    uint32_t key_ ;
+    std::vector<uint32_t> lvals_ ;
     bool is_pos_ ;
 
 };
@@ -254,6 +293,7 @@ public:
     IsTypePredicate(const std::string &keyword):  keyword_(keyword) {}
 
     Literal eval(Context &ctx) ;
+    int compile(Program &prog) ;
 
 private:
 
@@ -264,13 +304,17 @@ private:
 class ExistsPredicate: public ExpressionNode {
 public:
 
-    ExistsPredicate(const std::string &tag):  tag_(tag) {}
+    ExistsPredicate(const std::string &tag):  tag_(tag), key_(StringPool::intern(tag)) {}
 
     Literal eval(Context &ctx) ;
+    int compile(Program &prog) { return prog.emitExists(key_) ; }
+    bool guard(RuleGuard &g) const ;
+    void addKeys(TagFilter &filter) const { filter.addKey(tag_) ; }
 
 private:
 
     std::string tag_ ;
+    uint32_t key_ ;
 
 };
 
@@ -0,0 +1,107 @@
+#include "osm_rule_profiler.hpp"
+#include "osm_rule_parser.hpp"
+
+#include <algorithm>
+#include <iomanip>
+
+using namespace std ;
+
+namespace OSM {
+namespace Filter {
+
+RuleProfiler::RuleProfiler(const LayerDefinition *layers)
+{
+    for( const LayerDefinition *layer = layers ; layer ; layer = layer->next_ )
+    {
+        layer_index_[layer] = layers_.size() ;
+
+        for( const Rule *r = layer->rules_ ; r ; r = r->next_ )
+        {
+            rule_index_[r] = rules_.size() ;
+            rules_.push_back(r) ;
+            rule_layers_.push_back(layers_.size()) ;
+        }
+
+        layers_.push_back(layer) ;
+    }
+
+    layer_counters_.reset(new Counters[layers_.size()]) ;
+    rule_counters_.reset(new Counters[rules_.size()]) ;
+}
+
+void RuleProfiler::addEvaluation(const Rule *r, bool matched, uint64_t ns)
+{
+    uint idx = rule_index_.at(r) ;
+
+    Counters &c = rule_counters_[idx] ;
+    c.evaluated_.fetch_add(1, std::memory_order_relaxed) ;
+    if ( matched ) c.matched_.fetch_add(1, std::memory_order_relaxed) ;
+    c.time_ns_.fetch_add(ns, std::memory_order_relaxed) ;
+
+    layer_counters_[rule_layers_[idx]].time_ns_.fetch_add(ns, std::memory_order_relaxed) ;
+}
+
+void RuleProfiler::addStored(const Rule *r)
+{
+    rule_counters_[rule_index_.at(r)].stored_.fetch_add(1, std::memory_order_relaxed) ;
+}
+
+void RuleProfiler::addFeature(const LayerDefinition *layer, bool matched)
+{
+    Counters &c = layer_counters_[layer_index_.at(layer)] ;
+    c.evaluated_.fetch_add(1, std::memory_order_relaxed) ;
+    if ( matched ) c.matched_.fetch_add(1, std::memory_order_relaxed) ;
+}
+
+void RuleProfiler::addRows(const LayerDefinition *layer, uint64_t n)
+{
+    layer_counters_[layer_index_.at(layer)].stored_.fetch_add(n, std::memory_order_relaxed) ;
+}
+
+static double toMillis(uint64_t ns)
+{
+    return ns / 1.0e6 ;
+}
+
+void RuleProfiler::report(ostream &strm) const
+{
+    strm << "Layers:" << endl ;
+    strm << setw(20) << left << "layer" << right << setw(10) << "type" << setw(14) << "features"
+         << setw(12) << "matched" << setw(12) << "rows" << setw(12) << "time (ms)" << endl ;
+
+    for( uint i=0 ; i<layers_.size() ; i++ )
+    {
+        const Counters &c = layer_counters_[i] ;
+
+        strm << setw(20) << left << layers_[i]->name_ << right << setw(10) << layers_[i]->type_
+             << setw(14) << c.evaluated_ << setw(12) << c.matched_ << setw(12) << c.stored_
+             << setw(12) << fixed << setprecision(1) << toMillis(c.time_ns_) << endl ;
+    }
+
+    // most expensive rules first
+
+    vector<uint> order(rules_.size()) ;
+    for( uint i=0 ; i<order.size() ; i++ ) order[i] = i ;
+
+    std::stable_sort(order.begin(), order.end(), [&](uint a, uint b) {
+        return rule_counters_[a].time_ns_ > rule_counters_[b].time_ns_ ;
+    }) ;
+
+    strm << endl << "Rules by evaluation time:" << endl ;
+    strm << setw(20) << left << "layer" << right << setw(8) << "line" << setw(14) << "evaluated"
+         << setw(12) << "matched" << setw(12) << "stored" << setw(12) << "time (ms)" << setw(10) << "ns/eval" << endl ;
+
+    for( uint i: order )
+    {
+        const Counters &c = rule_counters_[i] ;
+        uint64_t evaluated = c.evaluated_ ;
+
+        strm << setw(20) << left << layers_[rule_layers_[i]]->name_ << right << setw(8) << rules_[i]->line_
+             << setw(14) << evaluated << setw(12) << c.matched_ << setw(12) << c.stored_
+             << setw(12) << fixed << setprecision(1) << toMillis(c.time_ns_)
+             << setw(10) << setprecision(0) << ( evaluated ? (double)c.time_ns_ / evaluated : 0.0 ) << endl ;
+    }
+}
+
+} // namespace Filter
+} // namespace OSM
@@ -0,0 +1,63 @@
+#ifndef __OSM_RULE_PROFILER_H__
+#define __OSM_RULE_PROFILER_H__
+
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+
+namespace OSM {
+namespace Filter {
+
+class Rule ;
+class LayerDefinition ;
+
+// Statistics of the layers and rules of an import configuration, collected when profiling is enabled. Counters are
+// atomic since the features are evaluated on several threads. For each rule it counts the evaluations of its
+// condition, the matches, the time spent evaluating and the stored features whose rows it contributed to. For each
+// layer it counts the features tested, the features matched and the rows stored.
+
+class RuleProfiler {
+public:
+
+    RuleProfiler(const LayerDefinition *layers) ;
+
+    // an evaluation of the rule condition that took the given time
+    void addEvaluation(const Rule *r, bool matched, uint64_t ns) ;
+
+    // a stored feature whose row was made by the store actions of the rule
+    void addStored(const Rule *r) ;
+
+    // a feature tested against the rules of the layer
+    void addFeature(const LayerDefinition *layer, bool matched) ;
+
+    void addRows(const LayerDefinition *layer, uint64_t n) ;
+
+    // print the layers and the rules sorted by evaluation time, with the source line of each rule
+    void report(std::ostream &strm) const ;
+
+private:
+
+    struct Counters {
+        Counters(): evaluated_(0), matched_(0), stored_(0), time_ns_(0) {}
+
+        std::atomic<uint64_t> evaluated_, matched_, stored_, time_ns_ ;
+    };
+
+    std::vector<const LayerDefinition *> layers_ ;
+    std::vector<const Rule *> rules_ ;
+    std::vector<uint> rule_layers_ ; // layer index of each rule
+
+    std::unordered_map<const LayerDefinition *, uint> layer_index_ ;
+    std::unordered_map<const Rule *, uint> rule_index_ ;
+
+    std::unique_ptr<Counters[]> layer_counters_, rule_counters_ ;
+};
+
+} // namespace Filter
+} // namespace OSM
+
+#endif
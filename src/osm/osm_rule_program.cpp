@@ -0,0 +1,343 @@
+#include "osm_rule_program.hpp"
+#include "osm_rule_parser.hpp"
+
+#include <cstdlib>
+#include <errno.h>
+
+using namespace std ;
+
+namespace OSM {
+namespace Filter {
+
+typedef Program::Value Value ;
+
+// same conversion as the auto-converting Literal constructor
+static void setString(Value &v, const string *s, uint32_t id)
+{
+    char *e ;
+    double x = std::strtod(s->c_str(), &e) ;
+
+    if ( *e != 0 || errno != 0 ) {
+        v.type_ = Value::String ;
+        v.string_ = s ;
+        v.id_ = id ;
+    }
+    else {
+        v.type_ = Value::Number ;
+        v.number_ = x ;
+    }
+}
+
+static void setLiteral(Value &v, const Literal &l)
+{
+    v.type_ = (Value::Type)l.type_ ;
+    v.number_ = l.number_val_ ;
+    v.boolean_ = l.boolean_val_ ;
+    v.string_ = &l.string_val_ ;
+    v.id_ = Value::NoId ;
+}
+
+static bool toBoolean(const Value &v)
+{
+    switch ( v.type_ ) {
+    case Value::Null: return false ;
+    case Value::Boolean: return v.boolean_ ;
+    case Value::Number: return v.number_ != 0.0 ;
+    case Value::String: return v.string_->empty() ;
+    }
+    return false ;
+}
+
+static double toNumber(const Value &v)
+{
+    switch ( v.type_ ) {
+    case Value::Null: return 0 ;
+    case Value::Boolean: return (double)v.boolean_ ;
+    case Value::Number: return v.number_ ;
+    case Value::String: return atof(v.string_->c_str()) ;
+    }
+    return 0 ;
+}
+
+// string equality where the rhs counts as empty if it is not a string, see ComparisonPredicate::eval
+static bool equalStrings(const Value &lhs, const Value &rhs)
+{
+    if ( rhs.type_ != Value::String ) return lhs.string_->empty() ;
+    if ( lhs.id_ != Value::NoId && rhs.id_ != Value::NoId ) return lhs.id_ == rhs.id_ ;
+    return *lhs.string_ == *rhs.string_ ;
+}
+
+static bool compare(int op, const Value &lhs, const Value &rhs)
+{
+    if ( lhs.type_ == Value::Null || rhs.type_ == Value::Null ) return false ;
+
+    switch ( op ) {
+    case ComparisonPredicate::Equal:
+        if ( lhs.type_ == Value::String ) return equalStrings(lhs, rhs) ;
+        return toNumber(lhs) == toNumber(rhs) ;
+    case ComparisonPredicate::NotEqual:
+        if ( lhs.type_ == Value::String ) return !equalStrings(lhs, rhs) ;
+        return toNumber(lhs) != toNumber(rhs) ;
+    case ComparisonPredicate::Less:
+        return toNumber(lhs) < toNumber(rhs) ;
+    case ComparisonPredicate::Greater:
+        return toNumber(lhs) > toNumber(rhs) ;
+    case ComparisonPredicate::LessOrEqual:
+        return toNumber(lhs) <= toNumber(rhs) ;
+    case ComparisonPredicate::GreaterOrEqual:
+        return toNumber(lhs) >= toNumber(rhs) ;
+    }
+
+    return false ;
+}
+
+static void setBoolean(Value &v, bool b)
+{
+    v.type_ = Value::Boolean ;
+    v.boolean_ = b ;
+}
+
+bool Program::compile(ExpressionNode *node)
+{
+    clear() ;
+
+    result_ = node->compile(*this) ;
+
+    if ( overflow_ ) {
+        clear() ;
+        return false ;
+    }
+
+    return true ;
+}
+
+void Program::clear()
+{
+    code_.clear() ;
+    consts_.clear() ;
+    lists_.clear() ;
+    fallbacks_.clear() ;
+    n_regs_ = 0 ;
+    result_ = 0 ;
+    overflow_ = false ;
+}
+
+void Program::push(OpCode op, int dst, int a, int b, uint32_t arg)
+{
+    Instruction ins ;
+    ins.op_ = op ;
+    ins.dst_ = dst ;
+    ins.a_ = a ;
+    ins.b_ = b ;
+    ins.arg_ = arg ;
+
+    code_.push_back(ins) ;
+}
+
+int Program::emit(OpCode op, uint32_t arg, int a, int b)
+{
+    if ( n_regs_ == MaxRegisters ) {
+        overflow_ = true ;
+        return 0 ;
+    }
+
+    push(op, n_regs_, a, b, arg) ;
+
+    return n_regs_++ ;
+}
+
+int Program::emitConst(const Literal &val)
+{
+    Value v ;
+    setLiteral(v, val) ;
+
+    if ( v.type_ == Value::String ) {
+        v.id_ = StringPool::intern(val.string_val_) ;
+        v.string_ = &StringPool::str(v.id_) ;
+    }
+    else v.string_ = nullptr ;
+
+    consts_.push_back(v) ;
+
+    return emit(LoadConst, consts_.size() - 1) ;
+}
+
+int Program::emitTag(uint32_t key)
+{
+    return emit(LoadTag, key) ;
+}
+
+int Program::emitExists(uint32_t key)
+{
+    return emit(Exists, key) ;
+}
+
+int Program::emitInList(uint32_t key, const std::vector<uint32_t> &vals, bool is_pos)
+{
+    List l ;
+    l.key_ = key ;
+    l.vals_ = vals ;
+    l.is_pos_ = is_pos ;
+
+    lists_.push_back(l) ;
+
+    return emit(InList, lists_.size() - 1) ;
+}
+
+int Program::emitIsType(Feature::Type type)
+{
+    return emit(IsType, type) ;
+}
+
+int Program::emitCompare(int op, int lhs, int rhs)
+{
+    return emit(Compare, op, lhs, rhs) ;
+}
+
+int Program::emitNot(int src)
+{
+    return emit(Not, 0, src) ;
+}
+
+int Program::emitEval(ExpressionNode *node)
+{
+    if ( fallbacks_.size() == MaxFallbacks ) {
+        overflow_ = true ;
+        return 0 ;
+    }
+
+    fallbacks_.push_back(node) ;
+
+    return emit(Eval, fallbacks_.size() - 1) ;
+}
+
+// the result register is set from the lhs and the jump skips the rhs when the lhs already decides the result,
+// otherwise it is overwritten with the result of the rhs
+
+int Program::emitLogical(OpCode jump, ExpressionNode *lhs, ExpressionNode *rhs)
+{
+    int res = emit(ToBoolean, 0, lhs->compile(*this)) ;
+
+    size_t jpos = code_.size() ;
+    push(jump, res, res, 0, 0) ;
+
+    int r = rhs->compile(*this) ;
+    push(ToBoolean, res, r, 0, 0) ;
+
+    code_[jpos].arg_ = code_.size() ;
+
+    return res ;
+}
+
+bool Program::evalBoolean(Context &ctx) const
+{
+    Value regs[MaxRegisters] ;
+    Literal slots[MaxFallbacks] ;
+
+    size_t pc = 0, n = code_.size() ;
+
+    while ( pc < n )
+    {
+        const Instruction &ins = code_[pc++] ;
+        Value &dst = regs[ins.dst_] ;
+
+        switch ( ins.op_ ) {
+        case LoadConst:
+            dst = consts_[ins.arg_] ;
+            break ;
+        case LoadTag:
+        {
+            const uint32_t *val = ctx.find(ins.arg_) ;
+            if ( val ) setString(dst, &StringPool::str(*val), *val) ;
+            else dst.type_ = Value::Null ;
+            break ;
+        }
+        case Exists:
+            setBoolean(dst, ctx.find(ins.arg_) != nullptr) ;
+            break ;
+        case InList:
+        {
+            const List &l = lists_[ins.arg_] ;
+            const uint32_t *val = ctx.find(l.key_) ;
+
+            if ( !val ) dst.type_ = Value::Null ;
+            else {
+                bool found = false ;
+                for( uint32_t v: l.vals_ )
+                    if ( v == *val ) { found = true ; break ; }
+                setBoolean(dst, found ? l.is_pos_ : !l.is_pos_) ;
+            }
+            break ;
+        }
+        case IsType:
+            setBoolean(dst, ctx.feat_->type_ == (Feature::Type)ins.arg_) ;
+            break ;
+        case Compare:
+            setBoolean(dst, compare(ins.arg_, regs[ins.a_], regs[ins.b_])) ;
+            break ;
+        case Not:
+            setBoolean(dst, !toBoolean(regs[ins.a_])) ;
+            break ;
+        case ToBoolean:
+            setBoolean(dst, toBoolean(regs[ins.a_])) ;
+            break ;
+        case JumpIfFalse:
+            if ( !regs[ins.a_].boolean_ ) pc = ins.arg_ ;
+            break ;
+        case JumpIfTrue:
+            if ( regs[ins.a_].boolean_ ) pc = ins.arg_ ;
+            break ;
+        case Eval:
+            slots[ins.arg_] = fallbacks_[ins.arg_]->eval(ctx) ;
+            setLiteral(dst, slots[ins.arg_]) ;
+            break ;
+        }
+    }
+
+    return toBoolean(regs[result_]) ;
+}
+
+///////////////////////////////////////////////////////////////////
+
+int ExpressionNode::compile(Program &prog)
+{
+    return prog.emitEval(this) ;
+}
+
+int BooleanOperator::compile(Program &prog)
+{
+    switch ( op ) {
+    case And:
+        return prog.emitAnd(children_[0], children_[1]) ;
+    case Or:
+        return prog.emitOr(children_[0], children_[1]) ;
+    case Not:
+        return prog.emitNot(children_[0]->compile(prog)) ;
+    }
+
+    return prog.emitEval(this) ;
+}
+
+int ComparisonPredicate::compile(Program &prog)
+{
+    int lhs = children_[0]->compile(prog) ;
+    int rhs = children_[1]->compile(prog) ;
+
+    return prog.emitCompare(op_, lhs, rhs) ;
+}
+
+int ListPredicate::compile(Program &prog)
+{
+    return prog.emitInList(key_, lvals_, is_pos_) ;
+}
+
+int IsTypePredicate::compile(Program &prog)
+{
+    if ( keyword_ == "node" ) return prog.emitIsType(Feature::NodeFeature) ;
+    else if ( keyword_ == "way" ) return prog.emitIsType(Feature::WayFeature) ;
+    else if ( keyword_ == "relation" ) return prog.emitIsType(Feature::RelationFeature) ;
+    else return prog.emitEval(this) ;
+}
+
+} // namespace Filter
+} // namespace OSM
@@ -0,0 +1,102 @@
+#ifndef __OSM_RULE_PROGRAM_H__
+#define __OSM_RULE_PROGRAM_H__
+
+#include "osm_document.hpp"
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+namespace OSM {
+namespace Filter {
+
+class ExpressionNode ;
+class Context ;
+struct Literal ;
+
+// Rule condition compiled to a flat list of register instructions. Evaluating it walks an array instead of the
+// expression tree, keeps intermediate values in registers on the stack and compares tag values by their string pool
+// ids, so no strings are copied. Nodes that have no instruction of their own (functions, arithmetic, pattern matching)
+// are evaluated through the tree and their result is stored in a register. The result of every operation is the same
+// as that of ExpressionNode::eval.
+
+class Program {
+public:
+
+    static const uint MaxRegisters = 64 ;
+    static const uint MaxFallbacks = 8 ;
+
+    Program() {}
+
+    // compile the expression, returns false if it does not fit into the registers, in which case the program is
+    // left empty and the tree has to be evaluated instead
+    bool compile(ExpressionNode *node) ;
+
+    bool empty() const { return code_.empty() ; }
+
+    void clear() ;
+
+    // run the program and convert the result to boolean
+    bool evalBoolean(Context &ctx) const ;
+
+    // emitters used by ExpressionNode::compile, each returns the register holding the result of the instruction
+
+    int emitConst(const Literal &val) ;
+    int emitTag(uint32_t key) ;
+    int emitExists(uint32_t key) ;
+    int emitInList(uint32_t key, const std::vector<uint32_t> &vals, bool is_pos) ;
+    int emitIsType(Feature::Type type) ;
+    int emitCompare(int op, int lhs, int rhs) ;
+    int emitNot(int src) ;
+    int emitAnd(ExpressionNode *lhs, ExpressionNode *rhs) { return emitLogical(JumpIfFalse, lhs, rhs) ; }
+    int emitOr(ExpressionNode *lhs, ExpressionNode *rhs) { return emitLogical(JumpIfTrue, lhs, rhs) ; }
+    int emitEval(ExpressionNode *node) ;
+
+    // register value, string values point into the string pool or the constant table
+    struct Value {
+        enum Type { String, Number, Boolean, Null } ;
+
+        static const uint32_t NoId = 0xffffffff ;
+
+        Type type_ ;
+        double number_ ;
+        bool boolean_ ;
+        const std::string *string_ ;
+        uint32_t id_ ;  // pool id of string_ or NoId
+    };
+
+private:
+
+    enum OpCode { LoadConst, LoadTag, Exists, InList, IsType, Compare, Not, ToBoolean, JumpIfFalse, JumpIfTrue, Eval } ;
+
+    struct Instruction {
+        uint8_t op_ ;
+        uint8_t dst_ ;
+        uint8_t a_, b_ ;    // source registers
+        uint32_t arg_ ;     // key, constant/list/fallback index, comparison operator or jump target
+    };
+
+    struct List {
+        uint32_t key_ ;
+        std::vector<uint32_t> vals_ ;
+        bool is_pos_ ;
+    };
+
+    void push(OpCode op, int dst, int a, int b, uint32_t arg) ;
+    int emit(OpCode op, uint32_t arg, int a = 0, int b = 0) ;
+    int emitLogical(OpCode jump, ExpressionNode *lhs, ExpressionNode *rhs) ;
+
+    std::vector<Instruction> code_ ;
+    std::vector<Value> consts_ ;            // string constants are interned
+    std::vector<List> lists_ ;
+    std::vector<ExpressionNode *> fallbacks_ ;
+
+    uint n_regs_ = 0 ;
+    int result_ = 0 ;
+    bool overflow_ = false ;
+};
+
+} // namespace Filter
+} // namespace OSM
+
+#endif
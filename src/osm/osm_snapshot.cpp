@@ -0,0 +1,509 @@
+#include "osm_document.hpp"
+
+#include <mapped_file.hpp>
+
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+
+using namespace std ;
+
+#define SNAPSHOT_MAGIC "OSMSNAPS"
+#define SNAPSHOT_VERSION 1
+
+// A snapshot holds the document as it is after resolving the references: the node columns, the ways and relations
+// with their members as document indices, and the relation member arrays. Tags and roles refer to a string table
+// stored in the snapshot, since StringPool ids are only valid within a process. Every array is preceded by its
+// length and padded to 8 bytes, so that the file is restored by mapping it and copying the arrays in bulk. Like the
+// PBF block index it is a local cache written in native byte order, tied to the size and modification time of the
+// input file.
+
+namespace OSM {
+
+namespace {
+
+struct SnapshotHeader {
+    char magic_[8] ;
+    uint32_t version_ ;
+    uint32_t size_t_size_ ;
+    uint64_t file_size_ ;
+    int64_t file_mtime_ ;
+    uint64_t options_ ;     // hash of the reading options that change the document contents
+    uint64_t size_ ;        // size of the snapshot, detects truncated files
+};
+
+class SnapshotWriter {
+public:
+
+    SnapshotWriter(FILE *fp): fp_(fp) {}
+
+    template<class T>
+    void write(const T *data, uint64_t n) {
+        static const char padding[8] = { 0 } ;
+
+        size_t bytes = n * sizeof(T) ;
+
+        ok_ = ok_ && fwrite(&n, sizeof(n), 1, fp_) == 1 ;
+        ok_ = ok_ && ( bytes == 0 || fwrite(data, bytes, 1, fp_) == 1 ) ;
+        ok_ = ok_ && ( bytes % 8 == 0 || fwrite(padding, 8 - bytes % 8, 1, fp_) == 1 ) ;
+
+        written_ += sizeof(n) + ( bytes + 7 ) / 8 * 8 ;
+    }
+
+    template<class T>
+    void write(const vector<T> &v) { write(v.data(), v.size()) ; }
+
+    bool ok() const { return ok_ ; }
+    uint64_t written() const { return written_ ; }
+
+private:
+
+    FILE *fp_ ;
+    bool ok_ = true ;
+    uint64_t written_ = 0 ;
+};
+
+class SnapshotReader {
+public:
+
+    SnapshotReader(const char *data, size_t size): data_(data), size_(size) {}
+
+    template<class T>
+    bool read(vector<T> &v) {
+        uint64_t n ;
+
+        if ( pos_ + sizeof(n) > size_ ) return false ;
+        memcpy(&n, data_ + pos_, sizeof(n)) ;
+        pos_ += sizeof(n) ;
+
+        if ( n > ( size_ - pos_ ) / sizeof(T) ) return false ;
+
+        size_t bytes = n * sizeof(T) ;
+
+        v.resize(n) ;
+        if ( bytes ) memcpy(v.data(), data_ + pos_, bytes) ;
+
+        pos_ += ( bytes + 7 ) / 8 * 8 ;
+
+        return true ;
+    }
+
+private:
+
+    const char *data_ ;
+    size_t size_, pos_ = 0 ;
+};
+
+// strings of the snapshot, numbered in order of first use
+
+class SnapshotStrings {
+public:
+
+    uint32_t add(uint32_t id) {
+        auto it = index_.find(id) ;
+        if ( it != index_.end() ) return it->second ;
+
+        uint32_t idx = ids_.size() ;
+        index_.emplace(id, idx) ;
+        ids_.push_back(id) ;
+
+        return idx ;
+    }
+
+    void write(SnapshotWriter &w) const {
+        vector<uint64_t> offsets(1, 0) ;
+        vector<char> chars ;
+
+        for( uint32_t id: ids_ ) {
+            const string &s = StringPool::str(id) ;
+            chars.insert(chars.end(), s.begin(), s.end()) ;
+            offsets.push_back(chars.size()) ;
+        }
+
+        w.write(offsets) ;
+        w.write(chars) ;
+    }
+
+private:
+
+    unordered_map<uint32_t, uint32_t> index_ ;
+    vector<uint32_t> ids_ ;
+};
+
+}
+
+static bool file_stamp(const string &fileName, uint64_t &size, int64_t &mtime)
+{
+    struct stat st ;
+
+    if ( stat(fileName.c_str(), &st) != 0 ) return false ;
+
+    size = st.st_size ;
+    mtime = st.st_mtime ;
+
+    return true ;
+}
+
+static string snapshot_path(const string &fileName)
+{
+    return fileName + ".snap" ;
+}
+
+// tags of a sequence of features as offsets into an array of key/value pairs
+
+template<class F>
+static void write_tags(SnapshotWriter &w, SnapshotStrings &strings, size_t n, F tags)
+{
+    vector<uint64_t> offsets(1, 0) ;
+    vector<uint32_t> pairs ;
+
+    for( size_t i=0 ; i<n ; i++ )
+    {
+        for( const TagList::Tag &t: tags(i) ) {
+            pairs.push_back(strings.add(t.key_)) ;
+            pairs.push_back(strings.add(t.val_)) ;
+        }
+
+        offsets.push_back(pairs.size()) ;
+    }
+
+    w.write(offsets) ;
+    w.write(pairs) ;
+}
+
+// tags of the i-th feature from the arrays written by write_tags, strings maps the snapshot strings to pool ids
+
+template<class F>
+static bool restore_tags(const vector<uint64_t> &offsets, const vector<uint32_t> &pairs, const vector<uint32_t> &strings,
+                         size_t n, F tags)
+{
+    if ( offsets.size() != n + 1 || offsets.back() != pairs.size() ) return false ;
+
+    for( size_t i=0 ; i<n ; i++ )
+    {
+        if ( offsets[i] > offsets[i+1] ) return false ;
+
+        TagList &tl = tags(i) ;
+        tl.reserve(( offsets[i+1] - offsets[i] ) / 2) ;
+
+        for( uint64_t k = offsets[i] ; k + 1 < offsets[i+1] ; k += 2 )
+        {
+            if ( pairs[k] >= strings.size() || pairs[k+1] >= strings.size() ) return false ;
+            tl.add(strings[pairs[k]], strings[pairs[k+1]]) ;
+        }
+    }
+
+    return true ;
+}
+
+template<class T>
+static void write_adjacency(SnapshotWriter &w, const Adjacency<T> &adj)
+{
+    w.write(adj.offsets()) ;
+    w.write(adj.values()) ;
+}
+
+static void write_roles(SnapshotWriter &w, SnapshotStrings &strings, const Adjacency<uint32_t> &roles)
+{
+    vector<uint32_t> values ;
+    values.reserve(roles.values().size()) ;
+
+    for( uint32_t id: roles.values() ) values.push_back(strings.add(id)) ;
+
+    w.write(roles.offsets()) ;
+    w.write(values) ;
+}
+
+// FNV-1a over the sorted keys of the tag filter
+
+uint64_t Document::snapshotOptions() const
+{
+    uint64_t h = 14695981039346656037ull ;
+
+    if ( !tag_filter_ ) return h ;
+
+    vector<string> keys(tag_filter_->keys().begin(), tag_filter_->keys().end()) ;
+    std::sort(keys.begin(), keys.end()) ;
+
+    for( const string &key: keys ) {
+        for( char c: key ) h = ( h ^ (unsigned char)c ) * 1099511628211ull ;
+        h = ( h ^ 0xff ) * 1099511628211ull ; // separator, the byte does not occur in UTF-8
+    }
+
+    return h ;
+}
+
+bool Document::saveSnapshot(const string &fileName) const
+{
+    SnapshotHeader header ;
+
+    memcpy(header.magic_, SNAPSHOT_MAGIC, sizeof(header.magic_)) ;
+    header.version_ = SNAPSHOT_VERSION ;
+    header.size_t_size_ = sizeof(size_t) ;
+    header.options_ = snapshotOptions() ;
+    header.size_ = 0 ;
+
+    if ( !file_stamp(fileName, header.file_size_, header.file_mtime_) ) return false ;
+
+    // write to a temporary file first so that concurrent readers never see a partial snapshot, the header is
+    // rewritten with the final size at the end
+
+    string path = snapshot_path(fileName), tmp_path = path + ".tmp" ;
+
+    FILE *fp = fopen(tmp_path.c_str(), "wb") ;
+
+    if ( !fp ) return false ;
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 ;
+
+    SnapshotWriter w(fp) ;
+    SnapshotStrings strings ;
+
+    // nodes
+
+    size_t n_nodes = nodes_.size() ;
+
+    vector<int32_t> lat(n_nodes), lon(n_nodes) ;
+
+    for( size_t i=0 ; i<n_nodes ; i++ )
+        nodes_.getFixed(i, lat[i], lon[i]) ;
+
+    w.write(nodes_.ids_) ;
+    w.write(lat) ;
+    w.write(lon) ;
+    w.write(nodes_.tagged_) ;
+
+    write_tags(w, strings, nodes_.tags_.size(), [&](size_t i) -> const TagList & { return nodes_.tags_[i] ; }) ;
+
+    lat.clear() ; lat.shrink_to_fit() ;
+    lon.clear() ; lon.shrink_to_fit() ;
+
+    // ways
+
+    vector<int64_t> ids ;
+    vector<uint64_t> offsets(1, 0) ;
+    vector<uint> way_nodes ;
+
+    for( const Way &way: ways_ ) {
+        ids.push_back(way.id_) ;
+        way_nodes.insert(way_nodes.end(), way.nodes_.begin(), way.nodes_.end()) ;
+        offsets.push_back(way_nodes.size()) ;
+    }
+
+    w.write(ids) ;
+    write_tags(w, strings, ways_.size(), [&](size_t i) -> const TagList & { return ways_[i].tags_ ; }) ;
+    w.write(offsets) ;
+    w.write(way_nodes) ;
+
+    // relations
+
+    ids.clear() ;
+    for( const Relation &relation: relations_ ) ids.push_back(relation.id_) ;
+
+    w.write(ids) ;
+    write_tags(w, strings, relations_.size(), [&](size_t i) -> const TagList & { return relations_[i].tags_ ; }) ;
+
+    write_adjacency(w, rel_nodes_) ;
+    write_roles(w, strings, rel_node_roles_) ;
+    write_adjacency(w, rel_ways_) ;
+    write_roles(w, strings, rel_way_roles_) ;
+    write_adjacency(w, rel_children_) ;
+    write_roles(w, strings, rel_child_roles_) ;
+
+    // strings last, since they are collected along the way
+
+    strings.write(w) ;
+
+    header.size_ = sizeof(header) + w.written() ;
+
+    ok = ok && w.ok() && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1 ;
+
+    ok = ( fclose(fp) == 0 ) && ok ;
+
+    if ( ok ) ok = rename(tmp_path.c_str(), path.c_str()) == 0 ;
+
+    if ( !ok ) remove(tmp_path.c_str()) ;
+
+    return ok ;
+}
+
+bool Document::loadSnapshot(const string &fileName, bool &failed)
+{
+    // restore only into an empty document
+
+    if ( !nodes_.empty() || !ways_.empty() || !relations_.empty() ) return false ;
+
+    uint64_t file_size ;
+    int64_t file_mtime ;
+
+    if ( !file_stamp(fileName, file_size, file_mtime) ) return false ;
+
+    MappedFile file ;
+
+    if ( !file.open(snapshot_path(fileName)) ) return false ;
+
+    SnapshotHeader header ;
+
+    if ( file.size() < sizeof(header) ) return false ;
+
+    memcpy(&header, file.data(), sizeof(header)) ;
+
+    if ( memcmp(header.magic_, SNAPSHOT_MAGIC, sizeof(header.magic_)) != 0 ||
+         header.version_ != SNAPSHOT_VERSION ||
+         header.size_t_size_ != sizeof(size_t) ||
+         header.file_size_ != file_size ||
+         header.file_mtime_ != file_mtime ||
+         header.options_ != snapshotOptions() ||
+         header.size_ != file.size() ) return false ;
+
+    SnapshotReader r(file.data() + sizeof(header), file.size() - sizeof(header)) ;
+
+    // the string table is at the end, the arrays before it are read in a first pass
+
+    vector<int64_t> node_ids, way_ids, rel_ids ;
+    vector<int32_t> lat, lon ;
+    vector<uint> tagged ;
+
+    vector<uint64_t> node_tag_offsets, way_tag_offsets, rel_tag_offsets ;
+    vector<uint32_t> node_tag_pairs, way_tag_pairs, rel_tag_pairs ;
+
+    vector<uint64_t> way_node_offsets ;
+    vector<uint> way_nodes ;
+
+    vector<size_t> member_offsets[6] ;
+    vector<uint32_t> member_values[6] ; // members and roles of nodes, ways and child relations
+
+    bool ok = r.read(node_ids) && r.read(lat) && r.read(lon) && r.read(tagged) &&
+            r.read(node_tag_offsets) && r.read(node_tag_pairs) &&
+            r.read(way_ids) && r.read(way_tag_offsets) && r.read(way_tag_pairs) &&
+            r.read(way_node_offsets) && r.read(way_nodes) &&
+            r.read(rel_ids) && r.read(rel_tag_offsets) && r.read(rel_tag_pairs) ;
+
+    for( int k=0 ; k<6 && ok ; k++ )
+        ok = r.read(member_offsets[k]) && r.read(member_values[k]) ;
+
+    vector<uint64_t> string_offsets ;
+    vector<char> chars ;
+
+    ok = ok && r.read(string_offsets) && r.read(chars) ;
+
+    if ( !ok || string_offsets.empty() || string_offsets.back() != chars.size() ) return false ;
+
+    size_t n_nodes = node_ids.size(), n_ways = way_ids.size(), n_rels = rel_ids.size() ;
+
+    if ( lat.size() != n_nodes || lon.size() != n_nodes || way_node_offsets.size() != n_ways + 1 ||
+         way_node_offsets.back() != way_nodes.size() ) return false ;
+
+    for( uint idx: tagged )
+        if ( idx >= n_nodes ) return false ;
+
+    for( uint idx: way_nodes )
+        if ( idx >= n_nodes ) return false ;
+
+    // intern the strings under a single lock
+
+    vector<string> table ;
+    table.reserve(string_offsets.size() - 1) ;
+
+    for( size_t i=0 ; i+1<string_offsets.size() ; i++ ) {
+        if ( string_offsets[i] > string_offsets[i+1] ) return false ;
+        table.emplace_back(chars.data() + string_offsets[i], chars.data() + string_offsets[i+1]) ;
+    }
+
+    vector<uint32_t> strings(table.size()) ;
+    StringPool::intern(table.begin(), table.end(), strings.data()) ;
+
+    table.clear() ;
+    chars.clear() ;
+
+    // restore the entities
+
+    nodes_.tags_.resize(tagged.size()) ;
+
+    ways_.resize(n_ways) ;
+    relations_.resize(n_rels) ;
+
+    ok = restore_tags(node_tag_offsets, node_tag_pairs, strings, tagged.size(), [&](size_t i) -> TagList & { return nodes_.tags_[i] ; }) &&
+         restore_tags(way_tag_offsets, way_tag_pairs, strings, n_ways, [&](size_t i) -> TagList & { return ways_[i].tags_ ; }) &&
+         restore_tags(rel_tag_offsets, rel_tag_pairs, strings, n_rels, [&](size_t i) -> TagList & { return relations_[i].tags_ ; }) ;
+
+    // members are indices of entities and roles indices in the string table
+
+    Adjacency<uint> *members[3] = { &rel_nodes_, &rel_ways_, &rel_children_ } ;
+    Adjacency<uint32_t> *roles[3] = { &rel_node_roles_, &rel_way_roles_, &rel_child_roles_ } ;
+    size_t n_members[3] = { n_nodes, n_ways, n_rels } ;
+
+    for( int k=0 ; k<3 && ok ; k++ )
+    {
+        vector<size_t> &offsets = member_offsets[2*k], &role_offsets = member_offsets[2*k+1] ;
+        vector<uint32_t> &values = member_values[2*k], &role_values = member_values[2*k+1] ;
+
+        ok = offsets.size() == n_rels + 1 && offsets.back() == values.size() && role_offsets == offsets ;
+
+        for( size_t i=0 ; i<n_rels && ok ; i++ )
+            ok = offsets[i] <= offsets[i+1] ;
+
+        for( size_t i=0 ; i<values.size() && ok ; i++ ) {
+            ok = values[i] < n_members[k] && role_values[i] < strings.size() ;
+            if ( ok ) role_values[i] = strings[role_values[i]] ;
+        }
+
+        if ( !ok ) break ;
+
+        members[k]->assign(std::move(offsets), vector<uint>(values.begin(), values.end())) ;
+        roles[k]->assign(std::move(role_offsets), std::move(role_values)) ;
+    }
+
+    for( size_t i=0 ; i<n_ways && ok ; i++ )
+    {
+        ok = way_node_offsets[i] <= way_node_offsets[i+1] ;
+
+        if ( ok ) {
+            ways_[i].id_ = way_ids[i] ;
+            ways_[i].nodes_.assign(way_nodes.begin() + way_node_offsets[i], way_nodes.begin() + way_node_offsets[i+1]) ;
+        }
+    }
+
+    // node coordinates go to the location file before anything is committed, failing to write them is an error that
+    // parsing the input would run into as well
+
+    if ( ok && nodes_.locations_ ) {
+        for( size_t i=0 ; i<n_nodes && ok ; i++ )
+            ok = nodes_.locations_->set(node_ids[i], lat[i], lon[i]) ;
+
+        failed = !ok ;
+    }
+
+    if ( !ok )
+    {
+        nodes_.tags_.clear() ;
+        ways_.clear() ;
+        relations_.clear() ;
+
+        rel_nodes_.clear() ; rel_node_roles_.clear() ;
+        rel_ways_.clear() ; rel_way_roles_.clear() ;
+        rel_children_.clear() ; rel_child_roles_.clear() ;
+
+        return false ;
+    }
+
+    for( size_t i=0 ; i<n_rels ; i++ )
+        relations_[i].id_ = rel_ids[i] ;
+
+    if ( !nodes_.locations_ ) {
+        nodes_.lat_ = std::move(lat) ;
+        nodes_.lon_ = std::move(lon) ;
+    }
+
+    nodes_.ids_ = std::move(node_ids) ;
+    nodes_.tagged_ = std::move(tagged) ;
+
+    linkMembers() ;
+
+    return true ;
+}
+
+}
@@ -0,0 +1,69 @@
+#include "osm_string_pool.hpp"
+
+#include <unordered_map>
+#include <stdexcept>
+
+using namespace std ;
+
+namespace OSM {
+
+const std::string **StringPool::chunks_[StringPool::MaxChunks] ;
+
+// the map owns the strings, chunks point to its keys which are stable across rehashing
+static unordered_map<string, uint32_t> &ids() {
+    static unordered_map<string, uint32_t> ids ;
+    return ids ;
+}
+
+std::mutex &StringPool::mutex() {
+    static std::mutex mtx ;
+    return mtx ;
+}
+
+uint32_t StringPool::insert(const string &s)
+{
+    auto &m = ids() ;
+
+    auto it = m.find(s) ;
+    if ( it != m.end() ) return it->second ;
+
+    if ( m.size() == UINT32_MAX ) throw std::length_error("string pool exhausted") ;
+
+    uint32_t id = m.size() ;
+
+    it = m.insert(make_pair(s, id)).first ;
+
+    const string **&chunk = chunks_[id >> ChunkBits] ;
+    if ( chunk == nullptr ) chunk = new const string *[ChunkMask + 1] ;
+
+    chunk[id & ChunkMask] = &it->first ;
+
+    return id ;
+}
+
+uint32_t StringPool::intern(const string &s)
+{
+    std::lock_guard<std::mutex> lock(mutex()) ;
+    return insert(s) ;
+}
+
+bool StringPool::lookup(const string &s, uint32_t &id)
+{
+    std::lock_guard<std::mutex> lock(mutex()) ;
+
+    auto &m = ids() ;
+
+    auto it = m.find(s) ;
+    if ( it == m.end() ) return false ;
+
+    id = it->second ;
+    return true ;
+}
+
+size_t StringPool::size()
+{
+    std::lock_guard<std::mutex> lock(mutex()) ;
+    return ids().size() ;
+}
+
+}
@@ -0,0 +1,53 @@
+#ifndef __OSM_STRING_POOL_H__
+#define __OSM_STRING_POOL_H__
+
+#include <string>
+#include <cstdint>
+#include <mutex>
+
+namespace OSM {
+
+// Process wide pool of tag keys and values. Each distinct string is stored once and identified by a 32-bit id, so
+// that features hold pairs of integers instead of string copies and tag lookups compare integers. Interning is
+// serialized by a mutex while str() is lock free: strings are kept in fixed size chunks that never move, and an id
+// is only handed out after its string has been stored.
+
+class StringPool {
+public:
+
+    // get the id of a string, adding it to the pool if needed
+    static uint32_t intern(const std::string &s) ;
+
+    // intern a range of strings under a single lock, ids are written to the output array
+    template<class Iterator>
+    static void intern(Iterator begin, Iterator end, uint32_t *ids) {
+        std::lock_guard<std::mutex> lock(mutex()) ;
+        for( ; begin != end ; ++begin ) *ids++ = insert(*begin) ;
+    }
+
+    // get the id of a string already in the pool, returns false otherwise
+    static bool lookup(const std::string &s, uint32_t &id) ;
+
+    // the string with given id
+    static const std::string &str(uint32_t id) {
+        return *chunks_[id >> ChunkBits][id & ChunkMask] ;
+    }
+
+    // number of strings in the pool
+    static size_t size() ;
+
+private:
+
+    static const uint32_t ChunkBits = 16 ;
+    static const uint32_t ChunkMask = ( 1u << ChunkBits ) - 1 ;
+    static const uint32_t MaxChunks = 1u << ( 32 - ChunkBits ) ;
+
+    static std::mutex &mutex() ;
+    static uint32_t insert(const std::string &s) ;
+
+    static const std::string **chunks_[MaxChunks] ;
+};
+
+}
+
+#endif
@@ -0,0 +1,60 @@
+#include "osm_tag_list.hpp"
+
+#include <algorithm>
+
+using namespace std ;
+
+namespace OSM {
+
+const uint32_t TagFilter::Dropped ;
+
+void TagList::set(uint32_t key, uint32_t val)
+{
+    for( Tag &t: tags_ )
+        if ( t.key_ == key ) {
+            t.val_ = val ;
+            return ;
+        }
+
+    tags_.push_back(Tag(key, val)) ;
+}
+
+void TagList::remove(uint32_t key)
+{
+    tags_.erase(std::remove_if(tags_.begin(), tags_.end(), [key](const Tag &t) { return t.key_ == key ; }), tags_.end()) ;
+}
+
+void TagList::remove(const string &key)
+{
+    uint32_t id ;
+    if ( StringPool::lookup(key, id) ) remove(id) ;
+}
+
+bool TagList::contains(const string &key) const
+{
+    uint32_t id ;
+    return StringPool::lookup(key, id) && contains(id) ;
+}
+
+string TagList::get(const string &key, const string &defaultVal) const
+{
+    uint32_t id ;
+
+    if ( !StringPool::lookup(key, id) ) return defaultVal ;
+
+    const uint32_t *val = find(id) ;
+
+    return ( val ) ? StringPool::str(*val) : defaultVal ;
+}
+
+vector<string> TagList::keys() const
+{
+    vector<string> res ;
+
+    for( const Tag &t: tags_ )
+        res.push_back(t.key()) ;
+
+    return res ;
+}
+
+}
@@ -0,0 +1,108 @@
+#ifndef __OSM_TAG_LIST_H__
+#define __OSM_TAG_LIST_H__
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <cstdint>
+
+#include "osm_string_pool.hpp"
+
+namespace OSM {
+
+// Tags of a feature stored as pairs of StringPool ids in insertion order. Features carry only a handful of tags so
+// lookups are a linear scan comparing integers. The overloads taking strings go through the pool lock and are meant
+// for cold code, loops over the features of a document should intern their keys once and use the id overloads.
+
+class TagList {
+public:
+
+    struct Tag {
+        Tag(uint32_t key, uint32_t val): key_(key), val_(val) {}
+
+        const std::string &key() const { return StringPool::str(key_) ; }
+        const std::string &value() const { return StringPool::str(val_) ; }
+
+        uint32_t key_, val_ ;
+    };
+
+    typedef std::vector<Tag>::const_iterator const_iterator ;
+
+    TagList() {}
+
+    // add a key/val pair unless the key already exists
+    void add(const std::string &key, const std::string &val) {
+        add(StringPool::intern(key), StringPool::intern(val)) ;
+    }
+
+    void add(uint32_t key, uint32_t val) {
+        if ( !find(key) ) tags_.push_back(Tag(key, val)) ;
+    }
+
+    // add a key/val pair or replace the value of an existing key
+    void set(const std::string &key, const std::string &val) {
+        set(StringPool::intern(key), StringPool::intern(val)) ;
+    }
+
+    void set(uint32_t key, uint32_t val) ;
+
+    // remove entry with given key if exists
+    void remove(const std::string &key) ;
+    void remove(uint32_t key) ;
+
+    void clear() { tags_.clear() ; }
+    void reserve(size_t n) { tags_.reserve(n) ; }
+
+    bool contains(const std::string &key) const ;
+    bool contains(uint32_t key) const { return find(key) != nullptr ; }
+
+    // get the value of the given key if exists, otherwise return defaultVal
+    std::string get(const std::string &key, const std::string &defaultVal = std::string()) const ;
+
+    // pointer to the value id of the given key or null if it does not exist
+    const uint32_t *find(uint32_t key) const {
+        for( const Tag &t: tags_ )
+            if ( t.key_ == key ) return &t.val_ ;
+        return nullptr ;
+    }
+
+    std::vector<std::string> keys() const ;
+
+    size_t size() const { return tags_.size() ; }
+    bool empty() const { return tags_.empty() ; }
+
+    const_iterator begin() const { return tags_.begin() ; }
+    const_iterator end() const { return tags_.end() ; }
+
+private:
+
+    std::vector<Tag> tags_ ;
+};
+
+// Keys of the tags kept when reading a document, the others are dropped while decoding (see Document::setTagFilter)
+
+class TagFilter {
+public:
+
+    // pool id of the strings of a block that are not interned since they belong to dropped tags only
+    static const uint32_t Dropped = 0xffffffff ;
+
+    TagFilter() {}
+    TagFilter(std::initializer_list<std::string> keys): keys_(keys) {}
+
+    void addKey(const std::string &key) { keys_.insert(key) ; }
+
+    bool accepts(const std::string &key) const { return keys_.count(key) != 0 ; }
+
+    size_t size() const { return keys_.size() ; }
+
+    const std::unordered_set<std::string> &keys() const { return keys_ ; }
+
+private:
+
+    std::unordered_set<std::string> keys_ ;
+};
+
+}
+
+#endif
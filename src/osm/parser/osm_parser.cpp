@@ -688,13 +688,13 @@ namespace OSM {
 
   case 7:
 #line 111 "/home/malasiot/source/mbtools/src/osm/osm.y" // lalr1.cc:847
-    { yylhs.value.as< OSM::Filter::Rule * > () = new OSM::Filter::Rule{yystack_[1].value.as< OSM::Filter::ExpressionNode * > (), yystack_[0].value.as< OSM::Filter::Command * > ()} ; }
+    { yylhs.value.as< OSM::Filter::Rule * > () = new OSM::Filter::Rule{yystack_[1].value.as< OSM::Filter::ExpressionNode * > (), yystack_[0].value.as< OSM::Filter::Command * > ()} ; yylhs.value.as< OSM::Filter::Rule * > ()->line_ = yylhs.location.begin.line ; }
 #line 693 "/home/malasiot/source/mbtools/src/osm/parser/osm_parser.cpp" // lalr1.cc:847
     break;
 
   case 8:
 #line 112 "/home/malasiot/source/mbtools/src/osm/osm.y" // lalr1.cc:847
-    { yylhs.value.as< OSM::Filter::Rule * > () = new OSM::Filter::Rule{nullptr, yystack_[0].value.as< OSM::Filter::Command * > ()} ; }
+    { yylhs.value.as< OSM::Filter::Rule * > () = new OSM::Filter::Rule{nullptr, yystack_[0].value.as< OSM::Filter::Command * > ()} ; yylhs.value.as< OSM::Filter::Rule * > ()->line_ = yylhs.location.begin.line ; }
 #line 699 "/home/malasiot/source/mbtools/src/osm/parser/osm_parser.cpp" // lalr1.cc:847
     break;
 
@@ -1173,7 +1173,7 @@ case 51:
 /* rule 51 can match eol */
 YY_RULE_SETUP
 #line 99 "/home/malasiot/source/mbtools/src/osm/osm.l"
-{ yylloc->step();}
+{ yylloc->lines(); yylloc->step();}
 	YY_BREAK
 case 52:
 YY_RULE_SETUP
@@ -11,7 +11,6 @@ class Dictionary
 	public:
 
 	Dictionary() ;
-	~Dictionary() {}
 
 	// add a key/val pair 
     void add(const std::string &key, const std::string &val) ;
@@ -0,0 +1,85 @@
+#include "mapped_file.hpp"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <fstream>
+
+using namespace std ;
+
+static const char empty_file_data = 0 ;
+
+MappedFile::MappedFile(): data_(nullptr), size_(0), mapped_(false) {}
+
+MappedFile::~MappedFile()
+{
+    close() ;
+}
+
+bool MappedFile::open(const string &fileName)
+{
+    close() ;
+
+#ifndef _WIN32
+    int fd = ::open(fileName.c_str(), O_RDONLY) ;
+
+    if ( fd == -1 ) return false ;
+
+    struct stat st ;
+
+    if ( fstat(fd, &st) == -1 ) {
+        ::close(fd) ;
+        return false ;
+    }
+
+    size_ = st.st_size ;
+
+    if ( size_ == 0 ) {
+        ::close(fd) ;
+        data_ = &empty_file_data ;
+        return true ;
+    }
+
+    void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0) ;
+
+    ::close(fd) ;
+
+    if ( p != MAP_FAILED ) {
+        // the file is consumed front to back
+        madvise(p, size_, MADV_SEQUENTIAL) ;
+
+        data_ = (const char *)p ;
+        mapped_ = true ;
+        return true ;
+    }
+#endif
+
+    ifstream strm(fileName.c_str(), ios::in | ios::binary) ;
+
+    if ( !strm ) return false ;
+
+    buffer_.assign(istreambuf_iterator<char>(strm), istreambuf_iterator<char>()) ;
+
+    size_ = buffer_.size() ;
+    data_ = ( buffer_.empty() ) ? &empty_file_data : buffer_.data() ;
+
+    return true ;
+}
+
+void MappedFile::close()
+{
+#ifndef _WIN32
+    if ( mapped_ ) munmap((void *)data_, size_) ;
+#endif
+
+    buffer_.clear() ;
+    buffer_.shrink_to_fit() ;
+
+    data_ = nullptr ;
+    size_ = 0 ;
+    mapped_ = false ;
+}
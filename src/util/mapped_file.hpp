@@ -0,0 +1,35 @@
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+#include <string>
+#include <vector>
+
+// Read only view of a whole file mapped in memory. Where mapping is not available the file contents are read into
+// a heap buffer instead.
+
+class MappedFile {
+public:
+
+    MappedFile() ;
+    ~MappedFile() ;
+
+    bool open(const std::string &fileName) ;
+    void close() ;
+
+    bool isOpen() const { return data_ != nullptr ; }
+
+    const char *data() const { return data_ ; }
+    size_t size() const { return size_ ; }
+
+private:
+
+    MappedFile(const MappedFile &) = delete ;
+    MappedFile &operator = (const MappedFile &) = delete ;
+
+    const char *data_ ;
+    size_t size_ ;
+    bool mapped_ ;
+    std::vector<char> buffer_ ; // fallback storage
+};
+
+#endif
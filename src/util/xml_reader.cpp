@@ -1,74 +1,229 @@
 #include "xml_reader.hpp"
 
 #include <iostream>
-#include <boost/algorithm/string/replace.hpp>
+#include <algorithm>
+#include <cstring>
 #include <stdio.h>
 #include <stdlib.h>
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define XML_READER_SSE2
+#endif
+
 using namespace std ;
 
-#define BUF_SIZE 1024*16
+// size of the initial stream buffer, it is grown if a single token does not fit
+#define BUF_SIZE 1024*1024
+
+static const size_t npos = std::string::npos ;
+
+// first occurrence of any of the three characters in [p, e) or null
 
-void XmlReader::flush()
+static const char *find_any(const char *p, const char *e, char a, char b, char c)
 {
-    cp_ = buf_ ;
-    size_t rs ;
+#ifdef XML_READER_SSE2
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), vc = _mm_set1_epi8(c) ;
 
-    if ( fdesc_ )
-        rs = fread(buf_, 1, buf_size_, fdesc_);
-    else
+    for( ; e - p >= 16 ; p += 16 )
     {
-        strm_->read(buf_, buf_size_) ;
-        rs = strm_->gcount() ;
+        __m128i v = _mm_loadu_si128((const __m128i *)p) ;
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)), _mm_cmpeq_epi8(v, vc)) ;
+
+        int mask = _mm_movemask_epi8(m) ;
+        if ( mask ) return p + __builtin_ctz(mask) ;
     }
+#endif
+
+    for( ; p < e ; ++p )
+        if ( *p == a || *p == b || *p == c ) return p ;
 
-    be_ = cp_ + rs ;
+    return nullptr ;
 }
 
-void XmlReader::advance()
+//! returns true if a character is whitespace
+static bool isWhiteSpaceCharacter(char c)
 {
-    if ( cp_ == nullptr ) return ;
-    if ( *cp_ == '\n' ) lineno_ ++ ;
-    if ( ++cp_ < be_ )  ;
-    else {
-        flush() ;
-        if ( cp_ == be_ ) cp_ = nullptr ;
-    }
+        return ( c == ' ' || c == '\t' || c == '\n' || c == '\r');
 }
 
-XmlReader::XmlReader(istream &strm): strm_(&strm), fdesc_(nullptr), current_node_type_(None), lineno_(1)
+// append [s, e) to out replacing the predefined xml entities
+
+static void decode_entities(const char *s, const char *e, string &out)
 {
-    buf_size_ = BUF_SIZE ;
-    buf_ = new char [buf_size_] ;
-    flush() ;
+    static const struct { const char *name_ ; size_t len_ ; char c_ ; } entities[] = {
+        { "&amp;", 5, '&' }, { "&lt;", 4, '<' }, { "&gt;", 4, '>' }, { "&quot;", 6, '"' }, { "&apos;", 6, '\'' }
+    } ;
 
+    while ( s < e )
+    {
+        const char *amp = (const char *)memchr(s, '&', e - s) ;
+
+        if ( !amp ) {
+            out.append(s, e) ;
+            break ;
+        }
+
+        out.append(s, amp) ;
+
+        s = amp + 1 ;
+        out += '&' ;
+
+        for( const auto &ent: entities )
+        {
+            if ( (size_t)(e - amp) >= ent.len_ && memcmp(amp, ent.name_, ent.len_) == 0 ) {
+                out.back() = ent.c_ ;
+                s = amp + ent.len_ ;
+                break ;
+            }
+        }
+    }
 }
 
-XmlReader::XmlReader(const string &fileName): strm_(nullptr), current_node_type_(None), lineno_(1)
+XmlReader::XmlReader(istream &strm): current_node_type_(None), strm_(&strm), eof_(false), is_empty_elem_(false), lineno_(1)
 {
-    fdesc_ = fopen(fileName.c_str(), "rt") ;
+    buf_.resize(BUF_SIZE) ;
+    cp_ = be_ = tok_ = line_pos_ = buf_.data() ;
+    refill() ;
+}
 
-    buf_size_ = BUF_SIZE ;
-    buf_ = new char [buf_size_] ;
-    flush() ;
+XmlReader::XmlReader(const string &fileName): current_node_type_(None), strm_(nullptr), eof_(true), is_empty_elem_(false), lineno_(1)
+{
+    // the whole file is the buffer, an unreadable file looks empty
+
+    if ( file_.open(fileName) ) {
+        cp_ = tok_ = line_pos_ = file_.data() ;
+        be_ = cp_ + file_.size() ;
+    }
+    else
+        cp_ = be_ = tok_ = line_pos_ = nullptr ;
 }
 
 XmlReader::~XmlReader()
 {
-    delete [] buf_ ;
-    if ( fdesc_ ) fclose(fdesc_) ;
 }
 
-bool XmlReader::read()
+// load more input keeping the data starting at the current token, returns false if there is no more input
+
+bool XmlReader::refill()
+{
+    if ( eof_ ) return false ;
+
+    lineno_ += std::count(line_pos_, tok_, '\n') ;
+
+    size_t n = be_ - tok_, cp_off = cp_ - tok_ ;
+
+    if ( tok_ != buf_.data() )
+        memmove(buf_.data(), tok_, n) ;
+    else if ( n == buf_.size() )
+        buf_.resize(buf_.size() * 2) ;
+
+    char *base = buf_.data() ;
+
+    strm_->read(base + n, buf_.size() - n) ;
+    size_t rs = strm_->gcount() ;
+
+    tok_ = line_pos_ = base ;
+    cp_ = base + cp_off ;
+    be_ = base + n + rs ;
+
+    if ( rs == 0 ) {
+        eof_ = true ;
+        return false ;
+    }
+
+    return true ;
+}
+
+bool XmlReader::ensure(size_t n)
 {
-    // if not end reached, parse the node
-    if ( !cp_ ) return false ;
+    while ( (size_t)(be_ - tok_) < n )
+        if ( !refill() ) return false ;
 
+    return true ;
+}
+
+size_t XmlReader::find(size_t offset, char c)
+{
+    while ( true )
+    {
+        const char *p = tok_ + offset ;
+
+        if ( p < be_ ) {
+            const char *q = (const char *)memchr(p, c, be_ - p) ;
+            if ( q ) return q - tok_ ;
+        }
+
+        offset = std::max(offset, (size_t)(be_ - tok_)) ;
+
+        if ( !refill() ) return npos ;
+    }
+}
+
+size_t XmlReader::findAny(size_t offset, char a, char b, char c)
+{
+    while ( true )
+    {
+        const char *p = tok_ + offset ;
+
+        if ( p < be_ ) {
+            const char *q = find_any(p, be_, a, b, c) ;
+            if ( q ) return q - tok_ ;
+        }
+
+        offset = std::max(offset, (size_t)(be_ - tok_)) ;
+
+        if ( !refill() ) return npos ;
+    }
+}
+
+// offset of the first occurrence of seq at or after offset
+
+size_t XmlReader::findSequence(size_t offset, const char *seq, size_t len)
+{
+    while ( true )
+    {
+        size_t pos = find(offset + len - 1, seq[len-1]) ;
+
+        if ( pos == npos ) return npos ;
+
+        size_t start = pos - ( len - 1 ) ;
+
+        if ( memcmp(tok_ + start, seq, len - 1) == 0 ) return start ;
+
+        offset = start + 1 ;
+    }
+}
+
+// offset of the '>' closing the current tag, skipping quoted attribute values
+
+size_t XmlReader::findTagEnd(size_t offset)
+{
+    while ( true )
+    {
+        size_t pos = findAny(offset, '>', '"', '\'') ;
+
+        if ( pos == npos ) return npos ;
+
+        char c = tok_[pos] ;
+
+        if ( c == '>' ) return pos ;
+
+        size_t close = find(pos + 1, c) ;
+
+        if ( close == npos ) return npos ;
+
+        offset = close + 1 ;
+    }
+}
+
+bool XmlReader::read()
+{
     do {
        parseCurrentNode();
     } while ( current_node_type_ == Ignored ) ;
 
-    return ( cp_ && current_node_type_ != Invalid && current_node_type_ != None ) ;
+    return ( current_node_type_ != Invalid && current_node_type_ != None ) ;
 
 }
 
@@ -77,74 +232,73 @@ void XmlReader::parseCurrentNode()
 {
     if ( current_node_type_ == StartElement && is_empty_elem_ ) {
         current_node_type_ = EndElement ;
+        is_empty_elem_ = false ;
         return ;
     }
 
     current_node_type_ = None ;
 
-    char* start = cp_;
+    tok_ = cp_ ;
 
-    // more forward until '<' found
-    while(cp_ && *cp_ != '<' )
-        advance() ;
+    // move forward until '<' found
 
-    if (!cp_) return;
+    size_t lt = find(0, '<') ;
 
-    if (cp_ - start > 0)
-    {
-        // we found some text, store it
-        if (setText(start, cp_)) return;
+    if ( lt == npos ) {
+        cp_ = be_ ;
+        return ;
+    }
+
+    if ( lt > 0 && setText(tok_, tok_ + lt) ) {
+        // we found some text
+        cp_ = tok_ + lt ;
+        return ;
     }
 
-    advance() ;
+    tok_ += lt ;
+    cp_ = tok_ ;
 
-    if ( !cp_ ) return ;
+    if ( !ensure(2) ) {
+        cp_ = be_ ;
+        return ;
+    }
 
     // based on current token, parse and report next element
 
-    switch(*cp_)
+    bool ok ;
+
+    switch( tok_[1] )
     {
         case '/':
-            parseClosingXMLElement();
+            ok = parseClosingXMLElement();
             break;
         case '?':
-            ignoreDefinition();
+            ok = ignoreDefinition();
             break;
         case '!':
-            if (!parseCDATA()) parseComment();
+            if ( ensure(9) && memcmp(tok_, "<![CDATA[", 9) == 0 ) ok = parseCDATA() ;
+            else ok = parseComment();
             break;
         default:
-            parseOpeningXMLElement();
+            ok = parseOpeningXMLElement();
             break;
     }
-}
-
-//! returns true if a character is whitespace
-static bool isWhiteSpaceCharacter(char c)
-{
-        return ( c == ' ' || c == '\t' || c == '\n' || c == '\r');
-}
 
-
-string replaceSpecialCharacters(const string &orig_str)
-{
-
-    string res = boost::replace_all_copy(orig_str, "&amp;", "&") ;
-    boost::replace_all(res, "&lt;", "<") ;
-    boost::replace_all(res, "&gt;", ">") ;
-    boost::replace_all(res, "&quot;", "\"") ;
-    boost::replace_all(res, "&apos;", "\'") ;
-    return res ;
+    if ( !ok ) {
+        // malformed or truncated input
+        current_node_type_ = Invalid ;
+        cp_ = be_ ;
+    }
 }
 
     //! sets the state that text was found. Returns true if set should be set
-bool XmlReader::setText(char* start, char* end)
+bool XmlReader::setText(const char* start, const char* end)
 {
     // check if text is more than 2 characters, and if not, check if there is
     // only white space, so that this text won't be reported
     if (end - start < 3)
     {
-        char* p = start;
+        const char* p = start;
         for(; p != end; ++p)
             if (!isWhiteSpaceCharacter(*p))
                 break;
@@ -154,8 +308,8 @@ bool XmlReader::setText(char* start, char* end)
     }
 
     // set current text to the parsed text, and replace xml special characters
-    std::string s(start, (int)(end - start));
-    current_node_name_ = replaceSpecialCharacters(s);
+    current_node_name_.clear() ;
+    decode_entities(start, end, current_node_name_) ;
 
     // current XML node type is text
     current_node_type_ = Characters;
@@ -163,209 +317,216 @@ bool XmlReader::setText(char* start, char* end)
     return true;
 }
 
-void XmlReader::ignoreDefinition()
+bool XmlReader::ignoreDefinition()
 {
     current_node_type_ = Ignored;
 
     // move until end marked with '>' reached
-    while(cp_ && *cp_ != L'>')
-        advance() ;
+    size_t end = findTagEnd(2) ;
 
-    advance() ;
+    if ( end == npos ) return false ;
+
+    cp_ = tok_ + end + 1 ;
+
+    return true ;
 }
 
-void XmlReader::parseComment()
+bool XmlReader::parseComment()
 {
     current_node_type_ = Ignored;
-    advance() ;
 
-    int count = 1;
+    if ( ensure(4) && memcmp(tok_, "<!--", 4) == 0 )
+    {
+        size_t end = findSequence(4, "-->", 3) ;
+
+        if ( end == npos ) return false ;
 
-    // move until end of comment reached
-    while( count )
+        cp_ = tok_ + end + 3 ;
+    }
+    else
     {
-        if (*cp_ == '>') --count;
-        else if (*cp_ == '<') ++count;
+        // other declaration (e.g. DOCTYPE), move past the matching '>'
+
+        size_t offset = 2 ;
+        int count = 1 ;
+
+        while ( count )
+        {
+            size_t pos = findAny(offset, '<', '>', '>') ;
+
+            if ( pos == npos ) return false ;
 
-        advance() ;
-        if ( !cp_ ) break ;
+            if ( tok_[pos] == '>' ) --count ;
+            else ++count ;
+
+            offset = pos + 1 ;
+        }
+
+        cp_ = tok_ + offset ;
     }
+
+    return true ;
 }
 
 
     //! parses an opening xml element and reads attributes
-void XmlReader::parseOpeningXMLElement()
+bool XmlReader::parseOpeningXMLElement()
 {
+    size_t end = findTagEnd(1) ;
+
+    if ( end == npos ) return false ;
+
+    // the whole tag is now contiguous in the buffer
+
+    const char *p = tok_ + 1, *e = tok_ + end ;
+
+    cp_ = e + 1 ;
+
     current_node_type_ = StartElement;
     is_empty_elem_ = false;
     attrs_.clear();
 
-    current_node_name_.clear() ;
-
-    // find end of element
-    while(cp_ && *cp_ != '>' && !isWhiteSpaceCharacter(*cp_)) {
-        current_node_name_ += *cp_ ;
-        advance() ;
+    if ( e > p && e[-1] == '/' ) {
+        // tag is closed directly
+        is_empty_elem_ = true ;
+        --e ;
     }
 
-    // find Attributes
-    while(*cp_ != '>')
-    {
-        if (isWhiteSpaceCharacter(*cp_))
-            advance() ;
-        else
-        {
-            if (*cp_ != '/')
-            {
-                // we've got an attribute
+    // element name
 
-                // read the attribute names
-                string name ;
+    const char *n = p ;
 
-                while(!isWhiteSpaceCharacter(*cp_) && *cp_ != '=') {
-                    name += *cp_ ;
-                    advance() ;
-                }
+    while ( p < e && !isWhiteSpaceCharacter(*p) ) ++p ;
 
-                advance() ;
+    current_node_name_.assign(n, p) ;
 
-                // read the attribute value
-                while( cp_ && (*cp_ != '\"') && (*cp_ != '\'') )  advance() ;
+    // decoded values never exceed the tag length so that the storage is not reallocated while filling it
 
-                if (!cp_) // malformatted xml file
-                    return;
+    decoded_.clear() ;
+    decoded_.reserve(e - p) ;
 
-                const char attributeQuoteChar = *cp_;
+    // find Attributes
 
-                advance() ;
+    while ( true )
+    {
+        while ( p < e && isWhiteSpaceCharacter(*p) ) ++p ;
 
-                string value ;
+        if ( p == e ) break ;
 
-                while( cp_ && *cp_ != attributeQuoteChar )  {
-                    value += *cp_ ;
-                    advance() ;
-                }
+        // read the attribute name
 
-                if (!cp_) // malformatted xml file
-                    return;
+        const char *name = p ;
 
-                advance();
+        while ( p < e && *p != '=' && !isWhiteSpaceCharacter(*p) ) ++p ;
 
-                value = replaceSpecialCharacters(value);
+        const char *name_end = p ;
 
-                attrs_[name] = value ;
-            }
-            else
-            {
-                // tag is closed directly
-                advance() ;
-                is_empty_elem_ = true ;
+        // read the attribute value
 
-                break;
-            }
-        }
-    }
+        while ( p < e && *p != '"' && *p != '\'' ) ++p ;
 
+        if ( p == e ) return false ;
 
-    int nlen = current_node_name_.size() ;
+        const char quote = *p++ ;
 
-    if ( current_node_name_[nlen-1] == '/' )
-    {
-        current_node_name_ = current_node_name_.substr(0, nlen - 1 ) ;
-        is_empty_elem_ = true ;
-    }
+        const char *value = p ;
+        const char *value_end = (const char *)memchr(value, quote, e - value) ;
 
+        if ( !value_end ) return false ;
 
+        p = value_end + 1 ;
 
-    advance() ;
+        Attribute attr ;
+        attr.name_ = boost::string_ref(name, name_end - name) ;
 
+        if ( memchr(value, '&', value_end - value) ) {
+            size_t offset = decoded_.size() ;
+            decode_entities(value, value_end, decoded_) ;
+            attr.value_ = boost::string_ref(decoded_.data() + offset, decoded_.size() - offset) ;
+        }
+        else
+            attr.value_ = boost::string_ref(value, value_end - value) ;
+
+        attrs_.push_back(attr) ;
+    }
+
+    return true ;
 }
 
 //! parses an closing xml tag
-void XmlReader::parseClosingXMLElement()
+bool XmlReader::parseClosingXMLElement()
 {
     current_node_type_ = EndElement;
 
     attrs_.clear() ;
-    advance() ;
 
-    current_node_name_.clear() ;
+    size_t end = find(2, '>') ;
 
-    while(*cp_ != '>')  {
-        current_node_name_ += *cp_ ;
-        advance() ;
-    }
+    if ( end == npos ) return false ;
+
+    const char *p = tok_ + 2, *e = tok_ + end ;
+
+    while ( e > p && isWhiteSpaceCharacter(e[-1]) ) --e ;
+
+    current_node_name_.assign(p, e) ;
 
-    advance() ;
+    cp_ = tok_ + end + 1 ;
+
+    return true ;
 }
 
 
-//! parses a possible CDATA section, returns false if begin was not a CDATA section
+//! parses a CDATA section
 bool XmlReader::parseCDATA()
 {
-    advance() ;
-
-    if ( !cp_ ) return false ;
+    size_t end = findSequence(9, "]]>", 3) ;
 
-    if ( *cp_ != '[') return false;
+    if ( end == npos ) return false ;
 
-    current_node_name_.clear() ;
+    current_node_name_.assign(tok_ + 9, tok_ + end) ;
     current_node_type_ = Characters;
 
-    // skip '<![CDATA['
-    int count=0;
-    while( *cp_ && count<8 )
-    {
-        advance() ;
-        ++count;
-    }
+    cp_ = tok_ + end + 3 ;
 
-    if (!cp_)  return true;
+    return true;
+}
 
-        // find end of CDATA
-    while( cp_ )
-    {
-        current_node_name_ += *cp_ ;
-        advance() ;
 
-        char la1, la2, la3 ;
+std::string XmlReader::attribute(const std::string &name, const std::string &def_val) const
+{
+    boost::string_ref key(name) ;
 
-        if (cp_ && *cp_ == ']' ) {
-            la1 = *cp_ ;
+    // the last occurrence wins
 
-            advance() ;
+    for( auto it = attrs_.rbegin() ; it != attrs_.rend() ; ++it )
+        if ( it->name_ == key ) return it->value_.to_string() ;
 
-            if ( cp_ && *cp_  == ']' ) {
-                 la2 = *cp_ ;
-                 advance() ;
+    return def_val ;
+}
 
-                 if ( cp_ && *cp_ == '>' )
-                 {
-                    advance() ;
-                    break ;
-                 }
-                 else
-                     current_node_name_ += *cp_ ;
+boost::string_ref XmlReader::attributeRef(const char *name) const
+{
+    boost::string_ref key(name) ;
 
-            }
-            else
-                current_node_name_ += *cp_ ;
+    for( auto it = attrs_.rbegin() ; it != attrs_.rend() ; ++it )
+        if ( it->name_ == key ) return it->value_ ;
 
-         }
+    return boost::string_ref() ;
+}
 
+std::map<string, string> XmlReader::attributes() const
+{
+    std::map<string, string> res ;
 
-    }
+    for( const Attribute &attr: attrs_ )
+        res[attr.name_.to_string()] = attr.value_.to_string() ;
 
-    return true;
+    return res ;
 }
 
-
-std::string XmlReader::attribute(const std::string &name, const std::string &def_val) const
+int XmlReader::currentLine() const
 {
-    map<string, string>::const_iterator it = attrs_.find(name) ;
-
-    if ( it == attrs_.end() ) return def_val ;
-    else return (*it).second ;
+    return lineno_ + std::count(line_pos_, cp_, '\n') ;
 }
 
 std::string XmlReader::elementText()
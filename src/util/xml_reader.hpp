@@ -4,8 +4,15 @@
 #include <istream>
 #include <map>
 #include <sstream>
+#include <vector>
 
-// Simple and fast XML pull style reader
+#include <boost/utility/string_ref.hpp>
+
+#include "mapped_file.hpp"
+
+// Simple and fast XML pull style reader. Files are mapped in memory and streams are read in large chunks, so that
+// each markup token is contiguous in memory and parsed in place. Attribute values are exposed as references into the
+// input buffer, the reader does not allocate memory per element.
 
 class XmlReader {
 public:
@@ -40,13 +47,19 @@ public:
     /**
      * @brief get the name of the current node (element name or text)
      */
-    std::string nodeName() const { return current_node_name_ ; }
+    const std::string &nodeName() const { return current_node_name_ ; }
 
     /**
      * @brief get attribute value with given name if tit exists otherwise return the default value
      */
     std::string attribute(const std::string &name, const std::string &val = std::string()) const ;
 
+    /**
+     * @brief get attribute value with given name as a reference into the reader buffer, valid until the next call
+     * to read(). An empty reference is returned if the attribute does not exist.
+     */
+    boost::string_ref attributeRef(const char *name) const ;
+
     /**
      * @brief return the text between start and end element nodes or an empty string in case a start element was found between
      */
@@ -63,37 +76,47 @@ public:
     bool isStartElement(const std::string &name = std::string()) ;
     bool isEndElement(const std::string &name = std::string()) ;
 
-    const std::map<std::string , std::string> &attributes() const { return attrs_ ; }
+    std::map<std::string , std::string> attributes() const ;
 
-    int currentLine() const { return lineno_ ; }
+    int currentLine() const ;
 
 private:
 
+    struct Attribute {
+        boost::string_ref name_, value_ ;
+    };
+
     bool parseCDATA();
-    void parseClosingXMLElement();
-    void parseOpeningXMLElement();
-    void parseComment();
-    void ignoreDefinition();
-    bool setText(char *start, char *end);
+    bool parseClosingXMLElement();
+    bool parseOpeningXMLElement();
+    bool parseComment();
+    bool ignoreDefinition();
+    bool setText(const char *start, const char *end);
     void parseCurrentNode();
 
-    void flush();
-    void advance();
+    // searches relative to the start of the current token, more input is loaded as needed
+    size_t find(size_t offset, char c) ;
+    size_t findAny(size_t offset, char a, char b, char c) ;
+    size_t findSequence(size_t offset, const char *seq, size_t len) ;
+    size_t findTagEnd(size_t offset) ;
+    bool ensure(size_t n) ;
+
+    bool refill() ;
 
 private:
-    char *cp_, *be_ ;
+    const char *cp_, *be_ ;     // current position and end of data
+    const char *tok_ ;          // start of the token being parsed
     std::string current_node_name_ ;
     NodeType current_node_type_ ;
-    char * buf_ ;
-    size_t buf_size_ ;
+    std::vector<char> buf_ ;    // stream input buffer
     std::istream *strm_ ;
-    FILE *fdesc_ ;
-    std::map<std::string, std::string> attrs_ ;
+    MappedFile file_ ;
+    bool eof_ ;                 // no more input beyond be_
+    std::vector<Attribute> attrs_ ;
+    std::string decoded_ ;      // storage for attribute values that contain entities
     bool is_empty_elem_ ;
-    int lineno_, colno_ ;
-
-
-
+    int lineno_ ;               // number of lines before line_pos_
+    const char *line_pos_ ;
 };
 
 
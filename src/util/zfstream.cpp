@@ -10,11 +10,15 @@
 #include "zfstream.hpp"
 #include <cstring>          // for strcpy, strcat, strlen (mode strings)
 #include <cstdio>           // for BUFSIZ
+#include <algorithm>        // for min
 
 #include <zlib.h>
 // Internal buffer sizes (default and "unbuffered" versions)
 #define BIGBUFSIZE BUFSIZ
 #define SMALLBUFSIZE 1
+// Size and number of chunks inflated ahead by the reader thread
+#define READ_AHEAD_CHUNK_SIZE (1024*1024)
+#define READ_AHEAD_CHUNKS 4
 
 //#pragma comment(lib, "zdll.lib")
 /*****************************************************************************/
@@ -23,7 +27,9 @@ using namespace std ;
 // Default constructor
 gzfilebuf::gzfilebuf()
 : file(NULL), io_mode(std::ios_base::openmode(0)), own_fd(false),
-  buffer(NULL), buffer_size(BIGBUFSIZE), own_buffer(true)
+  buffer(NULL), buffer_size(BIGBUFSIZE), own_buffer(true),
+  req_mode(read_ahead), cur_mode(read_sync), max_whole(256*1024*1024),
+  current_chunk(NULL), reader_done(false), reader_stop(false)
 {
   // No buffers to start with
   this->disable_buffer();
@@ -32,6 +38,8 @@ gzfilebuf::gzfilebuf()
 // Destructor
 gzfilebuf::~gzfilebuf()
 {
+  // The reader thread uses the file, stop it even if the file stays open
+  this->stop_read_ahead();
   // Sync output buffer and close only if responsible for file
   // (i.e. attached streams should be left open at this stage)
   this->sync();
@@ -49,6 +57,15 @@ gzfilebuf::setcompression(int comp_level,
   return gzsetparams((gzFile)file, comp_level, comp_strategy);
 }
 
+// Set decompression strategy
+void
+gzfilebuf::set_read_mode(read_mode mode,
+                         std::size_t max_whole_size)
+{
+  req_mode = mode;
+  max_whole = max_whole_size;
+}
+
 // Open gzipped file
 gzfilebuf*
 gzfilebuf::open(const char *name,
@@ -74,6 +91,21 @@ gzfilebuf::open(const char *name,
   this->enable_buffer();
   io_mode = mode;
   own_fd = true;
+
+  // Start decompressing ahead of the consumer
+  if (mode & std::ios_base::in)
+  {
+    if (req_mode == read_whole && this->load_whole(name))
+      cur_mode = read_whole;
+    else if (this->read_failed())
+    {
+      // load_whole hit an error part way, the stream can't be resumed
+      this->close();
+      return NULL;
+    }
+    else if (req_mode != read_sync)
+      this->start_read_ahead();
+  }
   return this;
 }
 
@@ -102,6 +134,10 @@ gzfilebuf::attach(int fd,
   this->enable_buffer();
   io_mode = mode;
   own_fd = false;
+
+  // Size of an attached file is unknown, so read_whole is not available
+  if ((mode & std::ios_base::in) && req_mode != read_sync)
+    this->start_read_ahead();
   return this;
 }
 
@@ -114,6 +150,11 @@ gzfilebuf::close()
     return NULL;
   // Assume success
   gzfilebuf* retval = this;
+  // Release decompression state before the file goes away
+  this->stop_read_ahead();
+  whole.clear();
+  whole.shrink_to_fit();
+  cur_mode = read_sync;
   // Attempt to sync and close gzipped file
   if (this->sync() == -1)
     retval = NULL;
@@ -195,6 +236,16 @@ gzfilebuf::underflow()
   if (!this->is_open() || !(io_mode & std::ios_base::in))
     return traits_type::eof();
 
+  // The whole file was the get area
+  if (cur_mode == read_whole)
+  {
+    this->setg(buffer, buffer, buffer);
+    return traits_type::eof();
+  }
+
+  if (cur_mode == read_ahead)
+    return this->underflow_read_ahead();
+
   // Attempt to fill internal buffer from gzipped file
   // (buffer must be guaranteed to exist...)
   int bytes_read = gzread((gzFile)file, buffer, buffer_size);
@@ -371,6 +422,173 @@ gzfilebuf::disable_buffer()
   }
 }
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Start the thread inflating chunks ahead of the consumer
+void
+gzfilebuf::start_read_ahead()
+{
+  reader_done = reader_stop = false;
+  current_chunk = NULL;
+  for (int i = 0; i < READ_AHEAD_CHUNKS; ++i)
+    free_chunks.push_back(new char_type[READ_AHEAD_CHUNK_SIZE]);
+  cur_mode = read_ahead;
+  reader = std::thread(&gzfilebuf::read_chunks, this);
+}
+
+// Stop the reader thread (if running) and release the chunks
+void
+gzfilebuf::stop_read_ahead()
+{
+  if (!reader.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(chunk_mutex);
+    reader_stop = true;
+    chunk_free.notify_all();
+  }
+  reader.join();
+
+  for (std::size_t i = 0; i < free_chunks.size(); ++i)
+    delete[] free_chunks[i];
+  for (std::size_t i = 0; i < filled_chunks.size(); ++i)
+    delete[] filled_chunks[i].first;
+  delete[] current_chunk;
+
+  free_chunks.clear();
+  filled_chunks.clear();
+  current_chunk = NULL;
+  cur_mode = read_sync;
+  // Get area may point into a released chunk
+  this->setg(buffer, buffer, buffer);
+}
+
+// Inflate into free chunks until EOF, error or stop request
+void
+gzfilebuf::read_chunks()
+{
+  std::unique_lock<std::mutex> lock(chunk_mutex);
+  while (true)
+  {
+    chunk_free.wait(lock, [this]() { return reader_stop || !free_chunks.empty(); });
+    if (reader_stop)
+      break;
+
+    char_type* chunk = free_chunks.back();
+    free_chunks.pop_back();
+
+    // Inflate without holding the lock
+    lock.unlock();
+    int bytes_read = gzread((gzFile)file, chunk, READ_AHEAD_CHUNK_SIZE);
+    lock.lock();
+
+    // Indicates error or EOF
+    if (bytes_read <= 0)
+    {
+      free_chunks.push_back(chunk);
+      break;
+    }
+    filled_chunks.push_back(std::make_pair(chunk, bytes_read));
+    chunk_ready.notify_one();
+  }
+  reader_done = true;
+  chunk_ready.notify_all();
+}
+
+// Make the next inflated chunk the get area
+gzfilebuf::int_type
+gzfilebuf::underflow_read_ahead()
+{
+  std::unique_lock<std::mutex> lock(chunk_mutex);
+
+  // The current chunk has been consumed, give it back to the reader
+  if (current_chunk)
+  {
+    free_chunks.push_back(current_chunk);
+    current_chunk = NULL;
+    chunk_free.notify_one();
+  }
+
+  chunk_ready.wait(lock, [this]() { return reader_done || !filled_chunks.empty(); });
+
+  if (filled_chunks.empty())
+  {
+    // Reset get area
+    this->setg(buffer, buffer, buffer);
+    return traits_type::eof();
+  }
+
+  current_chunk = filled_chunks.front().first;
+  int bytes_read = filled_chunks.front().second;
+  filled_chunks.pop_front();
+
+  this->setg(current_chunk, current_chunk, current_chunk + bytes_read);
+
+  // Return next character in get area
+  return traits_type::to_int_type(*(this->gptr()));
+}
+
+// Inflate the whole file into memory. The size is taken from the gzip trailer
+// (ISIZE, the size modulo 2^32 of the last member) and the buffer grows if this
+// turns out to be an underestimate, e.g. for multi-member files.
+bool
+gzfilebuf::load_whole(const char* name)
+{
+  FILE* fp = fopen(name, "rb");
+  if (!fp)
+    return false;
+
+  unsigned char trailer[4];
+  bool ok = (fseek(fp, -4, SEEK_END) == 0 && fread(trailer, 1, 4, fp) == 4);
+  fclose(fp);
+  if (!ok)
+    return false;
+
+  std::size_t size = (std::size_t)trailer[0] | ((std::size_t)trailer[1] << 8) |
+                     ((std::size_t)trailer[2] << 16) | ((std::size_t)trailer[3] << 24);
+  if (size == 0 || size > max_whole)
+    return false;
+
+  // Large reads are inflated by zlib straight into the destination
+  whole.resize(size);
+  std::size_t total = 0;
+  while (true)
+  {
+    if (total == whole.size())
+      whole.resize(2 * whole.size());
+
+    unsigned request = (unsigned)std::min<std::size_t>(whole.size() - total, 1u << 30);
+    int bytes_read = gzread((gzFile)file, &whole[total], request);
+    // Indicates error or EOF
+    if (bytes_read <= 0)
+    {
+      // Corrupt or truncated data must not pass for a shorter file
+      if (bytes_read < 0 || this->read_failed())
+      {
+        whole.clear();
+        whole.shrink_to_fit();
+        return false;
+      }
+      break;
+    }
+    total += bytes_read;
+  }
+  whole.resize(total);
+
+  // Make the whole file available as get area
+  this->setg(whole.data(), whole.data(), whole.data() + total);
+  return true;
+}
+
+// Check the error state of zlib
+bool
+gzfilebuf::read_failed() const
+{
+  int errnum = Z_OK;
+  gzerror((gzFile)file, &errnum);
+  return errnum != Z_OK;
+}
+
 /*****************************************************************************/
 
 // Default constructor initializes stream buffer
@@ -13,6 +13,11 @@
 #include <istream>  // not iostream, since we don't need cin/cout
 #include <ostream>
 #include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
 
 /*****************************************************************************/
 
@@ -56,6 +61,26 @@ public:
   bool
   is_open() const { return (file != NULL); }
 
+  /**
+   *  @brief  Decompression strategy used when reading.
+   *
+   *  read_sync inflates inside underflow. read_ahead (the default) inflates the
+   *  next chunks on a background thread while the current one is consumed.
+   *  read_whole inflates the whole file into a single buffer in one pass if its
+   *  uncompressed size is known and small enough, otherwise it behaves like
+   *  read_ahead.
+  */
+  enum read_mode { read_sync, read_ahead, read_whole };
+
+  /**
+   *  @brief  Set decompression strategy, applied by the next open/attach.
+   *  @param  mode  Read mode.
+   *  @param  max_whole_size  Largest uncompressed size loaded by read_whole.
+  */
+  void
+  set_read_mode(read_mode mode,
+                std::size_t max_whole_size = 256*1024*1024);
+
   /**
    *  @brief  Open gzipped file.
    *  @param  name  File name.
@@ -180,6 +205,48 @@ private:
   void
   disable_buffer();
 
+  /**
+   *  @brief  Start the read-ahead thread.
+  */
+  void
+  start_read_ahead();
+
+  /**
+   *  @brief  Stop the read-ahead thread and release its chunks.
+   *
+   *  This function is safe to call multiple times. It must be called before
+   *  the underlying file is closed.
+  */
+  void
+  stop_read_ahead();
+
+  /**
+   *  @brief  Body of the read-ahead thread.
+  */
+  void
+  read_chunks();
+
+  /**
+   *  @brief  Make the next chunk inflated by the read-ahead thread the get area.
+  */
+  int_type
+  underflow_read_ahead();
+
+  /**
+   *  @brief  Inflate the whole file into memory.
+   *  @param  name  File name, used to read the uncompressed size from the trailer.
+   *  @return  False if the size is unknown or too large (nothing is read), or
+   *           if the data is corrupt or truncated (see read_failed).
+  */
+  bool
+  load_whole(const char* name);
+
+  /**
+   *  @brief  Check whether zlib reported an error on the file.
+  */
+  bool
+  read_failed() const;
+
   /**
    *  Underlying file pointer.
   */
@@ -221,6 +288,31 @@ private:
    *  upon destruction.
   */
   bool own_buffer;
+
+  /**
+   *  Requested and active read modes.
+  */
+  read_mode req_mode, cur_mode;
+  std::size_t max_whole;
+
+  /**
+   *  @brief  Read-ahead state.
+   *
+   *  Chunks cycle from the free list to the filled queue (inflated by the
+   *  reader thread) to the get area and back to the free list.
+  */
+  std::thread reader;
+  std::mutex chunk_mutex;
+  std::condition_variable chunk_ready, chunk_free;
+  std::vector<char_type*> free_chunks;
+  std::deque<std::pair<char_type*, int> > filled_chunks;
+  char_type* current_chunk;
+  bool reader_done, reader_stop;
+
+  /**
+   *  Decompressed file in read_whole mode.
+  */
+  std::vector<char_type> whole;
 };
 
 /*****************************************************************************/
@@ -8,9 +8,12 @@ namespace fs = boost::filesystem ;
 
 using namespace std ;
 
-MBTileWriter::MBTileWriter(const std::string &fileName): tileset_(fileName)
+MBTileWriter::MBTileWriter(const std::string &fileName, bool update): tileset_(fileName)
 {
-    if ( !fs::is_directory(fileName) ) {
+    if ( update && fs::is_regular_file(fileName) ) {
+        db_.reset(new SQLite::Database(fileName)) ;
+    }
+    else if ( !fs::is_directory(fileName) ) {
         if ( fs::exists(fileName) ) fs::remove(fileName);
 
         db_.reset(new SQLite::Database(fileName)) ;
@@ -145,3 +148,103 @@ bool MBTileWriter::writeTilesFolder(const MapFile &map, MapConfig &cfg)
     return true ;
 
 }
+
+// test if tile is within the zoom range and extent of the map
+
+static bool tile_in_range(const MapConfig &cfg, const TileKey &tile)
+{
+    int z = tile.z_ ;
+    if ( z < cfg.minz_ || z > cfg.maxz_ ) return false ;
+
+    uint32_t x0, y0, x1, y1 ;
+    tms::metersToTile(cfg.bbox_.minx_, cfg.bbox_.miny_, tile.z_, x0, y0) ;
+    tms::metersToTile(cfg.bbox_.maxx_, cfg.bbox_.maxy_, tile.z_, x1, y1) ;
+
+    return tile.x_ >= x0 && tile.x_ <= x1 && tile.y_ >= y0 && tile.y_ <= y1 ;
+}
+
+bool MBTileWriter::writeTilesDB(const MapFile &map, MapConfig &cfg, const TileSet &tiles)
+{
+    assert(db_) ;
+
+    SQLite::Session session(db_.get()) ;
+    SQLite::Connection &con = session.handle() ;
+
+    try {
+
+        SQLite::Transaction trans(con) ;
+        SQLite::Command cmd(con, "REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?,?,?,?);") ;
+        SQLite::Command del_cmd(con, "DELETE FROM tiles WHERE zoom_level=? AND tile_column=? AND tile_row=?;") ;
+
+        for( const TileKey &tile: tiles )
+        {
+            if ( !tile_in_range(cfg, tile) ) continue ;
+
+            VectorTileWriter vt(tile.x_, tile.y_, tile.z_) ;
+
+            if ( map.queryTile(cfg, vt) ) {
+
+                string data = vt.toString() ;
+
+                cmd.bind((int)tile.z_) ;
+                cmd.bind((int)tile.x_) ;
+                cmd.bind((int)tile.y_) ;
+                cmd.bind(data.data(), data.size()) ;
+
+                cmd.exec() ;
+                cmd.clear() ;
+            }
+            else {
+                del_cmd.bind((int)tile.z_) ;
+                del_cmd.bind((int)tile.x_) ;
+                del_cmd.bind((int)tile.y_) ;
+
+                del_cmd.exec() ;
+                del_cmd.clear() ;
+            }
+        }
+
+        trans.commit() ;
+
+        return true ;
+    }
+    catch ( SQLite::Exception &e )
+    {
+        cerr << e.what() << endl ;
+        return false ;
+    }
+}
+
+bool MBTileWriter::writeTilesFolder(const MapFile &map, MapConfig &cfg, const TileSet &tiles)
+{
+    for( const TileKey &t: tiles )
+    {
+        if ( !tile_in_range(cfg, t) ) continue ;
+
+        VectorTileWriter vt(t.x_, t.y_, t.z_) ;
+
+        fs::path tile(tileset_) ;
+
+        tile /= to_string(t.z_) ;
+        tile /= to_string(t.x_) ;
+
+        if ( map.queryTile(cfg, vt) ) {
+
+            string data = vt.toString() ;
+
+            fs::create_directories(tile) ;
+
+            tile /= to_string(t.y_) + ".pbf";
+
+            ofstream strm(tile.native().c_str(), ios::binary) ;
+            strm.write(data.data(), data.size()) ;
+        }
+        else {
+            tile /= to_string(t.y_) + ".pbf";
+
+            fs::remove(tile) ;
+        }
+    }
+
+    return true ;
+}
@@ -2,15 +2,21 @@
 #define __MBTILE_WRITER_H__
 
 #include "map_file.hpp"
+#include "tile_set.hpp"
 #include <boost/filesystem.hpp>
 
 class MBTileWriter {
 public:
-    MBTileWriter(const std::string &fileName) ;
+    // an existing tileset is deleted unless update is set
+    MBTileWriter(const std::string &fileName, bool update = false) ;
 
     bool writeTilesDB(const MapFile &map, MapConfig &cfg) ;
     bool writeTilesFolder(const MapFile &map, MapConfig &cfg) ;
 
+    // regenerate only the given tiles (within the zoom range and extent of the map), tiles left without data are removed
+    bool writeTilesDB(const MapFile &map, MapConfig &cfg, const TileSet &tiles) ;
+    bool writeTilesFolder(const MapFile &map, MapConfig &cfg, const TileSet &tiles) ;
+
     bool writeMetaData(const std::string &name, const std::string &val);
 
 private: